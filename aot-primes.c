@@ -0,0 +1,271 @@
+/* Generated by aotc, do not edit */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "common.h"
+
+/* Stack capacity the program was compiled for */
+#define STACK_SIZE 32
+static _Alignas(CACHE_LINE_SIZE) uint32_t stack[STACK_SIZE];
+
+/* Stack slots relative to SP at the start of a block */
+#define S(k) stack[sp + (k)]
+
+#define PUSH(v) do { uint32_t v_ = (v); \
+    if (sp >= STACK_SIZE-1) { printf("Stack overflow\n"); state = Cpu_Break; } \
+    else stack[++sp] = v_; } while (0)
+#define POP() (sp < 0 ? (printf("Stack underflow\n"), state = Cpu_Break, 0u) \
+                      : stack[sp--])
+#define PICK(pos) (sp - 1 < (int32_t)(pos) \
+    ? (printf("Out of bound picking\n"), state = Cpu_Break, 0u) \
+    : stack[sp - (int32_t)(pos)])
+
+int main(int argc, char **argv) {
+    uint64_t steplimit = parse_args(argc, argv);
+    int32_t sp = -1;
+    uint64_t steps = 0;
+    uint32_t pc = 0;
+    cpu_state_t state = Cpu_Running;
+
+L_0:
+    if ((uint32_t)(sp - (-1)) > 30u || steps + 2 > steplimit) goto slow_0;
+    /* 0: Push */
+    S(1) = 100000u;
+    /* 0x2: Push */
+    S(2) = 2u;
+    sp += 2; steps += 2; goto L_4;
+slow_0:
+    /* 0: Push */
+    if (steps >= steplimit) { pc = 0; goto done; }
+    PUSH(100000u);
+    steps++;
+    if (state != Cpu_Running) { pc = 0x2; goto done; }
+    /* 0x2: Push */
+    if (steps >= steplimit) { pc = 0x2; goto done; }
+    PUSH(2u);
+    steps++;
+    if (state != Cpu_Running) { pc = 0x4; goto done; }
+    goto L_4;
+
+L_4:
+    if ((uint32_t)(sp - (1)) > 28u || steps + 4 > steplimit) goto slow_4;
+    /* 0x4: Over */
+    S(1) = S(-1);
+    /* 0x5: Over */
+    S(2) = S(0);
+    /* 0x6: Sub */
+    S(1) = S(2) - S(1);
+    /* 0x7: JE */
+    { uint32_t v = S(1); sp += 0; steps += 4;
+      if (v == 0) goto L_32; }
+    goto L_9;
+slow_4:
+    /* 0x4: Over */
+    if (steps >= steplimit) { pc = 0x4; goto done; }
+    { uint32_t t1 = POP(), t2 = POP(); if (state == Cpu_Running) { PUSH(t2); PUSH(t1); PUSH(t2); } }
+    steps++;
+    if (state != Cpu_Running) { pc = 0x5; goto done; }
+    /* 0x5: Over */
+    if (steps >= steplimit) { pc = 0x5; goto done; }
+    { uint32_t t1 = POP(), t2 = POP(); if (state == Cpu_Running) { PUSH(t2); PUSH(t1); PUSH(t2); } }
+    steps++;
+    if (state != Cpu_Running) { pc = 0x6; goto done; }
+    /* 0x6: Sub */
+    if (steps >= steplimit) { pc = 0x6; goto done; }
+    { uint32_t t1 = POP(), t2 = POP(); if (state == Cpu_Running) PUSH(t1 - t2); }
+    steps++;
+    if (state != Cpu_Running) { pc = 0x7; goto done; }
+    /* 0x7: JE */
+    if (steps >= steplimit) { pc = 0x7; goto done; }
+    { uint32_t t1 = POP(); steps++;
+      if (state != Cpu_Running) { pc = 0x9; goto done; }
+      if (t1 == 0) goto L_32; }
+    goto L_9;
+
+L_9:
+    if ((uint32_t)(sp - (-1)) > 31u || steps + 1 > steplimit) goto slow_9;
+    /* 0x9: Push */
+    S(1) = 2u;
+    sp += 1; steps += 1; goto L_11;
+slow_9:
+    /* 0x9: Push */
+    if (steps >= steplimit) { pc = 0x9; goto done; }
+    PUSH(2u);
+    steps++;
+    if (state != Cpu_Running) { pc = 0xb; goto done; }
+    goto L_11;
+
+L_11:
+    if ((uint32_t)(sp - (1)) > 28u || steps + 5 > steplimit) goto slow_11;
+    /* 0xb: Over */
+    S(1) = S(-1);
+    /* 0xc: Over */
+    S(2) = S(0);
+    /* 0xd: Swap */
+    { uint32_t t = S(2); S(2) = S(1); S(1) = t; }
+    /* 0xe: Sub */
+    S(1) = S(2) - S(1);
+    /* 0xf: JE */
+    { uint32_t v = S(1); sp += 0; steps += 5;
+      if (v == 0) goto L_26; }
+    goto L_17;
+slow_11:
+    /* 0xb: Over */
+    if (steps >= steplimit) { pc = 0xb; goto done; }
+    { uint32_t t1 = POP(), t2 = POP(); if (state == Cpu_Running) { PUSH(t2); PUSH(t1); PUSH(t2); } }
+    steps++;
+    if (state != Cpu_Running) { pc = 0xc; goto done; }
+    /* 0xc: Over */
+    if (steps >= steplimit) { pc = 0xc; goto done; }
+    { uint32_t t1 = POP(), t2 = POP(); if (state == Cpu_Running) { PUSH(t2); PUSH(t1); PUSH(t2); } }
+    steps++;
+    if (state != Cpu_Running) { pc = 0xd; goto done; }
+    /* 0xd: Swap */
+    if (steps >= steplimit) { pc = 0xd; goto done; }
+    { uint32_t t1 = POP(), t2 = POP(); if (state == Cpu_Running) { PUSH(t1); PUSH(t2); } }
+    steps++;
+    if (state != Cpu_Running) { pc = 0xe; goto done; }
+    /* 0xe: Sub */
+    if (steps >= steplimit) { pc = 0xe; goto done; }
+    { uint32_t t1 = POP(), t2 = POP(); if (state == Cpu_Running) PUSH(t1 - t2); }
+    steps++;
+    if (state != Cpu_Running) { pc = 0xf; goto done; }
+    /* 0xf: JE */
+    if (steps >= steplimit) { pc = 0xf; goto done; }
+    { uint32_t t1 = POP(); steps++;
+      if (state != Cpu_Running) { pc = 0x11; goto done; }
+      if (t1 == 0) goto L_26; }
+    goto L_17;
+
+L_17:
+    if ((uint32_t)(sp - (1)) > 28u || steps + 5 > steplimit) goto slow_17;
+    /* 0x11: Over */
+    S(1) = S(-1);
+    /* 0x12: Over */
+    S(2) = S(0);
+    /* 0x13: Swap */
+    { uint32_t t = S(2); S(2) = S(1); S(1) = t; }
+    /* 0x14: Mod */
+    if (S(1) == 0) { sp += 0; steps += 4; pc = 0x15; state = Cpu_Break; goto done; }
+    S(1) = S(2) % S(1);
+    /* 0x15: JE */
+    { uint32_t v = S(1); sp += 0; steps += 5;
+      if (v == 0) goto L_28; }
+    goto L_23;
+slow_17:
+    /* 0x11: Over */
+    if (steps >= steplimit) { pc = 0x11; goto done; }
+    { uint32_t t1 = POP(), t2 = POP(); if (state == Cpu_Running) { PUSH(t2); PUSH(t1); PUSH(t2); } }
+    steps++;
+    if (state != Cpu_Running) { pc = 0x12; goto done; }
+    /* 0x12: Over */
+    if (steps >= steplimit) { pc = 0x12; goto done; }
+    { uint32_t t1 = POP(), t2 = POP(); if (state == Cpu_Running) { PUSH(t2); PUSH(t1); PUSH(t2); } }
+    steps++;
+    if (state != Cpu_Running) { pc = 0x13; goto done; }
+    /* 0x13: Swap */
+    if (steps >= steplimit) { pc = 0x13; goto done; }
+    { uint32_t t1 = POP(), t2 = POP(); if (state == Cpu_Running) { PUSH(t1); PUSH(t2); } }
+    steps++;
+    if (state != Cpu_Running) { pc = 0x14; goto done; }
+    /* 0x14: Mod */
+    if (steps >= steplimit) { pc = 0x14; goto done; }
+    { uint32_t t1 = POP(), t2 = POP(); if (state == Cpu_Running) { if (t2 == 0) state = Cpu_Break; else PUSH(t1 % t2); } }
+    steps++;
+    if (state != Cpu_Running) { pc = 0x15; goto done; }
+    /* 0x15: JE */
+    if (steps >= steplimit) { pc = 0x15; goto done; }
+    { uint32_t t1 = POP(); steps++;
+      if (state != Cpu_Running) { pc = 0x17; goto done; }
+      if (t1 == 0) goto L_28; }
+    goto L_23;
+
+L_23:
+    if ((uint32_t)(sp - (0)) > 31u || steps + 2 > steplimit) goto slow_23;
+    /* 0x17: Inc */
+    S(0) += 1;
+    /* 0x18: Jump */
+    sp += 0; steps += 2; goto L_11;
+slow_23:
+    /* 0x17: Inc */
+    if (steps >= steplimit) { pc = 0x17; goto done; }
+    { uint32_t t1 = POP(); if (state == Cpu_Running) PUSH(t1 + 1); }
+    steps++;
+    if (state != Cpu_Running) { pc = 0x18; goto done; }
+    /* 0x18: Jump */
+    if (steps >= steplimit) { pc = 0x18; goto done; }
+    steps++; goto L_11;
+
+L_26:
+    if ((uint32_t)(sp - (1)) > 29u || steps + 2 > steplimit) goto slow_26;
+    /* 0x1a: Over */
+    S(1) = S(-1);
+    /* 0x1b: Print */
+    printf("[%d]\n", S(1));
+    sp += 0; steps += 2; goto L_28;
+slow_26:
+    /* 0x1a: Over */
+    if (steps >= steplimit) { pc = 0x1a; goto done; }
+    { uint32_t t1 = POP(), t2 = POP(); if (state == Cpu_Running) { PUSH(t2); PUSH(t1); PUSH(t2); } }
+    steps++;
+    if (state != Cpu_Running) { pc = 0x1b; goto done; }
+    /* 0x1b: Print */
+    if (steps >= steplimit) { pc = 0x1b; goto done; }
+    { uint32_t t1 = POP(); if (state == Cpu_Running) printf("[%d]\n", t1); }
+    steps++;
+    if (state != Cpu_Running) { pc = 0x1c; goto done; }
+    goto L_28;
+
+L_28:
+    if ((uint32_t)(sp - (1)) > 30u || steps + 3 > steplimit) goto slow_28;
+    /* 0x1c: Drop */
+    /* 0x1d: Inc */
+    S(-1) += 1;
+    /* 0x1e: Jump */
+    sp += -1; steps += 3; goto L_4;
+slow_28:
+    /* 0x1c: Drop */
+    if (steps >= steplimit) { pc = 0x1c; goto done; }
+    (void)POP();
+    steps++;
+    if (state != Cpu_Running) { pc = 0x1d; goto done; }
+    /* 0x1d: Inc */
+    if (steps >= steplimit) { pc = 0x1d; goto done; }
+    { uint32_t t1 = POP(); if (state == Cpu_Running) PUSH(t1 + 1); }
+    steps++;
+    if (state != Cpu_Running) { pc = 0x1e; goto done; }
+    /* 0x1e: Jump */
+    if (steps >= steplimit) { pc = 0x1e; goto done; }
+    steps++; goto L_4;
+
+L_32:
+    if ((uint32_t)(sp - (-1)) > 32u || steps + 1 > steplimit) goto slow_32;
+    /* 0x20: Halt */
+    sp += 0; steps += 1; pc = 0x21; state = Cpu_Halted; goto done;
+slow_32:
+    /* 0x20: Halt */
+    if (steps >= steplimit) { pc = 0x20; goto done; }
+    state = Cpu_Halted;
+    steps++;
+    if (state != Cpu_Running) { pc = 0x21; goto done; }
+
+done:
+    printf("CPU executed %ld steps. End state \"%s\".\n",
+            steps, state == Cpu_Halted? "Halted":
+                   state == Cpu_Running? "Running": "Break");
+    printf("PC = %#x, SP = %d\n", pc, sp);
+    printf("Stack: ");
+    for (int32_t i=sp; i >= 0 ; i--) {
+        printf("%#10x ", stack[i]);
+    }
+    printf("%s\n", sp == -1? "(empty)": "");
+
+    unload_program();
+
+    return state == Cpu_Halted ||
+           (state == Cpu_Running &&
+            steps == steplimit)?0:1;
+}
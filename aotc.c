@@ -0,0 +1,544 @@
+/*  aotc.c - an ahead-of-time compiler of programs for a stack virtual machine
+    into C.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* Translates a program, the default one or one given with --inp-prog,
+   into a C translation unit printed to stdout. The unit has a label for
+   every basic block of the program and keeps the guest stack in local
+   variables. Built with common.c, it runs the program with the same
+   results as switched. Usage: aotc [--inp-prog=<file>] > program.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+/* The stack capacity is chosen when the program is compiled */
+static int32_t stack_capacity;
+/* All indexed by PC */
+static uint32_t program_size;
+static decode_t *decoded;
+static bool *truncated; /* the immediate is out of bounds */
+static bool *reachable;
+static bool *leader;
+static bool uses_out_of_bounds = false;
+
+static void decode_program(const Instr_t *prog) {
+    for (uint32_t pc = 0; pc < program_size; pc++) {
+        decode_t *d = &decoded[pc];
+        d->opcode = prog[pc];
+        d->length = 1;
+        switch (d->opcode) {
+        case Instr_Push: case Instr_JNE: case Instr_JE: case Instr_Jump:
+            if (!(pc + 1 < program_size)) {
+                truncated[pc] = true;
+                d->opcode = Instr_Break;
+                break;
+            }
+            d->length = 2;
+            d->immediate = (int32_t)prog[pc + 1];
+            break;
+        default:
+            if (d->opcode > Instr_Pick) /* Undefined instructions are Break */
+                d->opcode = Instr_Break;
+            break;
+        }
+    }
+}
+
+static bool ends_block(Instr_t opcode) {
+    return opcode == Instr_JE || opcode == Instr_JNE || opcode == Instr_Jump
+           || opcode == Instr_Halt || opcode == Instr_Break;
+}
+
+static uint32_t target_of(uint32_t pc) {
+    return pc + decoded[pc].length + decoded[pc].immediate;
+}
+
+/* Find code reachable from the start and the leaders of its blocks */
+static void find_blocks() {
+    /* Every reachable instruction adds at most two PCs */
+    uint32_t *worklist = malloc((2 * (size_t)program_size + 1)
+                                * sizeof(uint32_t));
+    if (!worklist) {
+        fprintf(stderr, "Failed to allocate memory for the worklist.\n");
+        exit(2);
+    }
+    size_t count = 0;
+    worklist[count++] = 0;
+    leader[0] = true;
+    while (count > 0) {
+        uint32_t pc = worklist[--count];
+        if (reachable[pc])
+            continue;
+        reachable[pc] = true;
+        const decode_t *d = &decoded[pc];
+        uint32_t successors[2];
+        int successors_count = 0;
+        switch (d->opcode) {
+        case Instr_Halt:
+        case Instr_Break:
+            break;
+        case Instr_JE:
+        case Instr_JNE:
+            successors[successors_count++] = pc + d->length;
+            /* fallthrough */
+        case Instr_Jump:
+            successors[successors_count++] = target_of(pc);
+            for (int i = 0; i < successors_count; i++)
+                if (successors[i] < program_size)
+                    leader[successors[i]] = true;
+            break;
+        default:
+            successors[successors_count++] = pc + d->length;
+            break;
+        }
+        for (int i = 0; i < successors_count; i++)
+            if (successors[i] < program_size && !reachable[successors[i]])
+                worklist[count++] = successors[i];
+    }
+    free(worklist);
+}
+
+/* Stack values consumed and produced by an instruction */
+static void stack_effect(Instr_t opcode, int *needs, int *results) {
+    switch (opcode) {
+    case Instr_Push: case Instr_Rand:
+        *needs = 0; *results = 1; break;
+    case Instr_Print: case Instr_Drop: case Instr_JE: case Instr_JNE:
+        *needs = 1; *results = 0; break;
+    case Instr_Inc: case Instr_Dec: case Instr_SQRT: case Instr_Pick:
+        *needs = 1; *results = 1; break;
+    case Instr_Dup:
+        *needs = 1; *results = 2; break;
+    case Instr_Swap:
+        *needs = 2; *results = 2; break;
+    case Instr_Over:
+        *needs = 2; *results = 3; break;
+    case Instr_Add: case Instr_Sub: case Instr_Mul: case Instr_Mod:
+    case Instr_And: case Instr_Or: case Instr_Xor:
+    case Instr_SHL: case Instr_SHR:
+        *needs = 2; *results = 1; break;
+    case Instr_Rot:
+        *needs = 3; *results = 3; break;
+    default: /* Nop, Jump, Halt, Break */
+        *needs = 0; *results = 0; break;
+    }
+}
+
+static const char* binary_operator(Instr_t opcode) {
+    switch (opcode) {
+    case Instr_Add: return "+";
+    case Instr_Sub: return "-";
+    case Instr_Mul: return "*";
+    case Instr_Mod: return "%";
+    case Instr_And: return "&";
+    case Instr_Or:  return "|";
+    case Instr_Xor: return "^";
+    case Instr_SHL: return "<<";
+    case Instr_SHR: return ">>";
+    default: return NULL;
+    }
+}
+
+/* Shift counts are masked as x86 does it in the interpreters, otherwise
+   the C compiler is free to fold shifts of constants by 32 and more
+   to anything */
+
+/* A jump to the block at pc */
+static void emit_goto(uint32_t pc) {
+    if (pc < program_size) {
+        printf("goto L_%u;", pc);
+    } else {
+        printf("{ pc = %#x; goto out_of_bounds; }", pc);
+        uses_out_of_bounds = true;
+    }
+}
+
+/* Instructions of the block at pc, up to the next block */
+static int block_length(uint32_t pc) {
+    int length = 0;
+    do {
+        length++;
+        if (ends_block(decoded[pc].opcode))
+            break;
+        pc += decoded[pc].length;
+    } while (pc < program_size && !leader[pc]);
+    return length;
+}
+
+/* Fast path of a block: stack bounds and the step limit are checked
+   once for the whole block, stack slots are addressed relative to SP
+   at the block start */
+static void emit_fast_block(uint32_t start, int length) {
+    int depth = 0, lowest = -1, highest = 0;
+    uint32_t pc = start;
+    for (int i = 0; i < length; i++) {
+        int needs, results;
+        stack_effect(decoded[pc].opcode, &needs, &results);
+        if (needs - 1 - depth > lowest)
+            lowest = needs - 1 - depth;
+        depth += results - needs;
+        if (depth > highest)
+            highest = depth;
+        pc += decoded[pc].length;
+    }
+    const int lo = lowest, hi = stack_capacity - 1 - highest;
+    printf("L_%u:\n", start);
+    if (hi < lo)
+        printf("    goto slow_%u;\n", start);
+    else
+        printf("    if ((uint32_t)(sp - (%d)) > %uu || steps + %d > steplimit)"
+               " goto slow_%u;\n", lo, (uint32_t)(hi - lo), length, start);
+
+    int d = 0;
+    pc = start;
+    for (int i = 0; i < length; i++) {
+        const decode_t *dec = &decoded[pc];
+        const uint32_t next = pc + dec->length;
+        const char *op = binary_operator(dec->opcode);
+        printf("    /* %#x: %s */\n", pc, InstrNames[dec->opcode]);
+        switch (dec->opcode) {
+        case Instr_Nop:
+            break;
+        case Instr_Push:
+            printf("    S(%d) = %uu;\n", d + 1, (uint32_t)dec->immediate);
+            d++;
+            break;
+        case Instr_Print:
+            printf("    printf(\"[%%d]\\n\", S(%d));\n", d);
+            d--;
+            break;
+        case Instr_Swap:
+            printf("    { uint32_t t = S(%d); S(%d) = S(%d); S(%d) = t; }\n",
+                   d, d, d - 1, d - 1);
+            break;
+        case Instr_Dup:
+            printf("    S(%d) = S(%d);\n", d + 1, d);
+            d++;
+            break;
+        case Instr_Over:
+            printf("    S(%d) = S(%d);\n", d + 1, d - 1);
+            d++;
+            break;
+        case Instr_Inc:
+            printf("    S(%d) += 1;\n", d);
+            break;
+        case Instr_Dec:
+            printf("    S(%d) -= 1;\n", d);
+            break;
+        case Instr_Mod:
+            printf("    if (S(%d) == 0) { sp += %d; steps += %d; pc = %#x;"
+                   " state = Cpu_Break; goto done; }\n",
+                   d - 1, d - 2, i + 1, next);
+            /* fallthrough */
+        case Instr_Add: case Instr_Sub: case Instr_Mul:
+        case Instr_And: case Instr_Or: case Instr_Xor:
+        case Instr_SHL: case Instr_SHR:
+            if (dec->opcode == Instr_SHL || dec->opcode == Instr_SHR)
+                printf("    S(%d) = S(%d) %s (S(%d) & 31);\n", d - 1, d, op, d - 1);
+            else
+                printf("    S(%d) = S(%d) %s S(%d);\n", d - 1, d, op, d - 1);
+            d--;
+            break;
+        case Instr_Rand:
+            printf("    S(%d) = rand();\n", d + 1);
+            d++;
+            break;
+        case Instr_Drop:
+            d--;
+            break;
+        case Instr_Rot:
+            printf("    { uint32_t t1 = S(%d), t2 = S(%d), t3 = S(%d);"
+                   " S(%d) = t1; S(%d) = t3; S(%d) = t2; }\n",
+                   d, d - 1, d - 2, d - 2, d - 1, d);
+            break;
+        case Instr_SQRT:
+            printf("    S(%d) = sqrt(S(%d));\n", d, d);
+            break;
+        case Instr_Pick:
+            printf("    { int32_t pos = S(%d);\n"
+                   "      if (sp + %d < pos) { printf(\"Out of bound picking\\n\");"
+                   " S(%d) = 0; sp += %d; steps += %d; pc = %#x;"
+                   " state = Cpu_Break; goto done; }\n"
+                   "      S(%d) = S(%d - pos); }\n",
+                   d, d - 2, d, d, i + 1, next, d, d - 1);
+            break;
+        case Instr_Halt:
+        case Instr_Break:
+            if (truncated[pc])
+                printf("    printf(\"PC+1 out of bounds\\n\");\n");
+            printf("    sp += %d; steps += %d; pc = %#x; state = %s; goto done;\n",
+                   d, i + 1, next,
+                   dec->opcode == Instr_Halt ? "Cpu_Halted" : "Cpu_Break");
+            break;
+        case Instr_JE:
+        case Instr_JNE:
+            printf("    { uint32_t v = S(%d); sp += %d; steps += %d;\n"
+                   "      if (v %s 0) ", d, d - 1, length,
+                   dec->opcode == Instr_JE ? "==" : "!=");
+            emit_goto(target_of(pc));
+            printf(" }\n    ");
+            emit_goto(next);
+            printf("\n");
+            break;
+        case Instr_Jump:
+            printf("    sp += %d; steps += %d; ", d, length);
+            emit_goto(target_of(pc));
+            printf("\n");
+            break;
+        default:
+            assert("Unreachable" && false);
+            break;
+        }
+        pc = next;
+    }
+    /* Blocks not ending with a branch fall through to the next one */
+    uint32_t last = start;
+    for (int i = 0; i < length - 1; i++)
+        last += decoded[last].length;
+    if (!ends_block(decoded[last].opcode)) {
+        printf("    sp += %d; steps += %d; ", d, length);
+        emit_goto(pc);
+        printf("\n");
+    }
+}
+
+/* Slow path of a block: every instruction is checked as in switched */
+static void emit_slow_block(uint32_t start, int length) {
+    printf("slow_%u:\n", start);
+    uint32_t pc = start;
+    for (int i = 0; i < length; i++) {
+        const decode_t *dec = &decoded[pc];
+        const uint32_t next = pc + dec->length;
+        const char *op = binary_operator(dec->opcode);
+        printf("    /* %#x: %s */\n", pc, InstrNames[dec->opcode]);
+        printf("    if (steps >= steplimit) { pc = %#x; goto done; }\n", pc);
+        switch (dec->opcode) {
+        case Instr_Nop:
+            break;
+        case Instr_Halt:
+            printf("    state = Cpu_Halted;\n");
+            break;
+        case Instr_Push:
+            printf("    PUSH(%uu);\n", (uint32_t)dec->immediate);
+            break;
+        case Instr_Print:
+            printf("    { uint32_t t1 = POP();"
+                   " if (state == Cpu_Running) printf(\"[%%d]\\n\", t1); }\n");
+            break;
+        case Instr_Swap:
+            printf("    { uint32_t t1 = POP(), t2 = POP();"
+                   " if (state == Cpu_Running) { PUSH(t1); PUSH(t2); } }\n");
+            break;
+        case Instr_Dup:
+            printf("    { uint32_t t1 = POP();"
+                   " if (state == Cpu_Running) { PUSH(t1); PUSH(t1); } }\n");
+            break;
+        case Instr_Over:
+            printf("    { uint32_t t1 = POP(), t2 = POP();"
+                   " if (state == Cpu_Running) { PUSH(t2); PUSH(t1); PUSH(t2); } }\n");
+            break;
+        case Instr_Inc:
+            printf("    { uint32_t t1 = POP();"
+                   " if (state == Cpu_Running) PUSH(t1 + 1); }\n");
+            break;
+        case Instr_Dec:
+            printf("    { uint32_t t1 = POP();"
+                   " if (state == Cpu_Running) PUSH(t1 - 1); }\n");
+            break;
+        case Instr_Drop:
+            printf("    (void)POP();\n");
+            break;
+        case Instr_Mod:
+            printf("    { uint32_t t1 = POP(), t2 = POP();"
+                   " if (state == Cpu_Running) {"
+                   " if (t2 == 0) state = Cpu_Break; else PUSH(t1 %% t2); } }\n");
+            break;
+        case Instr_Add: case Instr_Sub: case Instr_Mul:
+        case Instr_And: case Instr_Or: case Instr_Xor:
+            printf("    { uint32_t t1 = POP(), t2 = POP();"
+                   " if (state == Cpu_Running) PUSH(t1 %s t2); }\n", op);
+            break;
+        case Instr_SHL: case Instr_SHR:
+            printf("    { uint32_t t1 = POP(), t2 = POP();"
+                   " if (state == Cpu_Running) PUSH(t1 %s (t2 & 31)); }\n", op);
+            break;
+        case Instr_Rand:
+            printf("    PUSH(rand());\n");
+            break;
+        case Instr_Rot:
+            printf("    { uint32_t t1 = POP(), t2 = POP(), t3 = POP();"
+                   " if (state == Cpu_Running) { PUSH(t1); PUSH(t3); PUSH(t2); } }\n");
+            break;
+        case Instr_SQRT:
+            printf("    { uint32_t t1 = POP();"
+                   " if (state == Cpu_Running) PUSH(sqrt(t1)); }\n");
+            break;
+        case Instr_Pick:
+            printf("    { uint32_t t1 = POP();"
+                   " if (state == Cpu_Running) { uint32_t t2 = PICK(t1); PUSH(t2); } }\n");
+            break;
+        case Instr_Break:
+            if (truncated[pc])
+                printf("    printf(\"PC+1 out of bounds\\n\");\n");
+            printf("    state = Cpu_Break;\n");
+            break;
+        case Instr_JE:
+        case Instr_JNE:
+            printf("    { uint32_t t1 = POP(); steps++;\n"
+                   "      if (state != Cpu_Running) { pc = %#x; goto done; }\n"
+                   "      if (t1 %s 0) ", next,
+                   dec->opcode == Instr_JE ? "==" : "!=");
+            emit_goto(target_of(pc));
+            printf(" }\n    ");
+            emit_goto(next);
+            printf("\n");
+            return;
+        case Instr_Jump:
+            printf("    steps++; ");
+            emit_goto(target_of(pc));
+            printf("\n");
+            return;
+        default:
+            assert("Unreachable" && false);
+            break;
+        }
+        printf("    steps++;\n");
+        printf("    if (state != Cpu_Running) { pc = %#x; goto done; }\n", next);
+        if (dec->opcode == Instr_Halt || dec->opcode == Instr_Break)
+            return;
+        pc = next;
+    }
+    printf("    ");
+    emit_goto(pc);
+    printf("\n");
+}
+
+static void emit_prologue() {
+    printf(
+"/* Generated by aotc, do not edit */\n"
+"\n"
+"#include <stdio.h>\n"
+"#include <stdint.h>\n"
+"#include <stdlib.h>\n"
+"#include <math.h>\n"
+"\n"
+"#include \"common.h\"\n"
+"\n"
+"/* Stack capacity the program was compiled for */\n"
+"#define STACK_SIZE %d\n"
+"static _Alignas(CACHE_LINE_SIZE) uint32_t stack[STACK_SIZE];\n"
+"\n"
+"/* Stack slots relative to SP at the start of a block */\n"
+"#define S(k) stack[sp + (k)]\n"
+"\n"
+"#define PUSH(v) do { uint32_t v_ = (v); \\\n"
+"    if (sp >= STACK_SIZE-1) { printf(\"Stack overflow\\n\"); state = Cpu_Break; } \\\n"
+"    else stack[++sp] = v_; } while (0)\n"
+"#define POP() (sp < 0 ? (printf(\"Stack underflow\\n\"), state = Cpu_Break, 0u) \\\n"
+"                      : stack[sp--])\n"
+"#define PICK(pos) (sp - 1 < (int32_t)(pos) \\\n"
+"    ? (printf(\"Out of bound picking\\n\"), state = Cpu_Break, 0u) \\\n"
+"    : stack[sp - (int32_t)(pos)])\n"
+"\n"
+"int main(int argc, char **argv) {\n"
+"    uint64_t steplimit = parse_args(argc, argv);\n"
+"    int32_t sp = -1;\n"
+"    uint64_t steps = 0;\n"
+"    uint32_t pc = 0;\n"
+"    cpu_state_t state = Cpu_Running;\n"
+"\n", stack_capacity);
+}
+
+static void emit_epilogue() {
+    if (uses_out_of_bounds)
+        printf(
+"out_of_bounds:\n"
+"    if (steps < steplimit) {\n"
+"        printf(\"PC out of bounds\\n\");\n"
+"        state = Cpu_Break;\n"
+"    }\n");
+    printf(
+"done:\n"
+"    printf(\"CPU executed %%ld steps. End state \\\"%%s\\\".\\n\",\n"
+"            steps, state == Cpu_Halted? \"Halted\":\n"
+"                   state == Cpu_Running? \"Running\": \"Break\");\n"
+"    printf(\"PC = %%#x, SP = %%d\\n\", pc, sp);\n"
+"    printf(\"Stack: \");\n"
+"    for (int32_t i=sp; i >= 0 ; i--) {\n"
+"        printf(\"%%#10x \", stack[i]);\n"
+"    }\n"
+"    printf(\"%%s\\n\", sp == -1? \"(empty)\": \"\");\n"
+"\n"
+"    unload_program();\n"
+"\n"
+"    return state == Cpu_Halted ||\n"
+"           (state == Cpu_Running &&\n"
+"            steps == steplimit)?0:1;\n"
+"}\n");
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    const cpu_t cpu = init_cpu();
+    program_size = cpu.program_size;
+    stack_capacity = cpu.stack_capacity;
+    decoded = calloc(program_size, sizeof(decode_t));
+    truncated = calloc(program_size, sizeof(bool));
+    reachable = calloc(program_size, sizeof(bool));
+    leader = calloc(program_size, sizeof(bool));
+    if (!decoded || !truncated || !reachable || !leader) {
+        fprintf(stderr, "Failed to allocate memory for the program.\n");
+        exit(2);
+    }
+    decode_program(cpu.pmem);
+    find_blocks();
+
+    emit_prologue();
+    for (uint32_t pc = 0; pc < program_size; pc++) {
+        if (!reachable[pc] || !leader[pc])
+            continue;
+        const int length = block_length(pc);
+        emit_fast_block(pc, length);
+        emit_slow_block(pc, length);
+        printf("\n");
+    }
+    emit_epilogue();
+
+    free(leader);
+    free(reachable);
+    free(truncated);
+    free(decoded);
+    free(cpu.stack);
+    unload_program();
+    return 0;
+}
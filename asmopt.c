@@ -39,17 +39,14 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include "common.h"
 
-/* TODO:a global - not good. Should be moved into cpu state or somewhere else */
-static uint64_t steplimit = LLONG_MAX;
-
 static inline Instr_t fetch(const cpu_t *pcpu) {
     assert(pcpu);
-    assert(pcpu->pc < PROGRAM_SIZE);
+    assert(pcpu->pc < pcpu->program_size);
     return pcpu->pmem[pcpu->pc];
 };
 
 static inline Instr_t fetch_checked(cpu_t *pcpu) {
-    if (!(pcpu->pc < PROGRAM_SIZE)) {
+    if (!(pcpu->pc < pcpu->program_size)) {
         printf("PC out of bounds\n");
         pcpu->state = Cpu_Break;
         return Instr_Break;
@@ -90,7 +87,7 @@ static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
     case Instr_JNE:
     case Instr_JE:
     case Instr_Jump:
-        if (!(pcpu->pc+1 < PROGRAM_SIZE)) {
+        if (!(pcpu->pc+1 < pcpu->program_size)) {
             printf("PC+1 out of bounds\n");
             result.length = 1;
             result.opcode = Instr_Break;
@@ -120,12 +117,12 @@ static inline decode_t fetch_decode(cpu_t *pcpu) {
 #define ADVANCE_PC() do {\
     pcpu->pc += pdecoded->length;\
     pcpu->steps++; \
-    if (pcpu->state != Cpu_Running || pcpu->steps >= steplimit) return;\
+    if (pcpu->state != Cpu_Running || pcpu->steps >= pcpu->steplimit) return;\
 } while(0);
 
 static inline void push(cpu_t *pcpu, uint32_t v) {
     assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
+    if (pcpu->sp >= pcpu->stack_capacity-1) {
         printf("Stack overflow\n");
         pcpu->state = Cpu_Break;
         return;
@@ -472,7 +469,7 @@ extern uint32_t * ret_stack;
 
 int main(int argc, char **argv) {
 
-    steplimit = parse_args(argc, argv);
+    const uint64_t steplimit = parse_args(argc, argv);
 
     uint32_t stack[STACK_CAPACITY];
 
@@ -501,7 +498,7 @@ int main(int argc, char **argv) {
             );
     }
 
-    free(LoadedProgram);
+    unload_program();
 
     return ret_state == Cpu_Halted ||
            (ret_state == Cpu_Running &&
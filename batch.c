@@ -0,0 +1,463 @@
+/*  batch.c - runs many programs for a stack virtual machine on a pool of
+    threads, see stackvm.h.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#define _DEFAULT_SOURCE /* for open_memstream() and sysconf() */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "stackvm.h"
+
+/* A program to run, one per line of the jobs file:
+   <program file> [<step limit>] */
+typedef struct {
+    char *path;
+    uint64_t steplimit;
+    char *output;   /* guest output and final state of the CPU */
+    size_t output_size;
+    FILE *out;      /* open while the job runs */
+    bool ok;        /* halted or reached the step limit */
+} job_t;
+
+/* Jobs of a worker. The worker takes them from the bottom, others steal
+   from the top when they run out of their own. Jobs never make new jobs,
+   so a deque only shrinks */
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t top;
+    uint32_t bottom;
+} deque_t;
+
+typedef struct {
+    pthread_t thread;
+    unsigned index;
+} worker_t;
+
+static job_t *jobs;
+static uint32_t jobs_count;
+static deque_t *deques;
+static unsigned workers_count;
+static vm_engine_t engine = Vm_ThreadedCached;
+static uint32_t stack_capacity = STACK_CAPACITY;
+/* Jobs a worker runs at a time on the interleaved engine, 1 to run them
+   one after another on the chosen engine */
+static unsigned interleave = 1;
+#define MAX_INTERLEAVE 64
+/* Steps a job runs before the next one takes its turn, 0 unless jobs run
+   as green threads. A worker keeps up to MAX_SCHEDULED of them at a time */
+static uint64_t quantum = 0;
+#define MAX_SCHEDULED 4096
+
+static bool take_job(deque_t *d, bool steal, uint32_t *job) {
+    bool taken = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->top < d->bottom) {
+        *job = steal ? d->top++ : --d->bottom;
+        taken = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return taken;
+}
+
+static bool next_job(unsigned self, uint32_t *job) {
+    if (take_job(&deques[self], false, job))
+        return true;
+    for (unsigned i = 1; i < workers_count; i++)
+        if (take_job(&deques[(self + i) % workers_count], true, job))
+            return true;
+    return false;
+}
+
+/* Reads the whole file as program words. A partial last word is padded
+   with zeros like the loader of the standalone variants does.
+   Returns NULL if the file cannot be read */
+static Instr_t* read_program(const char *path, uint32_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    Instr_t *prog = NULL;
+    long length = -1;
+    if (!fseek(f, 0, SEEK_END))
+        length = ftell(f);
+    if (length >= 0 && (uint64_t)length <= MAX_PROGRAM_SIZE * sizeof(Instr_t)
+        && !fseek(f, 0, SEEK_SET)) {
+        *size = (length + sizeof(Instr_t) - 1) / sizeof(Instr_t);
+        prog = calloc(*size ? *size : 1, sizeof(Instr_t));
+        if (prog && fread(prog, 1, length, f) != (size_t)length) {
+            free(prog);
+            prog = NULL;
+        }
+    }
+    fclose(f);
+    return prog;
+}
+
+static void print_state(FILE *out, const cpu_t *cpu) {
+    fprintf(out, "CPU executed %ld steps. End state \"%s\".\n",
+            cpu->steps, cpu->state == Cpu_Halted? "Halted":
+                        cpu->state == Cpu_Running? "Running": "Break");
+    fprintf(out, "PC = %#x, SP = %d\n", cpu->pc, cpu->sp);
+    fprintf(out, "Stack: ");
+    for (int32_t i=cpu->sp; i >= 0 ; i--) {
+        fprintf(out, "%#10x ", cpu->stack[i]);
+    }
+    fprintf(out, "%s\n", cpu->sp == -1? "(empty)": "");
+}
+
+/* Loads the program of the job into the VM. Returns false if the job
+   cannot run, the reason is in its output then */
+static bool start_job(vm_t *vm, job_t *job) {
+    job->out = open_memstream(&job->output, &job->output_size);
+    if (job->out == NULL) {
+        fprintf(stderr, "Failed to allocate memory for job output.\n");
+        exit(2);
+    }
+    uint32_t size = 0;
+    Instr_t *prog = read_program(job->path, &size);
+    bool loaded = false;
+    if (prog == NULL) {
+        fprintf(job->out, "Cannot read target program file: %s\n", job->path);
+    } else if (!vm_load(vm, prog, size)) {
+        fprintf(job->out, "Cannot load target program: %s\n", job->path);
+    } else {
+        vm_set_output(vm, job->out);
+        loaded = true;
+    }
+    free(prog);
+    return loaded;
+}
+
+static void finish_job(vm_t *vm, job_t *job) {
+    const cpu_t *cpu = vm_cpu(vm);
+    print_state(job->out, cpu);
+    job->ok = cpu->state == Cpu_Halted ||
+              (cpu->state == Cpu_Running && cpu->steps == job->steplimit);
+    vm_set_output(vm, stdout);
+}
+
+static void end_job(job_t *job) {
+    fclose(job->out);
+    job->out = NULL;
+}
+
+/* Fills the slots from the first one on with jobs that can run, finishing
+   at once the ones that cannot. Returns the number of slots filled */
+static unsigned fill_slots(unsigned self, vm_t **vms, uint32_t *slot_jobs,
+                           unsigned first, unsigned slots) {
+    unsigned filled = first;
+    uint32_t job;
+    while (filled < slots && next_job(self, &job)) {
+        if (start_job(vms[filled], &jobs[job])) {
+            slot_jobs[filled++] = job;
+        } else {
+            end_job(&jobs[job]);
+        }
+    }
+    return filled;
+}
+
+/* Finishes the job in a slot. The last of the count slots in use moves
+   into its place, so that the free slots are at the end */
+static void release_slot(vm_t **vms, uint32_t *slot_jobs, unsigned slot,
+                         unsigned count) {
+    finish_job(vms[slot], &jobs[slot_jobs[slot]]);
+    end_job(&jobs[slot_jobs[slot]]);
+    vm_t *free_vm = vms[slot];
+    vms[slot] = vms[count - 1];
+    slot_jobs[slot] = slot_jobs[count - 1];
+    vms[count - 1] = free_vm;
+}
+
+/* Runs up to interleave jobs together, the free slots take new jobs
+   as soon as others are done */
+static void run_interleaved(unsigned self, vm_t **vms) {
+    uint32_t slot_jobs[MAX_INTERLEAVE];
+    uint64_t steps[MAX_INTERLEAVE];
+    unsigned count = fill_slots(self, vms, slot_jobs, 0, interleave);
+    while (count > 0) {
+        for (unsigned i = 0; i < count; i++)
+            steps[i] = jobs[slot_jobs[i]].steplimit - vm_cpu(vms[i])->steps;
+        unsigned done = vm_run_interleaved(vms, steps, count);
+        release_slot(vms, slot_jobs, done, count--);
+        count = fill_slots(self, vms, slot_jobs, count, interleave);
+    }
+}
+
+/* Runs up to slots jobs as green threads, each for a quantum of steps
+   in turn */
+static void run_scheduled(unsigned self, vm_t **vms, unsigned slots) {
+    vm_scheduler_t *sched = vm_scheduler_create(quantum);
+    uint32_t *slot_jobs = malloc(slots * sizeof(uint32_t));
+    if (sched == NULL || slot_jobs == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the scheduler.\n");
+        exit(2);
+    }
+    unsigned count = 0;
+    while (true) {
+        const unsigned filled = fill_slots(self, vms, slot_jobs, count, slots);
+        for (; count < filled; count++) {
+            if (!vm_scheduler_add(sched, vms[count],
+                                  jobs[slot_jobs[count]].steplimit)) {
+                fprintf(stderr,
+                        "Failed to allocate memory for the scheduler.\n");
+                exit(2);
+            }
+        }
+        const vm_t *done = vm_scheduler_run(sched);
+        if (done == NULL)
+            break;
+        unsigned slot = 0;
+        while (vms[slot] != done)
+            slot++;
+        release_slot(vms, slot_jobs, slot, count--);
+    }
+    free(slot_jobs);
+    vm_scheduler_destroy(sched);
+}
+
+/* Each worker has VMs of its own, reloaded for every job */
+static void* work(void *arg) {
+    const worker_t *worker = arg;
+    unsigned slots = interleave;
+    if (quantum > 0)
+        slots = jobs_count == 0 ? 1 :
+                jobs_count < MAX_SCHEDULED ? jobs_count : MAX_SCHEDULED;
+    vm_t **vms = malloc(slots * sizeof(vm_t*));
+    if (vms == NULL) {
+        fprintf(stderr, "Failed to allocate memory for workers.\n");
+        exit(2);
+    }
+    for (unsigned i = 0; i < slots; i++) {
+        vms[i] = vm_create(engine, stack_capacity);
+        if (vms[i] == NULL) {
+            fprintf(stderr, "Failed to create a virtual machine.\n");
+            exit(2);
+        }
+    }
+    if (quantum > 0) {
+        run_scheduled(worker->index, vms, slots);
+    } else if (interleave > 1) {
+        run_interleaved(worker->index, vms);
+    } else {
+        uint32_t job;
+        while (next_job(worker->index, &job)) {
+            if (start_job(vms[0], &jobs[job])) {
+                vm_run(vms[0], jobs[job].steplimit);
+                finish_job(vms[0], &jobs[job]);
+            }
+            end_job(&jobs[job]);
+        }
+    }
+    for (unsigned i = 0; i < slots; i++)
+        vm_destroy(vms[i]);
+    free(vms);
+    return NULL;
+}
+
+static void read_jobs(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open jobs file: %s\n", path);
+        exit(2);
+    }
+    uint32_t allocated = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    unsigned line_number = 0;
+    while (getline(&line, &line_size, f) >= 0) {
+        line_number++;
+        char *saveptr = NULL;
+        char *file = strtok_r(line, " \t\n", &saveptr);
+        if (file == NULL || file[0] == '#')
+            continue;
+        uint64_t steplimit = LLONG_MAX;
+        char *limit = strtok_r(NULL, " \t\n", &saveptr);
+        if (limit) {
+            char *endptr = NULL;
+            errno = 0;
+            /* A job runs for at least one step */
+            long long n = strtoll(limit, &endptr, 10);
+            if (errno || *endptr != '\0' || n <= 0
+                || strtok_r(NULL, " \t\n", &saveptr)) {
+                fprintf(stderr, "Invalid job at %s:%u\n", path, line_number);
+                exit(2);
+            }
+            steplimit = n;
+        }
+        if (jobs_count == allocated) {
+            allocated = allocated ? 2 * allocated : 64;
+            jobs = realloc(jobs, allocated * sizeof(job_t));
+            if (jobs == NULL) {
+                fprintf(stderr, "Failed to allocate memory for jobs.\n");
+                exit(2);
+            }
+        }
+        jobs[jobs_count++] = (job_t){.path = strdup(file),
+                                     .steplimit = steplimit};
+    }
+    free(line);
+    fclose(f);
+}
+
+static const char *threads_opt = "--threads=";
+static const char *engine_opt = "--engine=";
+static const char *stack_capacity_opt = "--stack-capacity=";
+static const char *interleave_opt = "--interleave=";
+static const char *quantum_opt = "--quantum=";
+static const char *const engine_names[] = {
+    [Vm_Switched] = "switched",
+    [Vm_Predecoded] = "predecoded",
+    [Vm_ThreadedCached] = "threaded-cached",
+};
+
+static void report_usage_and_exit(char *exec_name, int ret_code) {
+    fprintf(stderr, "Usage: %s %s<num> %s<switched|predecoded|threaded-cached>"
+            " %s<num> %s<num> %s<num> <jobs file>\n", exec_name,
+            threads_opt, engine_opt, stack_capacity_opt, interleave_opt,
+            quantum_opt);
+    exit(ret_code);
+}
+
+int main(int argc, char **argv) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    workers_count = online > 0 ? online : 1;
+    const char *jobs_file = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        char *endptr = NULL;
+        errno = 0;
+        if (!strcmp(argv[i], "--help")) {
+            report_usage_and_exit(argv[0], 0);
+        } else if (!strncmp(argv[i], threads_opt, strlen(threads_opt))) {
+            unsigned long n = strtoul(argv[i] + strlen(threads_opt), &endptr, 10);
+            if (errno || *endptr != '\0' || n == 0 || n > 1024) {
+                fprintf(stderr, "Invalid number of threads: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+            workers_count = n;
+        } else if (!strncmp(argv[i], engine_opt, strlen(engine_opt))) {
+            const char *name = argv[i] + strlen(engine_opt);
+            unsigned e;
+            for (e = 0; e < sizeof(engine_names) / sizeof(engine_names[0]); e++)
+                if (!strcmp(name, engine_names[e]))
+                    break;
+            if (e == sizeof(engine_names) / sizeof(engine_names[0])) {
+                fprintf(stderr, "Unknown engine: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+            engine = e;
+        } else if (!strncmp(argv[i], stack_capacity_opt,
+                            strlen(stack_capacity_opt))) {
+            unsigned long capacity =
+                strtoul(argv[i] + strlen(stack_capacity_opt), &endptr, 10);
+            if (errno || *endptr != '\0' || capacity < MIN_STACK_CAPACITY
+                || capacity > MAX_STACK_CAPACITY) {
+                fprintf(stderr, "Invalid stack capacity: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+            stack_capacity = capacity;
+        } else if (!strncmp(argv[i], interleave_opt, strlen(interleave_opt))) {
+            unsigned long n =
+                strtoul(argv[i] + strlen(interleave_opt), &endptr, 10);
+            if (errno || *endptr != '\0' || n == 0 || n > MAX_INTERLEAVE) {
+                fprintf(stderr, "Invalid number of interleaved jobs: %s\n",
+                        argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+            interleave = n;
+        } else if (!strncmp(argv[i], quantum_opt, strlen(quantum_opt))) {
+            quantum = strtoull(argv[i] + strlen(quantum_opt), &endptr, 10);
+            if (errno || *endptr != '\0' || quantum == 0) {
+                fprintf(stderr, "Invalid quantum: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+        } else if (jobs_file == NULL) {
+            jobs_file = argv[i];
+        } else {
+            fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+            report_usage_and_exit(argv[0], 2);
+        }
+    }
+    if (jobs_file == NULL)
+        report_usage_and_exit(argv[0], 2);
+    if (quantum > 0 && interleave > 1) {
+        fprintf(stderr, "Jobs cannot be both interleaved and scheduled\n");
+        report_usage_and_exit(argv[0], 2);
+    }
+    read_jobs(jobs_file);
+    if (workers_count > jobs_count)
+        workers_count = jobs_count ? jobs_count : 1;
+
+    /* Deal the jobs out in contiguous ranges, stealing evens out
+       the rest */
+    deques = calloc(workers_count, sizeof(deque_t));
+    worker_t *workers = calloc(workers_count, sizeof(worker_t));
+    if (deques == NULL || workers == NULL) {
+        fprintf(stderr, "Failed to allocate memory for workers.\n");
+        exit(2);
+    }
+    for (unsigned i = 0; i < workers_count; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].top = (uint64_t)jobs_count * i / workers_count;
+        deques[i].bottom = (uint64_t)jobs_count * (i + 1) / workers_count;
+    }
+    for (unsigned i = 0; i < workers_count; i++) {
+        workers[i].index = i;
+        if (pthread_create(&workers[i].thread, NULL, work, &workers[i])) {
+            fprintf(stderr, "Cannot start worker thread\n");
+            exit(2);
+        }
+    }
+    for (unsigned i = 0; i < workers_count; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    /* Outputs of the jobs in the order of the jobs file */
+    bool all_ok = true;
+    for (uint32_t i = 0; i < jobs_count; i++) {
+        printf("== %s\n", jobs[i].path);
+        fwrite(jobs[i].output, 1, jobs[i].output_size, stdout);
+        all_ok = all_ok && jobs[i].ok;
+        free(jobs[i].output);
+        free(jobs[i].path);
+    }
+    for (unsigned i = 0; i < workers_count; i++)
+        pthread_mutex_destroy(&deques[i].lock);
+    free(workers);
+    free(deques);
+    free(jobs);
+    return all_ok ? 0 : 1;
+}
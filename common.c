@@ -26,15 +26,31 @@ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
 OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
+#define _DEFAULT_SOURCE /* for MAP_ANONYMOUS and madvise() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "common.h"
 
+const char* const InstrNames[] = {
+    "Break", "Nop", "Halt", "Push", "Print",
+    "JNE", "Swap", "Dup", "JE", "Inc",
+    "Add", "Sub", "Mul", "Rand", "Dec",
+    "Drop", "Over", "Mod", "Jump",
+    "And", "Or", "Xor",
+    "SHL", "SHR",
+    "SQRT", "Rot", "Pick"
+};
+
 /* Program to print all prime numbers < 10000 */
 const Instr_t Primes[PROGRAM_SIZE] = {
     Instr_Push, 100000, // nmax (maximal number to test)
@@ -73,7 +89,14 @@ const Instr_t Primes[PROGRAM_SIZE] = {
 const Instr_t* DefProgram = Primes;
 
 /* Pointer to a loaded program */
-Instr_t* LoadedProgram = NULL;
+const Instr_t* LoadedProgram = NULL;
+uint32_t LoadedProgramSize = 0;
+static size_t LoadedMappingSize = 0;
+
+uint32_t StackCapacity = STACK_CAPACITY;
+unsigned ExtraOptions = 0;
+const char *CacheDir = NULL;
+const char *InitStacksFile = NULL;
 
 const Instr_t Instr_Rot_Test[PROGRAM_SIZE] = {
     Instr_Push, 1,
@@ -171,25 +194,207 @@ const Instr_t Factorial[PROGRAM_SIZE] = {
     Instr_Halt
 };
 
-cpu_t init_cpu () {
+cpu_t make_cpu(const Instr_t *prog, uint32_t size, uint32_t capacity) {
+    const size_t stack_bytes =
+        ((size_t)capacity * sizeof(uint32_t) + CACHE_LINE_SIZE - 1)
+        / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    uint32_t *stack = aligned_alloc(CACHE_LINE_SIZE, stack_bytes);
+    if (stack != NULL)
+        memset(stack, 0, stack_bytes);
     cpu_t cpu = {.pc = 0, .sp = -1, .state = Cpu_Running,
-                 .steps = 0, .stack = {0},
-                 .pmem = LoadedProgram ? LoadedProgram : DefProgram};
+                 .steps = 0, .stack = stack,
+                 .stack_capacity = capacity,
+                 .pmem = prog, .program_size = size, .out = stdout};
     return cpu;
 }
 
+cpu_t init_cpu () {
+    cpu_t cpu = make_cpu(LoadedProgram ? LoadedProgram : DefProgram,
+                         LoadedProgram ? LoadedProgramSize : PROGRAM_SIZE,
+                         StackCapacity);
+    if (cpu.stack == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the stack.\n");
+        exit(2);
+    }
+    return cpu;
+}
+
+/* Stack depth range before an instruction, unknown while min > max */
+typedef struct {
+    int32_t min;
+    int32_t max;
+} depth_range_t;
+
+/* Values an instruction consumes and then produces, pushes only happen
+   after pops so that the depth in between never exceeds both ends */
+static void stack_effect(Instr_t opcode, int32_t *needs, int32_t *results) {
+    switch (opcode) {
+    case Instr_Push: case Instr_Rand:
+        *needs = 0; *results = 1; break;
+    case Instr_Print: case Instr_Drop: case Instr_JE: case Instr_JNE:
+        *needs = 1; *results = 0; break;
+    case Instr_Inc: case Instr_Dec: case Instr_SQRT: case Instr_Pick:
+        *needs = 1; *results = 1; break;
+    case Instr_Dup:
+        *needs = 1; *results = 2; break;
+    case Instr_Swap:
+        *needs = 2; *results = 2; break;
+    case Instr_Over:
+        *needs = 2; *results = 3; break;
+    case Instr_Add: case Instr_Sub: case Instr_Mul: case Instr_Mod:
+    case Instr_And: case Instr_Or: case Instr_Xor:
+    case Instr_SHL: case Instr_SHR:
+        *needs = 2; *results = 1; break;
+    case Instr_Rot:
+        *needs = 3; *results = 3; break;
+    default: /* Nop, Jump, Halt, Break and undefined instructions */
+        *needs = 0; *results = 0; break;
+    }
+}
+
+/* Data flow analysis of stack depth ranges over the control flow graph.
+   Ranges only grow and are bounded by the stack capacity, so that
+   the worklist empties after a finite number of steps */
+bool verify_stack_depth(const Instr_t *prog, uint32_t size,
+                        uint32_t capacity) {
+    assert(prog);
+    depth_range_t *depth = malloc(size * sizeof(depth_range_t));
+    bool *queued = calloc(size, sizeof(bool));
+    uint32_t *worklist = malloc(size * sizeof(uint32_t));
+    if (!depth || !queued || !worklist) {
+        fprintf(stderr, "Failed to allocate memory for verification.\n");
+        exit(2);
+    }
+    for (uint32_t i = 0; i < size; i++)
+        depth[i] = (depth_range_t){.min = INT32_MAX, .max = INT32_MIN};
+    uint32_t count = 0;
+    bool verified = true;
+
+    depth[0] = (depth_range_t){.min = 0, .max = 0};
+    worklist[count++] = 0;
+    queued[0] = true;
+    while (count > 0) {
+        uint32_t pc = worklist[--count];
+        queued[pc] = false;
+        Instr_t opcode = prog[pc];
+        bool has_immediate = opcode == Instr_Push || opcode == Instr_JE
+                             || opcode == Instr_JNE || opcode == Instr_Jump;
+        if (has_immediate && !(pc + 1 < size))
+            continue; /* Decoded as Break */
+        if (opcode == Instr_Halt || opcode == Instr_Break
+            || opcode > Instr_Pick)
+            continue;
+
+        int32_t needs = 0, results = 0;
+        stack_effect(opcode, &needs, &results);
+        if (depth[pc].min < needs
+            || depth[pc].max - needs + results > (int32_t)capacity) {
+            verified = false;
+            break;
+        }
+        depth_range_t after = {.min = depth[pc].min - needs + results,
+                               .max = depth[pc].max - needs + results};
+
+        uint32_t next = pc + (has_immediate ? 2 : 1);
+        uint32_t successors[2];
+        int successors_count = 0;
+        if (opcode != Instr_Jump)
+            successors[successors_count++] = next;
+        if (opcode == Instr_JE || opcode == Instr_JNE || opcode == Instr_Jump)
+            successors[successors_count++] = next + (int32_t)prog[pc + 1];
+
+        for (int i = 0; i < successors_count; i++) {
+            uint32_t s = successors[i];
+            if (!(s < size))
+                continue; /* Stops with "PC out of bounds" */
+            depth_range_t old = depth[s];
+            if (after.min < depth[s].min)
+                depth[s].min = after.min;
+            if (after.max > depth[s].max)
+                depth[s].max = after.max;
+            if ((depth[s].min != old.min || depth[s].max != old.max)
+                && !queued[s]) {
+                worklist[count++] = s;
+                queued[s] = true;
+            }
+        }
+    }
+    free(depth);
+    free(queued);
+    free(worklist);
+    return verified;
+}
+
 static const char *steplimit_opt = "--steplimit=";
 static const char *inp_prog_opt = "--inp-prog=";
+static const char *stack_capacity_opt = "--stack-capacity=";
+static const char *cache_dir_opt = "--cache-dir=";
+static const char *init_stacks_opt = "--init-stacks=";
 
 static inline
 void report_usage_and_exit(char * exec_name, int ret_code) {
-    fprintf(stderr, "Usage: %s %s<num> %s<str>\n", exec_name, steplimit_opt, inp_prog_opt);
+    fprintf(stderr, "Usage: %s %s<num> %s<str> %s<num>", exec_name,
+            steplimit_opt, inp_prog_opt, stack_capacity_opt);
+    if (ExtraOptions & Option_CacheDir)
+        fprintf(stderr, " %s<dir>", cache_dir_opt);
+    if (ExtraOptions & Option_InitStacks)
+        fprintf(stderr, " %s<str>", init_stacks_opt);
+    fprintf(stderr, "\n");
     exit (ret_code);
 }
 
+/* Maps the file over the start of an anonymous region as long as the
+   program memory. Bytes past the end of the file read as zeros, that is
+   Break, both in the last page of the file and in the region after it */
+static void load_program(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Cannot open target program file: %s\n", path);
+        exit(2);
+    }
+    uint64_t filelen = st.st_size;
+    if (filelen > MAX_PROGRAM_SIZE * sizeof(Instr_t)) {
+        fprintf(stderr, "Input program size exceeds allocated memory.\n");
+        exit(2);
+    }
+    /* Whole words of the file, padded with Break up to PROGRAM_SIZE */
+    LoadedProgramSize = (filelen + sizeof(Instr_t) - 1) / sizeof(Instr_t);
+    if (LoadedProgramSize < PROGRAM_SIZE)
+        LoadedProgramSize = PROGRAM_SIZE;
+    LoadedMappingSize = LoadedProgramSize * sizeof(Instr_t);
+    void *region = mmap(NULL, LoadedMappingSize, PROT_READ,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate memory for input program.\n");
+        exit(2);
+    }
+    if (filelen > 0) {
+        if (mmap(region, filelen, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                 fd, 0) == MAP_FAILED) {
+            fprintf(stderr, "Cannot map target program file: %s\n", path);
+            exit(2);
+        }
+        /* Lazily decoding engines touch the program as they go, start
+           reading it in without waiting for it */
+        madvise(region, filelen, MADV_WILLNEED);
+    }
+    close(fd);
+    LoadedProgram = region;
+}
+
+void unload_program(void) {
+    if (LoadedProgram == NULL)
+        return;
+    munmap((void *)LoadedProgram, LoadedMappingSize);
+    LoadedProgram = NULL;
+    LoadedProgramSize = 0;
+    LoadedMappingSize = 0;
+}
+
 uint64_t parse_args(int argc, char** argv) {
     uint64_t steplimit = LLONG_MAX;
-    FILE *prog_file = NULL;
+    const char *prog_file = NULL;
 
     for (int i = 1; i < argc; ++i) {
         if (!strcmp(argv[i], "--help"))
@@ -201,12 +406,26 @@ uint64_t parse_args(int argc, char** argv) {
                 fprintf(stderr, "Invalid steplimit: %s\n", argv[i]);
                 report_usage_and_exit(argv[0], 2);
             }
-        } else if (!strncmp(argv[i], inp_prog_opt, strlen(inp_prog_opt))) {
-            prog_file = fopen(argv[i] + strlen(inp_prog_opt), "rb");
-            if (errno || prog_file == NULL) {
-                fprintf(stderr, "Cannot open target program file: %s\n", argv[i]);
+        } else if (!strncmp(argv[i], stack_capacity_opt,
+                            strlen(stack_capacity_opt))) {
+            char *endptr = NULL;
+            unsigned long capacity =
+                strtoul(argv[i] + strlen(stack_capacity_opt), &endptr, 10);
+            if (errno || (*endptr != '\0') || capacity < MIN_STACK_CAPACITY
+                || capacity > MAX_STACK_CAPACITY) {
+                fprintf(stderr, "Invalid stack capacity: %s\n", argv[i]);
                 report_usage_and_exit(argv[0], 2);
             }
+            StackCapacity = capacity;
+        } else if ((ExtraOptions & Option_CacheDir)
+                   && !strncmp(argv[i], cache_dir_opt, strlen(cache_dir_opt))) {
+            CacheDir = argv[i] + strlen(cache_dir_opt);
+        } else if ((ExtraOptions & Option_InitStacks)
+                   && !strncmp(argv[i], init_stacks_opt,
+                               strlen(init_stacks_opt))) {
+            InitStacksFile = argv[i] + strlen(init_stacks_opt);
+        } else if (!strncmp(argv[i], inp_prog_opt, strlen(inp_prog_opt))) {
+            prog_file = argv[i] + strlen(inp_prog_opt);
         } else {
             /* Handle positional arguments */
             /* For now, we only have steplimit */
@@ -219,24 +438,8 @@ uint64_t parse_args(int argc, char** argv) {
         }
     }
 
-    uint64_t filelen = 0;
-    if (prog_file != NULL) {
-        fseek(prog_file, 0, SEEK_END);  // Jump to the end of the file
-        filelen = ftell(prog_file);     // Get the current byte offset in the file
-        rewind(prog_file);              // Jump back to the beginning of the file
-        if (filelen > PROGRAM_SIZE * sizeof(Instr_t)) {
-            fprintf(stderr, "Input program size exceeds allocated memory.\n");
-            exit(2);
-        }
-        LoadedProgram = (Instr_t*) calloc(filelen, sizeof(Instr_t)); // Enough memory for file
-        if (LoadedProgram == NULL) {
-            fprintf(stderr, "Failed to allocate memory for input program.\n");
-            exit(2);
-        }
-        size_t act_read = fread(LoadedProgram, 1, filelen, prog_file); // Read in the entire file
-        assert(filelen == act_read);
-        fclose(prog_file);
-    }
+    if (prog_file != NULL)
+        load_program(prog_file);
 
     return steplimit;
 }
@@ -29,6 +29,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #ifndef COMMON_H_
 #define COMMON_H_
@@ -78,14 +79,49 @@ typedef enum {
 
 typedef uint32_t Instr_t;
 
-/* The code for target program for an interpreter to simulate */
+/* Mnemonics of instructions, indexed by opcodes */
+extern const char* const InstrNames[];
+
+/* The code for target program for an interpreter to simulate.
+   Programs are at least this long, shorter ones are padded with Break */
 #define PROGRAM_SIZE 512
+/* The longest program that can be loaded, in words */
+#define MAX_PROGRAM_SIZE (1u << 24)
 
 extern const Instr_t* DefProgram;
 
-extern Instr_t* LoadedProgram;
+/* A program from --inp-prog is mapped read-only from its file rather than
+   copied, so processes running the same program share its pages */
+extern const Instr_t* LoadedProgram;
+extern uint32_t LoadedProgramSize;
 
+/* Data stack entries unless chosen with --stack-capacity */
 #define STACK_CAPACITY 32
+/* Fast paths of the engines take for granted that the few slots a single
+   instruction or a superinstruction works on fit in the stack */
+#define MIN_STACK_CAPACITY 8
+#define MAX_STACK_CAPACITY (1u << 24)
+extern uint32_t StackCapacity;
+
+/* Options that only some variants take. A variant sets the ones it
+   takes before it calls parse_args(), which rejects the others */
+enum {
+    Option_CacheDir   = 1 << 0,
+    Option_InitStacks = 1 << 1,
+};
+extern unsigned ExtraOptions;
+
+/* Directory given with --cache-dir to keep translations of programs
+   between runs, NULL if they are not kept */
+extern const char *CacheDir;
+
+/* File given with --init-stacks with initial stacks of the instances
+   run side by side by lockstep, NULL if they start with empty stacks */
+extern const char *InitStacksFile;
+
+/* The data stack is allocated apart from the rest of the CPU state,
+   aligned to and padded to whole cache lines */
+#define CACHE_LINE_SIZE 64
 /* A struct to store information about a decoded instruction */
 typedef struct {
     Instr_t opcode; /* Used as an index in switch */
@@ -95,21 +131,41 @@ typedef struct {
     const void *sr; /* label to a service routine */
 } decode_t;
 
-/* Use up to 16 host bytes for one guest instruction in JIT variants */
-#define JIT_CODE_SIZE (PROGRAM_SIZE * 16)
+/* Use up to 128 host bytes for one guest instruction in JIT variants.
+   Generated code is allocated in chunks of this size, up to the arena size */
+#define JIT_CODE_SIZE (PROGRAM_SIZE * 128)
+#define JIT_ARENA_SIZE (JIT_CODE_SIZE * 1024)
 
 /* Simulated processor state */
 typedef struct {
     uint32_t pc; /* Program Counter */
     int32_t sp; /* Stack Pointer */
     cpu_state_t state;
+    uint32_t program_size; /* Words in program memory */
     uint64_t steps; /* Statistics - total number of instructions */
-    uint32_t stack[STACK_CAPACITY]; /* Data Stack */
+    uint32_t *stack; /* Data Stack */
     const Instr_t *pmem; /* Program Memory */
+    int32_t stack_capacity; /* Entries in the data stack */
+    FILE *out; /* Output of the guest: Print and error messages */
+    uint64_t steplimit; /* Where engines that take the limit from the CPU
+                           rather than as an argument stop */
 } cpu_t;
 
+/* A CPU at the start of the program with an empty stack of the given
+   capacity. The stack is allocated and owned by the caller, it is NULL
+   if there is no memory for it */
+cpu_t make_cpu(const Instr_t *prog, uint32_t size, uint32_t capacity);
+/* The CPU for the program and the stack capacity from the command line.
+   The stack of the returned CPU is allocated and owned by the caller */
 cpu_t init_cpu ();
+/* True if no execution of the program starting at PC 0 with the empty
+   stack of the given capacity can overflow or underflow the stack in any
+   instruction. Engines may then use handlers without stack bounds checks */
+bool verify_stack_depth(const Instr_t *prog, uint32_t size,
+                        uint32_t capacity);
 uint64_t parse_args(int argc, char** argv);
+/* Releases the program loaded by parse_args, if any */
+void unload_program(void);
 void write_program (Instr_t* program, size_t program_size, const char* out_file);
 
 #endif /* COMMON_H_ */
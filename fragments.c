@@ -0,0 +1,654 @@
+/*  fragments.c - host code glued from copies of code fragments for
+    the dynamic superinstructions and the traces of threaded-cached.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "fragments.h"
+
+/*** Code fragments ***/
+
+/* A run of consecutive instructions (a dynamic superinstruction) or
+   a recorded loop trace is translated into a host function glued from
+   copies of the relocatable code fragments below.
+   A function gets a pointer to cpu_t in RDI, keeps guest SP in RSI
+   and the stack in R8.
+   It does no stack or step limit checks; it is only entered after
+   the interpreter has made sure that the whole run will not fail them.
+   Operands marked with 0x7fffffff are patched when fragments are copied,
+   labels of such operands follow them. */
+
+#ifndef __x86_64__
+#error "Dynamic superinstructions and traces are only implemented for Intel 64 hosts"
+#endif
+
+_Static_assert(offsetof(cpu_t, pc) == 0
+               && offsetof(cpu_t, sp) == 4
+               && offsetof(cpu_t, state) == 8
+               && offsetof(cpu_t, steps) == 16
+               && offsetof(cpu_t, stack) == 24,
+               "Code fragments below assume this layout of cpu_t");
+
+__asm__(
+"    .text\n"
+"sf_Prologue:\n"
+"    movslq 4(%rdi), %rsi\n"
+"    movq 24(%rdi), %r8\n"
+"sf_Prologue_end:\n"
+"sf_Exit:\n"
+"    movl $0x7fffffff, (%rdi)\n"
+"sf_Exit_pc:\n"
+"sf_BranchExit:\n"
+"    movl %esi, 4(%rdi)\n"
+"    addq $0x7fffffff, 16(%rdi)\n"
+"sf_Exit_steps:\n"
+"    ret\n"
+"sf_Exit_end:\n"
+"sf_Nop:\n"
+"sf_Nop_end:\n"
+"sf_Push:\n"
+"    incq %rsi\n"
+"    movl $0x7fffffff, (%r8,%rsi,4)\n"
+"sf_Push_imm:\n"
+"sf_Push_end:\n"
+"sf_Swap:\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    movl -4(%r8,%rsi,4), %edx\n"
+"    movl %edx, (%r8,%rsi,4)\n"
+"    movl %eax, -4(%r8,%rsi,4)\n"
+"sf_Swap_end:\n"
+"sf_Dup:\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    incq %rsi\n"
+"    movl %eax, (%r8,%rsi,4)\n"
+"sf_Dup_end:\n"
+"sf_Over:\n"
+"    movl -4(%r8,%rsi,4), %eax\n"
+"    incq %rsi\n"
+"    movl %eax, (%r8,%rsi,4)\n"
+"sf_Over_end:\n"
+"sf_Inc:\n"
+"    incl (%r8,%rsi,4)\n"
+"sf_Inc_end:\n"
+"sf_Dec:\n"
+"    decl (%r8,%rsi,4)\n"
+"sf_Dec_end:\n"
+"sf_Drop:\n"
+"    decq %rsi\n"
+"sf_Drop_end:\n"
+"sf_Add:\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    addl -4(%r8,%rsi,4), %eax\n"
+"    decq %rsi\n"
+"    movl %eax, (%r8,%rsi,4)\n"
+"sf_Add_end:\n"
+"sf_Sub:\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    subl -4(%r8,%rsi,4), %eax\n"
+"    decq %rsi\n"
+"    movl %eax, (%r8,%rsi,4)\n"
+"sf_Sub_end:\n"
+"sf_Mul:\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    imull -4(%r8,%rsi,4), %eax\n"
+"    decq %rsi\n"
+"    movl %eax, (%r8,%rsi,4)\n"
+"sf_Mul_end:\n"
+"sf_And:\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    andl -4(%r8,%rsi,4), %eax\n"
+"    decq %rsi\n"
+"    movl %eax, (%r8,%rsi,4)\n"
+"sf_And_end:\n"
+"sf_Or:\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    orl -4(%r8,%rsi,4), %eax\n"
+"    decq %rsi\n"
+"    movl %eax, (%r8,%rsi,4)\n"
+"sf_Or_end:\n"
+"sf_Xor:\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    xorl -4(%r8,%rsi,4), %eax\n"
+"    decq %rsi\n"
+"    movl %eax, (%r8,%rsi,4)\n"
+"sf_Xor_end:\n"
+"sf_SHL:\n"
+"    movl -4(%r8,%rsi,4), %ecx\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    shll %cl, %eax\n"
+"    decq %rsi\n"
+"    movl %eax, (%r8,%rsi,4)\n"
+"sf_SHL_end:\n"
+"sf_SHR:\n"
+"    movl -4(%r8,%rsi,4), %ecx\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    shrl %cl, %eax\n"
+"    decq %rsi\n"
+"    movl %eax, (%r8,%rsi,4)\n"
+"sf_SHR_end:\n"
+"sf_Rot:\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    movl -4(%r8,%rsi,4), %ecx\n"
+"    movl -8(%r8,%rsi,4), %edx\n"
+"    movl %eax, -8(%r8,%rsi,4)\n"
+"    movl %edx, -4(%r8,%rsi,4)\n"
+"    movl %ecx, (%r8,%rsi,4)\n"
+"sf_Rot_end:\n"
+/* Division by zero leaves the function the way the interpreter stops:
+   both operands are popped, PC stays at the instruction */
+"sf_Mod:\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    movl -4(%r8,%rsi,4), %ecx\n"
+"    testl %ecx, %ecx\n"
+"    jnz 1f\n"
+"    subq $2, %rsi\n"
+"    movl %esi, 4(%rdi)\n"
+"    movl $0x7fffffff, (%rdi)\n"
+"sf_Mod_pc:\n"
+"    addq $0x7fffffff, 16(%rdi)\n"
+"sf_Mod_steps:\n"
+"    movl $2, 8(%rdi)\n" /* Cpu_Break */
+"    ret\n"
+"1:  xorl %edx, %edx\n"
+"    divl %ecx\n"
+"    decq %rsi\n"
+"    movl %edx, (%r8,%rsi,4)\n"
+"sf_Mod_end:\n"
+/* Branches may only end a run */
+"sf_JE:\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    decq %rsi\n"
+"    movl $0x7fffffff, (%rdi)\n"
+"sf_JE_next:\n"
+"    testl %eax, %eax\n"
+"    jnz 1f\n"
+"    movl $0x7fffffff, (%rdi)\n"
+"sf_JE_target:\n"
+"1:\n"
+"sf_JE_end:\n"
+"sf_JNE:\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    decq %rsi\n"
+"    movl $0x7fffffff, (%rdi)\n"
+"sf_JNE_next:\n"
+"    testl %eax, %eax\n"
+"    jz 1f\n"
+"    movl $0x7fffffff, (%rdi)\n"
+"sf_JNE_target:\n"
+"1:\n"
+"sf_JNE_end:\n"
+"sf_Jump:\n"
+"    movl $0x7fffffff, (%rdi)\n"
+"sf_Jump_target:\n"
+"sf_Jump_end:\n"
+/* Traces get the step count at which the last iteration may start in RSI
+   and keep it in R9, which no fragment uses: EAX, ECX and EDX are
+   scratch registers of the fragments */
+"sf_TracePrologue:\n"
+"    movq %rsi, %r9\n"
+"    movslq 4(%rdi), %rsi\n"
+"    movq 24(%rdi), %r8\n"
+"sf_TracePrologue_end:\n"
+/* Guards check that a conditional branch goes the recorded way,
+   otherwise they leave the trace for the other direction */
+"sf_GuardZero:\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    decq %rsi\n"
+"    testl %eax, %eax\n"
+"    jz 1f\n"
+"    movl $0x7fffffff, (%rdi)\n"
+"sf_GuardZero_pc:\n"
+"    movl %esi, 4(%rdi)\n"
+"    addq $0x7fffffff, 16(%rdi)\n"
+"sf_GuardZero_steps:\n"
+"    ret\n"
+"1:\n"
+"sf_GuardZero_end:\n"
+"sf_GuardNonZero:\n"
+"    movl (%r8,%rsi,4), %eax\n"
+"    decq %rsi\n"
+"    testl %eax, %eax\n"
+"    jnz 1f\n"
+"    movl $0x7fffffff, (%rdi)\n"
+"sf_GuardNonZero_pc:\n"
+"    movl %esi, 4(%rdi)\n"
+"    addq $0x7fffffff, 16(%rdi)\n"
+"sf_GuardNonZero_steps:\n"
+"    ret\n"
+"1:\n"
+"sf_GuardNonZero_end:\n"
+/* Ends an iteration of a trace. The next one starts if it cannot fail
+   stack bounds or hit the step limit, as the first one was checked */
+"sf_TraceLoop:\n"
+"    addq $0x7fffffff, 16(%rdi)\n"
+"sf_TraceLoop_steps:\n"
+"    cmpq %r9, 16(%rdi)\n"
+"    ja 1f\n"
+"    leal 0x7fffffff(%rsi), %ecx\n"
+"sf_TraceLoop_lo:\n"
+"    cmpl $0x7fffffff, %ecx\n"
+"sf_TraceLoop_range:\n"
+"    ja 1f\n"
+"    .byte 0xe9\n" /* jmp rel32 to the start of the iteration */
+"    .long 0\n"
+"sf_TraceLoop_back:\n"
+"1:  movl %esi, 4(%rdi)\n"
+"    movl $0x7fffffff, (%rdi)\n"
+"sf_TraceLoop_pc:\n"
+"    ret\n"
+"sf_TraceLoop_end:\n"
+);
+
+#define FRAGMENT(name) \
+    extern const char sf_##name[] __attribute__((visibility("hidden"))), \
+                      sf_##name##_end[] __attribute__((visibility("hidden")))
+#define PATCH_LABEL(name) \
+    extern const char sf_##name[] __attribute__((visibility("hidden")))
+
+FRAGMENT(Prologue); FRAGMENT(Exit);
+PATCH_LABEL(Exit_pc); PATCH_LABEL(Exit_steps); PATCH_LABEL(BranchExit);
+FRAGMENT(Nop); FRAGMENT(Push); FRAGMENT(Swap); FRAGMENT(Dup);
+FRAGMENT(Over); FRAGMENT(Inc); FRAGMENT(Dec); FRAGMENT(Drop);
+FRAGMENT(Add); FRAGMENT(Sub); FRAGMENT(Mul); FRAGMENT(And);
+FRAGMENT(Or); FRAGMENT(Xor); FRAGMENT(SHL); FRAGMENT(SHR);
+FRAGMENT(Rot); FRAGMENT(Mod); FRAGMENT(JE); FRAGMENT(JNE); FRAGMENT(Jump);
+PATCH_LABEL(Push_imm); PATCH_LABEL(Mod_pc); PATCH_LABEL(Mod_steps);
+PATCH_LABEL(JE_next); PATCH_LABEL(JE_target);
+PATCH_LABEL(JNE_next); PATCH_LABEL(JNE_target); PATCH_LABEL(Jump_target);
+FRAGMENT(TracePrologue); FRAGMENT(GuardZero); FRAGMENT(GuardNonZero);
+FRAGMENT(TraceLoop);
+PATCH_LABEL(GuardZero_pc); PATCH_LABEL(GuardZero_steps);
+PATCH_LABEL(GuardNonZero_pc); PATCH_LABEL(GuardNonZero_steps);
+PATCH_LABEL(TraceLoop_steps); PATCH_LABEL(TraceLoop_lo);
+PATCH_LABEL(TraceLoop_range); PATCH_LABEL(TraceLoop_back);
+PATCH_LABEL(TraceLoop_pc);
+
+typedef struct {
+    const char *start;
+    const char *end;
+    int needs;   /* stack values consumed */
+    int results; /* stack values produced */
+} fragment_t;
+
+/* Instructions without a fragment cannot be fused */
+static const fragment_t fragments[] = {
+    [Instr_Nop]  = {sf_Nop,  sf_Nop_end,  0, 0},
+    [Instr_Push] = {sf_Push, sf_Push_end, 0, 1},
+    [Instr_Swap] = {sf_Swap, sf_Swap_end, 2, 2},
+    [Instr_Dup]  = {sf_Dup,  sf_Dup_end,  1, 2},
+    [Instr_Over] = {sf_Over, sf_Over_end, 2, 3},
+    [Instr_Inc]  = {sf_Inc,  sf_Inc_end,  1, 1},
+    [Instr_Dec]  = {sf_Dec,  sf_Dec_end,  1, 1},
+    [Instr_Drop] = {sf_Drop, sf_Drop_end, 1, 0},
+    [Instr_Add]  = {sf_Add,  sf_Add_end,  2, 1},
+    [Instr_Sub]  = {sf_Sub,  sf_Sub_end,  2, 1},
+    [Instr_Mul]  = {sf_Mul,  sf_Mul_end,  2, 1},
+    [Instr_And]  = {sf_And,  sf_And_end,  2, 1},
+    [Instr_Or]   = {sf_Or,   sf_Or_end,   2, 1},
+    [Instr_Xor]  = {sf_Xor,  sf_Xor_end,  2, 1},
+    [Instr_SHL]  = {sf_SHL,  sf_SHL_end,  2, 1},
+    [Instr_SHR]  = {sf_SHR,  sf_SHR_end,  2, 1},
+    [Instr_Rot]  = {sf_Rot,  sf_Rot_end,  3, 3},
+    [Instr_Mod]  = {sf_Mod,  sf_Mod_end,  2, 1},
+    [Instr_JE]   = {sf_JE,   sf_JE_end,   1, 0},
+    [Instr_JNE]  = {sf_JNE,  sf_JNE_end,  1, 0},
+    [Instr_Jump] = {sf_Jump, sf_Jump_end, 0, 0},
+    [Instr_Pick] = {NULL, NULL, 0, 0} /* Sets the table size */
+};
+
+#define MAX_FRAGMENT_SIZE 64
+
+static bool is_branch(Instr_t opcode) {
+    return opcode == Instr_JE || opcode == Instr_JNE || opcode == Instr_Jump;
+}
+
+static char* copy_fragment(char *where, const char *start, const char *end) {
+    assert(end - start <= MAX_FRAGMENT_SIZE);
+    memcpy(where, start, end - start);
+    return where + (end - start);
+}
+
+/* Patch an imm32 operand in a copied fragment. The label follows it */
+static void patch_fragment(char *copy, const char *start, const char *label,
+                           uint32_t value) {
+    memcpy(copy + (label - start) - 4, &value, 4);
+}
+
+static char* allocate_code_buffer(size_t size) {
+    char *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        perror("mmap");
+        exit(2);
+    }
+    return buffer;
+}
+
+static void protect_code_buffer(char *buffer, size_t size, int prot) {
+    if (mprotect(buffer, size, prot)) {
+        perror("mprotect");
+        exit(2);
+    }
+}
+
+/*** Dynamic superinstructions ***/
+
+#define MAX_SUPER_LENGTH 16
+#define SUPER_CODE_SIZE(program_size) \
+    ((size_t)(program_size) * (MAX_SUPER_LENGTH + 1) * MAX_FRAGMENT_SIZE)
+
+super_t *supers;
+
+/* Glue host code for a run of instructions starting at pc.
+   Returns the end of generated code */
+static char* emit_super(char *where, const decode_t *dec,
+                        uint32_t pc, int32_t stack_capacity, super_t *super) {
+    char *code = where;
+    uint32_t length = 0;
+    int depth = 0; /* stack depth relative to the start of the run */
+    int lowest = -1, highest = 0;
+    where = copy_fragment(where, sf_Prologue, sf_Prologue_end);
+    for (;;) {
+        decode_t decoded = dec[pc];
+        const fragment_t *f = &fragments[decoded.opcode];
+        const uint32_t next_pc = pc + decoded.length;
+        const uint32_t target_pc = next_pc + decoded.immediate;
+        /* A value needed at SP+depth-k must be at index 0 or above */
+        if (f->needs - 1 - depth > lowest)
+            lowest = f->needs - 1 - depth;
+        depth += f->results - f->needs;
+        if (depth > highest)
+            highest = depth;
+
+        char *copy = where;
+        where = copy_fragment(where, f->start, f->end);
+        switch (decoded.opcode) {
+        case Instr_Push:
+            patch_fragment(copy, f->start, sf_Push_imm, decoded.immediate);
+            break;
+        case Instr_Mod:
+            patch_fragment(copy, f->start, sf_Mod_pc, pc);
+            patch_fragment(copy, f->start, sf_Mod_steps, length);
+            break;
+        case Instr_JE:
+            patch_fragment(copy, f->start, sf_JE_next, next_pc);
+            patch_fragment(copy, f->start, sf_JE_target, target_pc);
+            break;
+        case Instr_JNE:
+            patch_fragment(copy, f->start, sf_JNE_next, next_pc);
+            patch_fragment(copy, f->start, sf_JNE_target, target_pc);
+            break;
+        case Instr_Jump:
+            patch_fragment(copy, f->start, sf_Jump_target, target_pc);
+            break;
+        default:
+            break;
+        }
+        length++;
+        pc = next_pc;
+        if (is_branch(decoded.opcode)) {
+            char *exit = where;
+            where = copy_fragment(where, sf_BranchExit, sf_Exit_end);
+            patch_fragment(exit, sf_BranchExit, sf_Exit_steps, length);
+            break;
+        }
+        if (length == super->length) {
+            char *exit = where;
+            where = copy_fragment(where, sf_Exit, sf_Exit_end);
+            patch_fragment(exit, sf_Exit, sf_Exit_pc, pc);
+            patch_fragment(exit, sf_Exit, sf_Exit_steps, length);
+            break;
+        }
+    }
+    super->code = (super_code_t*)code;
+    super->lo = lowest;
+    super->hi = stack_capacity - 1 - highest;
+    return where;
+}
+
+void compile_supers(decode_t *dec, uint32_t size, int32_t stack_capacity,
+                         const void *super_sr) {
+    assert(dec);
+    const size_t code_size = SUPER_CODE_SIZE(size);
+    char *buffer = allocate_code_buffer(code_size);
+    supers = calloc(size, sizeof(super_t));
+    /* Runs start at branch targets and after branches, and never
+       cross them, so that every run is entered at its start */
+    bool *leader = calloc(size, sizeof(bool));
+    if (!supers || !leader) {
+        fprintf(stderr, "Failed to allocate memory for superinstructions.\n");
+        exit(2);
+    }
+    leader[0] = true;
+    for (uint32_t pc = 0; pc < size; pc++) {
+        if (!is_branch(dec[pc].opcode))
+            continue;
+        uint32_t next_pc = pc + dec[pc].length;
+        uint32_t target_pc = next_pc + dec[pc].immediate;
+        if (next_pc < size)
+            leader[next_pc] = true;
+        if (target_pc < size)
+            leader[target_pc] = true;
+    }
+
+    char *where = buffer;
+    for (uint32_t start = 0; start < size; start++) {
+        if (!leader[start])
+            continue;
+        /* Measure the run */
+        uint32_t pc = start, length = 0;
+        while (pc < size && length < MAX_SUPER_LENGTH
+               && fragments[dec[pc].opcode].start
+               && (pc == start || !leader[pc])) {
+            Instr_t opcode = dec[pc].opcode;
+            length++;
+            pc += dec[pc].length;
+            if (is_branch(opcode))
+                break;
+        }
+        /* Whatever follows the run starts a new one */
+        uint32_t skip = pc;
+        if (length == 0 && pc < size)
+            skip = pc + dec[pc].length;
+        if (skip < size)
+            leader[skip] = true;
+        if (length < 2)
+            continue;
+        super_t *super = &supers[start];
+        super->sr = dec[start].sr;
+        super->length = length;
+        where = emit_super(where, dec, start, stack_capacity, super);
+        assert(where <= buffer + code_size);
+        if (super->hi < super->lo)
+            continue; /* Can never fit on the stack */
+        dec[start].sr = super_sr;
+    }
+    free(leader);
+    protect_code_buffer(buffer, code_size, PROT_READ | PROT_EXEC);
+}
+
+/*** Traces of hot loops ***/
+
+/* A taken backward branch marks its target as a loop header. After enough
+   of them the path executed from the header until it is reached again
+   is recorded and translated into host code. Conditional branches on
+   the path become guards leaving the trace when they go another way.
+   The trace code iterates the loop without returning to the interpreter
+   as long as iterations cannot fail stack bounds or hit the step limit */
+
+#ifndef TRACE_THRESHOLD
+#define TRACE_THRESHOLD 64
+#endif
+#define MAX_TRACES 32
+#define TRACE_CODE_SIZE \
+    (MAX_TRACES * (MAX_TRACE_LENGTH + 2) * MAX_FRAGMENT_SIZE)
+
+trace_t *traces;
+recorder_t recorder;
+
+static char *trace_buffer;
+static size_t trace_buffer_used;
+
+void count_loop(uint32_t head, uint32_t program_size) {
+    if (head >= program_size || recorder.active)
+        return;
+    trace_t *trace = &traces[head];
+    if (trace->code || trace->failed || ++trace->heat < TRACE_THRESHOLD)
+        return;
+    recorder.active = true;
+    recorder.head = head;
+    recorder.length = 0;
+}
+
+/* Glue host code for the recorded trace and make its header run it */
+static void compile_trace(decode_t *dec, int32_t stack_capacity,
+                          const void *trace_sr) {
+    trace_t *trace = &traces[recorder.head];
+    if (!trace_buffer)
+        trace_buffer = allocate_code_buffer(TRACE_CODE_SIZE);
+    if (trace_buffer_used + (recorder.length + 2) * MAX_FRAGMENT_SIZE
+        > TRACE_CODE_SIZE) {
+        trace->failed = true;
+        return;
+    }
+    protect_code_buffer(trace_buffer, TRACE_CODE_SIZE,
+                        PROT_READ | PROT_WRITE);
+    char *code = trace_buffer + trace_buffer_used;
+    char *where = copy_fragment(code, sf_TracePrologue, sf_TracePrologue_end);
+    char *iteration = where;
+    int depth = 0; /* stack depth relative to the start of an iteration */
+    int lowest = -1, highest = 0;
+    for (uint32_t i = 0; i < recorder.length; i++) {
+        const uint32_t pc = recorder.pcs[i];
+        const decode_t decoded = dec[pc];
+        const fragment_t *f = &fragments[decoded.opcode];
+        const uint32_t next_pc = pc + decoded.length;
+        const uint32_t target_pc = next_pc + decoded.immediate;
+        const uint32_t taken_pc = i + 1 < recorder.length ?
+                                  recorder.pcs[i + 1] : recorder.head;
+        if (f->needs - 1 - depth > lowest)
+            lowest = f->needs - 1 - depth;
+        depth += f->results - f->needs;
+        if (depth > highest)
+            highest = depth;
+
+        char *copy = where;
+        switch (decoded.opcode) {
+        case Instr_JE:
+        case Instr_JNE: {
+            if (next_pc == target_pc) { /* Goes on either way */
+                where = copy_fragment(where, sf_Drop, sf_Drop_end);
+                break;
+            }
+            const bool taken = taken_pc == target_pc;
+            if ((decoded.opcode == Instr_JE) == taken) {
+                where = copy_fragment(where, sf_GuardZero, sf_GuardZero_end);
+                patch_fragment(copy, sf_GuardZero, sf_GuardZero_pc,
+                               taken ? next_pc : target_pc);
+                patch_fragment(copy, sf_GuardZero, sf_GuardZero_steps, i + 1);
+            } else {
+                where = copy_fragment(where, sf_GuardNonZero,
+                                      sf_GuardNonZero_end);
+                patch_fragment(copy, sf_GuardNonZero, sf_GuardNonZero_pc,
+                               taken ? next_pc : target_pc);
+                patch_fragment(copy, sf_GuardNonZero, sf_GuardNonZero_steps,
+                               i + 1);
+            }
+            break;
+        }
+        case Instr_Jump:
+            break; /* The trace just goes on */
+        case Instr_Push:
+            where = copy_fragment(where, f->start, f->end);
+            patch_fragment(copy, f->start, sf_Push_imm, decoded.immediate);
+            break;
+        case Instr_Mod:
+            where = copy_fragment(where, f->start, f->end);
+            patch_fragment(copy, f->start, sf_Mod_pc, pc);
+            patch_fragment(copy, f->start, sf_Mod_steps, i);
+            break;
+        default:
+            where = copy_fragment(where, f->start, f->end);
+            break;
+        }
+    }
+    trace->lo = lowest;
+    trace->hi = stack_capacity - 1 - highest;
+    trace->length = recorder.length;
+    if (trace->hi < trace->lo) {
+        /* Can never fit on the stack */
+        trace->failed = true;
+        protect_code_buffer(trace_buffer, TRACE_CODE_SIZE,
+                            PROT_READ | PROT_EXEC);
+        return;
+    }
+
+    char *loop = where;
+    where = copy_fragment(where, sf_TraceLoop, sf_TraceLoop_end);
+    patch_fragment(loop, sf_TraceLoop, sf_TraceLoop_steps, trace->length);
+    patch_fragment(loop, sf_TraceLoop, sf_TraceLoop_lo, -trace->lo);
+    patch_fragment(loop, sf_TraceLoop, sf_TraceLoop_range,
+                   trace->hi - trace->lo);
+    patch_fragment(loop, sf_TraceLoop, sf_TraceLoop_back,
+                   iteration - (loop + (sf_TraceLoop_back - sf_TraceLoop)));
+    patch_fragment(loop, sf_TraceLoop, sf_TraceLoop_pc, recorder.head);
+    trace_buffer_used += where - code;
+    protect_code_buffer(trace_buffer, TRACE_CODE_SIZE,
+                        PROT_READ | PROT_EXEC);
+
+    trace->code = (trace_code_t*)code;
+    trace->sr = dec[recorder.head].sr;
+    dec[recorder.head].sr = trace_sr;
+}
+
+void record_step(decode_t *dec, uint32_t pc, int32_t stack_capacity,
+                        const void *trace_sr) {
+    if (pc == recorder.head && recorder.length > 0) {
+        compile_trace(dec, stack_capacity, trace_sr);
+        recorder.active = false;
+        return;
+    }
+    /* Give up on instructions without fragments, on other traces
+       and on paths that do not come back soon */
+    if (recorder.length == MAX_TRACE_LENGTH
+        || !fragments[dec[pc].opcode].start
+        || dec[pc].sr == trace_sr) {
+        traces[recorder.head].failed = true;
+        recorder.active = false;
+        return;
+    }
+    recorder.pcs[recorder.length++] = pc;
+}
@@ -0,0 +1,97 @@
+/*  fragments.h - host code glued from copies of code fragments for
+    the dynamic superinstructions and the traces of threaded-cached.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef FRAGMENTS_H_
+#define FRAGMENTS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common.h"
+
+/*** Dynamic superinstructions ***/
+
+typedef void super_code_t(cpu_t *pcpu) __attribute__((sysv_abi));
+
+typedef struct {
+    super_code_t *code; /* NULL if no superinstruction starts here */
+    const void *sr;     /* unfused handler of the first instruction */
+    int32_t lo, hi;     /* range of SP for which the run cannot fail */
+    uint32_t length;    /* instructions in the run */
+} super_t;
+
+extern super_t *supers; /* by PC of the first instruction */
+
+/* Find runs of instructions worth fusing in the whole decoded program,
+   fill in supers and point the decoded service routines of the runs
+   to super_sr, which runs the superinstruction. supers is for the
+   caller to free */
+void compile_supers(decode_t *dec, uint32_t size, int32_t stack_capacity,
+                    const void *super_sr);
+
+/*** Traces of hot loops ***/
+
+#define MAX_TRACE_LENGTH 64
+
+/* Gets the step count at which the last iteration may start */
+typedef void trace_code_t(cpu_t *pcpu, uint64_t last_start)
+    __attribute__((sysv_abi));
+
+typedef struct {
+    trace_code_t *code; /* NULL if no trace starts here */
+    const void *sr;     /* handler of the first instruction */
+    int32_t lo, hi;     /* range of SP for which an iteration cannot fail */
+    uint32_t length;    /* instructions in an iteration */
+    uint32_t heat;      /* backward branches seen to here */
+    bool failed;        /* the loop cannot be traced */
+} trace_t;
+
+/* By PC of the loop header, zeroed by the caller before the run */
+extern trace_t *traces;
+
+typedef struct {
+    bool active;
+    uint32_t head; /* loop header, where the trace starts and ends */
+    uint32_t length;
+    uint32_t pcs[MAX_TRACE_LENGTH];
+} recorder_t;
+
+extern recorder_t recorder;
+
+/* Count a taken backward branch to the loop header at head, and start
+   recording the loop once it is hot */
+void count_loop(uint32_t head, uint32_t program_size);
+
+/* Add the instruction at pc to the trace being recorded. Back at the loop
+   header, compile the trace and point the decoded service routine of
+   the header to trace_sr, which runs the trace */
+void record_step(decode_t *dec, uint32_t pc, int32_t stack_capacity,
+                 const void *trace_sr);
+
+#endif /* FRAGMENTS_H_ */
@@ -0,0 +1,475 @@
+/*  interleaved.c - a threaded interpreter with pre-decoding that runs several
+    virtual machines in one dispatch loop, a block of each in turn.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#define _DEFAULT_SOURCE /* for open_memstream() */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+
+#include "common.h"
+
+/* Virtual machines run together by the standalone variant */
+#ifndef VMS
+#define VMS 4
+#endif
+
+static inline decode_t decode_at_address(const Instr_t* prog, uint32_t size,
+                                         uint32_t addr, FILE *out) {
+    assert(addr < size);
+    decode_t result = {0};
+    Instr_t raw_instr = prog[addr];
+    result.opcode = raw_instr;
+    switch (raw_instr) {
+    case Instr_Nop:
+    case Instr_Halt:
+    case Instr_Print:
+    case Instr_Swap:
+    case Instr_Dup:
+    case Instr_Inc:
+    case Instr_Add:
+    case Instr_Sub:
+    case Instr_Mul:
+    case Instr_Rand:
+    case Instr_Dec:
+    case Instr_Drop:
+    case Instr_Over:
+    case Instr_Mod:
+    case Instr_And:
+    case Instr_Or:
+    case Instr_Xor:
+    case Instr_SHL:
+    case Instr_SHR:
+    case Instr_Rot:
+    case Instr_SQRT:
+    case Instr_Pick:
+        result.length = 1;
+        break;
+    case Instr_Push:
+    case Instr_JNE:
+    case Instr_JE:
+    case Instr_Jump:
+        if (!(addr+1 < size)) {
+            fprintf(out, "PC+1 out of bounds\n");
+            result.length = 1;
+            result.opcode = Instr_Break;
+            break;
+        }
+        result.length = 2;
+        result.immediate = (int32_t)prog[addr+1];
+        break;
+    case Instr_Break:
+    default: /* Undefined instructions equal to Break */
+        result.length = 1;
+        result.opcode = Instr_Break;
+        break;
+    }
+    return result;
+}
+
+/*** Service routines ***/
+
+/* A VM that stops or reaches its step limit gives up its turn, and so
+   does every VM after a taken branch, so that the host works on blocks of
+   independent VMs back to back and can overlap them. Branches not taken
+   go on with the same VM, switching is not free */
+#define BAIL_ON_ERROR() if (cpu.state != Cpu_Running) goto next_vm;
+
+#define ADVANCE_PC() \
+    cpu.pc += decoded.length;\
+    cpu.steps++; \
+    if (cpu.state != Cpu_Running || cpu.steps >= steplimit) goto next_vm;
+
+#define END_BLOCK() goto next_vm
+
+/* Running off the end of the program right at the step limit is not
+   an error */
+#define DISPATCH()\
+    if (!(cpu.pc < cpu.program_size)) { \
+        if (cpu.steps < steplimit) cpu.state = Cpu_Break; \
+        goto next_vm; \
+    }; \
+    if (!decoded_cache[cpu.pc].sr) \
+        decode_lazily(decoded_cache, service_routines, \
+                      cpu.pmem, cpu.program_size, cpu.pc, cpu.out); \
+    decoded = decoded_cache[cpu.pc]; \
+    goto *decoded.sr;
+
+#define PUSH(v)   push(&cpu, (v))
+#define POP()     pop(&cpu)
+#define PICK(pos) pick(&cpu, (pos))
+
+static inline void push(cpu_t *pcpu, uint32_t v) {
+    assert(pcpu);
+    if (pcpu->sp >= pcpu->stack_capacity-1) {
+        fprintf(pcpu->out, "Stack overflow\n");
+        pcpu->state = Cpu_Break;
+        return;
+    }
+    pcpu->stack[++pcpu->sp] = v;
+}
+
+static inline uint32_t pop(cpu_t *pcpu) {
+    assert(pcpu);
+    if (pcpu->sp < 0) {
+        fprintf(pcpu->out, "Stack underflow\n");
+        pcpu->state = Cpu_Break;
+        return 0;
+    }
+    return pcpu->stack[pcpu->sp--];
+}
+
+static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
+    assert(pcpu);
+    if (pcpu->sp - 1 < pos) {
+        fprintf(pcpu->out, "Out of bound picking\n");
+        pcpu->state = Cpu_Break;
+        return 0;
+    }
+    return pcpu->stack[pcpu->sp - pos];
+}
+
+static void decode_lazily(decode_t *dec, const void* *in_sr,
+                          const Instr_t *prog, uint32_t size, uint32_t pc,
+                          FILE *out) {
+    assert(dec);
+    assert(in_sr);
+    assert(prog);
+    decode_t decoded = decode_at_address(prog, size, pc, out);
+    decoded.sr = in_sr[decoded.opcode];
+    dec[pc] = decoded;
+}
+
+/* Runs the CPUs in turn, a block of instructions of each up to a taken
+   branch, until one of them stops or reaches its step limit. Returns
+   the index of that CPU. All of them have to be running and below their
+   limits */
+unsigned run_interleaved(cpu_t *const *cpus, const uint64_t *steplimits,
+                         unsigned count) {
+    assert(cpus);
+    assert(steplimits);
+    assert(count > 0);
+
+    const void* service_routines[] = {
+        &&sr_Break, &&sr_Nop, &&sr_Halt, &&sr_Push, &&sr_Print,
+        &&sr_Jne, &&sr_Swap, &&sr_Dup, &&sr_Je, &&sr_Inc,
+        &&sr_Add, &&sr_Sub, &&sr_Mul, &&sr_Rand, &&sr_Dec,
+        &&sr_Drop, &&sr_Over, &&sr_Mod, &&sr_Jump,
+        &&sr_And, &&sr_Or, &&sr_Xor,
+        &&sr_SHL, &&sr_SHR,
+        &&sr_SQRT, &&sr_Rot, &&sr_Pick,
+        NULL
+    };
+
+    /* Every CPU has its own program, decoded as it runs */
+    decode_t **decoded_caches = calloc(count, sizeof(decode_t*));
+    if (!decoded_caches) {
+        fprintf(stderr, "Failed to allocate memory for decoded programs.\n");
+        exit(2);
+    }
+    for (unsigned i = 0; i < count; i++) {
+        assert(cpus[i]->state == Cpu_Running);
+        assert(cpus[i]->steps < steplimits[i]);
+        decoded_caches[i] = calloc(cpus[i]->program_size, sizeof(decode_t));
+        if (!decoded_caches[i]) {
+            fprintf(stderr,
+                    "Failed to allocate memory for decoded programs.\n");
+            exit(2);
+        }
+    }
+
+    unsigned current = 0;
+    cpu_t cpu = *cpus[current];
+    decode_t *decoded_cache = decoded_caches[current];
+    uint64_t steplimit = steplimits[current];
+
+    uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
+    decode_t decoded = {0};
+    DISPATCH();
+    sr_Nop:
+        /* Do nothing */
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Halt:
+        cpu.state = Cpu_Halted;
+        ADVANCE_PC();
+        /* No need to dispatch after Halt */
+    sr_Push:
+        PUSH(decoded.immediate);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Print:
+        tmp1 = POP(); BAIL_ON_ERROR();
+        fprintf(cpu.out, "[%d]\n", tmp1);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Swap:
+        tmp1 = POP();
+        tmp2 = POP();
+        BAIL_ON_ERROR();
+        PUSH(tmp1);
+        PUSH(tmp2);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Dup:
+        tmp1 = POP();
+        BAIL_ON_ERROR();
+        PUSH(tmp1);
+        PUSH(tmp1);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Over:
+        tmp1 = POP();
+        tmp2 = POP();
+        BAIL_ON_ERROR();
+        PUSH(tmp2);
+        PUSH(tmp1);
+        PUSH(tmp2);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Inc:
+        tmp1 = POP();
+        BAIL_ON_ERROR();
+        PUSH(tmp1+1);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Add:
+        tmp1 = POP();
+        tmp2 = POP();
+        BAIL_ON_ERROR();
+        PUSH(tmp1 + tmp2);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Sub:
+        tmp1 = POP();
+        tmp2 = POP();
+        BAIL_ON_ERROR();
+        PUSH(tmp1 - tmp2);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Mod:
+        tmp1 = POP();
+        tmp2 = POP();
+        BAIL_ON_ERROR();
+        if (tmp2 == 0) {
+            cpu.state = Cpu_Break;
+            goto next_vm;
+        }
+        PUSH(tmp1 % tmp2);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Mul:
+        tmp1 = POP();
+        tmp2 = POP();
+        BAIL_ON_ERROR();
+        PUSH(tmp1 * tmp2);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Rand:
+        tmp1 = rand();
+        PUSH(tmp1);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Dec:
+        tmp1 = POP();
+        BAIL_ON_ERROR();
+        PUSH(tmp1-1);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Drop:
+        (void)POP();
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Je:
+        tmp1 = POP();
+        BAIL_ON_ERROR();
+        if (tmp1 == 0) {
+            cpu.pc += decoded.immediate;
+            ADVANCE_PC();
+            END_BLOCK();
+        }
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Jne:
+        tmp1 = POP();
+        BAIL_ON_ERROR();
+        if (tmp1 != 0) {
+            cpu.pc += decoded.immediate;
+            ADVANCE_PC();
+            END_BLOCK();
+        }
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Jump:
+        cpu.pc += decoded.immediate;
+        ADVANCE_PC();
+        END_BLOCK();
+    sr_And:
+        tmp1 = POP();
+        tmp2 = POP();
+        BAIL_ON_ERROR();
+        PUSH(tmp1 & tmp2);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Or:
+        tmp1 = POP();
+        tmp2 = POP();
+        BAIL_ON_ERROR();
+        PUSH(tmp1 | tmp2);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Xor:
+        tmp1 = POP();
+        tmp2 = POP();
+        BAIL_ON_ERROR();
+        PUSH(tmp1 ^ tmp2);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_SHL:
+        tmp1 = POP();
+        tmp2 = POP();
+        BAIL_ON_ERROR();
+        PUSH(tmp1 << tmp2);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_SHR:
+        tmp1 = POP();
+        tmp2 = POP();
+        BAIL_ON_ERROR();
+        PUSH(tmp1 >> tmp2);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Rot:
+        tmp1 = POP();
+        tmp2 = POP();
+        tmp3 = POP();
+        BAIL_ON_ERROR();
+        PUSH(tmp1);
+        PUSH(tmp3);
+        PUSH(tmp2);
+        ADVANCE_PC();
+        DISPATCH();
+    sr_SQRT:
+        tmp1 = POP();
+        BAIL_ON_ERROR();
+        PUSH(sqrt(tmp1));
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Pick:
+        tmp1 = POP();
+        BAIL_ON_ERROR();
+        PUSH(PICK(tmp1));
+        ADVANCE_PC();
+        DISPATCH();
+    sr_Break:
+        cpu.state = Cpu_Break;
+        ADVANCE_PC();
+        /* No need to dispatch after Break */
+
+    next_vm:
+        *cpus[current] = cpu;
+        if (cpu.state == Cpu_Running && cpu.steps < steplimit) {
+            current = current + 1 < count ? current + 1 : 0;
+            cpu = *cpus[current];
+            decoded_cache = decoded_caches[current];
+            steplimit = steplimits[current];
+            DISPATCH();
+        }
+
+    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
+    for (unsigned i = 0; i < count; i++)
+        free(decoded_caches[i]);
+    free(decoded_caches);
+    return current;
+}
+
+#ifndef STACKVM_LIBRARY
+/* Runs VMS instances of the program, all of them to the end, and prints
+   the output and the end state of each in turn */
+int main(int argc, char **argv) {
+    uint64_t steplimit = parse_args(argc, argv);
+    cpu_t cpus[VMS];
+    cpu_t *running[VMS];
+    uint64_t steplimits[VMS];
+    char *text[VMS] = {0};
+    size_t text_size[VMS] = {0};
+    for (unsigned i = 0; i < VMS; i++) {
+        cpus[i] = init_cpu();
+        cpus[i].out = open_memstream(&text[i], &text_size[i]);
+        if (cpus[i].out == NULL) {
+            fprintf(stderr, "Failed to allocate memory for output.\n");
+            exit(2);
+        }
+    }
+
+    while (true) {
+        unsigned count = 0;
+        for (unsigned i = 0; i < VMS; i++) {
+            if (cpus[i].state == Cpu_Running && cpus[i].steps < steplimit) {
+                running[count] = &cpus[i];
+                steplimits[count++] = steplimit;
+            }
+        }
+        if (count == 0)
+            break;
+        run_interleaved(running, steplimits, count);
+    }
+
+    int ret = 0;
+    for (unsigned i = 0; i < VMS; i++) {
+        const cpu_t cpu = cpus[i];
+        fclose(cpu.out);
+        printf("== instance %u\n", i);
+        fwrite(text[i], 1, text_size[i], stdout);
+        free(text[i]);
+
+        /* Print CPU state */
+        printf("CPU executed %ld steps. End state \"%s\".\n",
+                cpu.steps, cpu.state == Cpu_Halted? "Halted":
+                           cpu.state == Cpu_Running? "Running": "Break");
+        printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
+        printf("Stack: ");
+        for (int32_t j=cpu.sp; j >= 0 ; j--) {
+            printf("%#10x ", cpu.stack[j]);
+        }
+        printf("%s\n", cpu.sp == -1? "(empty)": "");
+        if (!(cpu.state == Cpu_Halted ||
+              (cpu.state == Cpu_Running && cpu.steps == steplimit)))
+            ret = 1;
+        free(cpu.stack);
+    }
+    unload_program();
+    return ret;
+}
+#endif
@@ -0,0 +1,510 @@
+/*  lockstep.c - an interpreter running many instances of a program side by side
+    in lanes of vector registers.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#define _DEFAULT_SOURCE /* for open_memstream() and getline() */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <math.h>
+
+#include "common.h"
+
+/* Instances of the program run side by side, one in each lane of a vector.
+   Eight lanes of 32 bits fill an AVX2 register, build with -DLANES=16 and
+   -mavx512f to fill an AVX-512 one */
+#ifndef LANES
+#define LANES 8
+#endif
+_Static_assert(LANES >= 1 && LANES <= 32 && (LANES & (LANES - 1)) == 0,
+               "Lanes are a power of two, tracked in 32-bit masks");
+
+typedef uint32_t lanes_t __attribute__((vector_size(LANES * sizeof(uint32_t))));
+typedef uint32_t lane_mask_t; /* One bit per lane */
+
+/* Instances of a batch. The scalar part of the CPU of every lane is here,
+   up to date while the lane is not running. The stacks are kept as
+   a structure of arrays: entry i of the stack of lane l is stack[i][l] */
+typedef struct {
+    uint32_t pc[LANES];
+    int32_t sp[LANES];
+    cpu_state_t state[LANES];
+    uint64_t steps[LANES];
+    FILE *out[LANES];
+    lanes_t *stack;
+    lane_mask_t used; /* Lanes holding an instance */
+    const Instr_t *pmem;
+    uint32_t program_size;
+    int32_t stack_capacity;
+    cpu_t scratch; /* To run single lanes with the switched interpreter */
+} batch_t;
+
+/* Lanes at the same PC with the same SP run together as a group.
+   Instructions apply to all lanes, only the writes are masked */
+typedef struct {
+    uint32_t pc;
+    int32_t sp;
+    lane_mask_t mask;
+} group_t;
+
+void run_switched(cpu_t *pcpu, uint64_t steplimit);
+
+#define FOR_EACH_LANE(l, m) \
+    for (unsigned l = 0; l < LANES; l++) if ((m) & (1u << l))
+
+static inline bool is_live(const batch_t *b, unsigned l, uint64_t steplimit) {
+    return (b->used & (1u << l)) && b->state[l] == Cpu_Running
+           && b->steps[l] < steplimit;
+}
+
+/* Picks the group of the live lane with the lowest PC, so that lanes left
+   behind catch up with the others and groups merge where paths join again.
+   Tells where the nearest lane outside of the group is to yield to it */
+static bool next_group(const batch_t *b, uint64_t steplimit, group_t *g,
+                       uint32_t *next_pc, int32_t *next_sp) {
+    int first = -1;
+    for (unsigned l = 0; l < LANES; l++) {
+        if (is_live(b, l, steplimit) &&
+            (first < 0 || b->pc[l] < b->pc[first]))
+            first = l;
+    }
+    if (first < 0)
+        return false;
+
+    g->pc = b->pc[first];
+    g->sp = b->sp[first];
+    g->mask = 0;
+    *next_pc = UINT32_MAX;
+    *next_sp = -1;
+    for (unsigned l = 0; l < LANES; l++) {
+        if (!is_live(b, l, steplimit))
+            continue;
+        if (b->pc[l] == g->pc && b->sp[l] == g->sp) {
+            g->mask |= 1u << l;
+        } else if (b->pc[l] < *next_pc) {
+            *next_pc = b->pc[l];
+            *next_sp = b->sp[l];
+        }
+    }
+    return true;
+}
+
+/* Runs one instruction of a lane with the switched interpreter. Used for
+   whatever the vector code leaves out: errors with their messages, and
+   running off the end of the program */
+static void step_lane(batch_t *b, unsigned l) {
+    cpu_t *c = &b->scratch;
+    for (int32_t i = 0; i <= b->sp[l]; i++)
+        c->stack[i] = b->stack[i][l];
+    c->pc = b->pc[l];
+    c->sp = b->sp[l];
+    c->state = Cpu_Running;
+    c->steps = b->steps[l];
+    c->out = b->out[l];
+
+    run_switched(c, c->steps + 1);
+
+    for (int32_t i = 0; i <= c->sp; i++)
+        b->stack[i][l] = c->stack[i];
+    b->pc[l] = c->pc;
+    b->sp[l] = c->sp;
+    b->state[l] = c->state;
+    b->steps[l] = c->steps;
+}
+
+static void flush_group(batch_t *b, lane_mask_t mask, uint32_t pc, int32_t sp,
+                        cpu_state_t state, uint64_t count) {
+    FOR_EACH_LANE(l, mask) {
+        b->pc[l] = pc;
+        b->sp[l] = sp;
+        b->state[l] = state;
+        b->steps[l] += count;
+    }
+}
+
+/* Stack entries counting from the top of the group, 0 is the top */
+#define S(k) stack[sp + (k)]
+/* Lanes outside of the group keep what they have in the same slot */
+#define WRITE(k, v) (S(k) = ((v) & mask) | (S(k) & ~mask))
+/* Leaves to step_lane() what would overflow or underflow the stack */
+#define NEEDS(in, grows) do { \
+        if (sp < (in) - 1 || sp + (grows) > capacity - 1) goto single; \
+    } while (0)
+#define IMMEDIATE() do { \
+        if (!(pc + 1 < size)) goto single; \
+        imm = (int32_t)pmem[pc + 1]; \
+        length = 2; \
+    } while (0)
+
+/* Runs the group until it stops, diverges at a branch, reaches the step
+   limit or gets ahead of the lanes at next_pc */
+static void run_group(batch_t *b, group_t g, uint32_t next_pc, int32_t next_sp,
+                      uint64_t steplimit) {
+    lanes_t *stack = b->stack;
+    const Instr_t *pmem = b->pmem;
+    const uint32_t size = b->program_size;
+    const int32_t capacity = b->stack_capacity;
+    uint32_t pc = g.pc;
+    int32_t sp = g.sp;
+    cpu_state_t state = Cpu_Running;
+    uint64_t count = 0;
+    uint64_t budget = UINT64_MAX; /* Steps until a lane hits the limit */
+    lanes_t mask;
+    for (unsigned l = 0; l < LANES; l++) {
+        mask[l] = g.mask & (1u << l) ? UINT32_MAX : 0;
+        if ((g.mask & (1u << l)) && steplimit - b->steps[l] < budget)
+            budget = steplimit - b->steps[l];
+    }
+    lane_mask_t taken = 0;
+    uint32_t target = 0;
+
+    while (true) {
+        if (!(pc < size))
+            goto single;
+        uint32_t length = 1;
+        int32_t imm = 0;
+        lanes_t t = {0};
+        switch (pmem[pc]) {
+        case Instr_Nop:
+            break;
+        case Instr_Halt:
+            state = Cpu_Halted;
+            break;
+        case Instr_Push:
+            IMMEDIATE();
+            NEEDS(0, 1);
+            sp++;
+            WRITE(0, t + (uint32_t)imm);
+            break;
+        case Instr_Print:
+            NEEDS(1, 0);
+            FOR_EACH_LANE(l, g.mask)
+                fprintf(b->out[l], "[%d]\n", S(0)[l]);
+            sp--;
+            break;
+        case Instr_JE:
+        case Instr_JNE:
+            IMMEDIATE();
+            NEEDS(1, 0);
+            taken = 0;
+            FOR_EACH_LANE(l, g.mask)
+                if ((S(0)[l] == 0) == (pmem[pc] == Instr_JE))
+                    taken |= 1u << l;
+            sp--;
+            if (taken == g.mask) {
+                pc += imm;
+            } else if (taken != 0) {
+                /* Lanes go separate ways until their PCs meet again */
+                target = pc + length + imm;
+                pc += length;
+                count++;
+                goto diverge;
+            }
+            break;
+        case Instr_Jump:
+            IMMEDIATE();
+            pc += imm;
+            break;
+        case Instr_Swap:
+            NEEDS(2, 0);
+            t = S(0);
+            WRITE(0, S(-1));
+            WRITE(-1, t);
+            break;
+        case Instr_Dup:
+            NEEDS(1, 1);
+            sp++;
+            WRITE(0, S(-1));
+            break;
+        case Instr_Over:
+            NEEDS(2, 1);
+            sp++;
+            WRITE(0, S(-2));
+            break;
+        case Instr_Inc:
+            NEEDS(1, 0);
+            WRITE(0, S(0) + 1);
+            break;
+        case Instr_Dec:
+            NEEDS(1, 0);
+            WRITE(0, S(0) - 1);
+            break;
+        case Instr_Drop:
+            NEEDS(1, 0);
+            sp--;
+            break;
+        case Instr_Add:
+            NEEDS(2, 0);
+            WRITE(-1, S(0) + S(-1));
+            sp--;
+            break;
+        case Instr_Sub:
+            NEEDS(2, 0);
+            WRITE(-1, S(0) - S(-1));
+            sp--;
+            break;
+        case Instr_Mul:
+            NEEDS(2, 0);
+            WRITE(-1, S(0) * S(-1));
+            sp--;
+            break;
+        case Instr_Mod:
+            NEEDS(2, 0);
+            FOR_EACH_LANE(l, g.mask)
+                if (S(-1)[l] == 0)
+                    goto single;
+            /* Lanes outside of the group must not divide by zero either */
+            WRITE(-1, S(0) % (S(-1) | ~mask));
+            sp--;
+            break;
+        case Instr_And:
+            NEEDS(2, 0);
+            WRITE(-1, S(0) & S(-1));
+            sp--;
+            break;
+        case Instr_Or:
+            NEEDS(2, 0);
+            WRITE(-1, S(0) | S(-1));
+            sp--;
+            break;
+        case Instr_Xor:
+            NEEDS(2, 0);
+            WRITE(-1, S(0) ^ S(-1));
+            sp--;
+            break;
+        /* Shift counts wrap around as they do for x86 scalar shifts */
+        case Instr_SHL:
+            NEEDS(2, 0);
+            WRITE(-1, S(0) << (S(-1) & 31));
+            sp--;
+            break;
+        case Instr_SHR:
+            NEEDS(2, 0);
+            WRITE(-1, S(0) >> (S(-1) & 31));
+            sp--;
+            break;
+        case Instr_Rot:
+            NEEDS(3, 0);
+            t = S(0);
+            WRITE(0, S(-1));
+            WRITE(-1, S(-2));
+            WRITE(-2, t);
+            break;
+        case Instr_Rand:
+            NEEDS(0, 1);
+            sp++;
+            FOR_EACH_LANE(l, g.mask)
+                t[l] = rand();
+            WRITE(0, t);
+            break;
+        case Instr_SQRT:
+            NEEDS(1, 0);
+            t = S(0);
+            FOR_EACH_LANE(l, g.mask)
+                t[l] = sqrt(t[l]);
+            WRITE(0, t);
+            break;
+        case Instr_Pick:
+            NEEDS(1, 0);
+            t = S(0);
+            FOR_EACH_LANE(l, g.mask) {
+                int32_t pos = t[l];
+                if (pos < 0 || sp - 2 < pos)
+                    goto single;
+                t[l] = stack[sp - 1 - pos][l];
+            }
+            WRITE(0, t);
+            break;
+        case Instr_Break:
+        default: /* Undefined instructions equal to Break */
+            state = Cpu_Break;
+            break;
+        }
+        pc += length;
+        count++;
+        if (state != Cpu_Running || count == budget)
+            break;
+        if (pc > next_pc || (pc == next_pc && sp == next_sp))
+            break;
+    }
+    flush_group(b, g.mask, pc, sp, state, count);
+    return;
+
+diverge:
+    flush_group(b, g.mask & ~taken, pc, sp, state, count);
+    flush_group(b, taken, target, sp, state, count);
+    return;
+
+single:
+    flush_group(b, g.mask, pc, sp, state, count);
+    FOR_EACH_LANE(l, g.mask)
+        step_lane(b, l);
+}
+
+static void run_batch(batch_t *b, uint64_t steplimit) {
+    group_t g;
+    uint32_t next_pc;
+    int32_t next_sp;
+    while (next_group(b, steplimit, &g, &next_pc, &next_sp))
+        run_group(b, g, next_pc, next_sp, steplimit);
+}
+
+/* Initial stacks of the instances, one per line of the file with values
+   from the bottom of the stack up. Lines starting with # are comments */
+typedef struct {
+    uint32_t *values; /* stack_capacity entries for each instance */
+    int32_t *sp;
+    uint32_t count;
+} init_stacks_t;
+
+static init_stacks_t read_init_stacks(const char *path, int32_t capacity) {
+    init_stacks_t stacks = {0};
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        exit(2);
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    uint32_t allocated = 0;
+    while (getline(&line, &line_size, f) != -1) {
+        if (line[0] == '#')
+            continue;
+        if (stacks.count == allocated) {
+            allocated = allocated ? allocated * 2 : LANES;
+            stacks.values = realloc(stacks.values, (size_t)allocated
+                                    * capacity * sizeof(uint32_t));
+            stacks.sp = realloc(stacks.sp, allocated * sizeof(int32_t));
+            if (stacks.values == NULL || stacks.sp == NULL) {
+                fprintf(stderr, "Failed to allocate memory for stacks.\n");
+                exit(2);
+            }
+        }
+        uint32_t *values = stacks.values + (size_t)stacks.count * capacity;
+        int32_t sp = -1;
+        char *p = line;
+        while (true) {
+            char *end;
+            errno = 0;
+            unsigned long v = strtoul(p, &end, 0);
+            if (end == p)
+                break;
+            if (errno || v > UINT32_MAX || sp == capacity - 1) {
+                fprintf(stderr, "%s:%u: bad value or too many values\n",
+                        path, stacks.count + 1);
+                exit(2);
+            }
+            values[++sp] = v;
+            p = end;
+        }
+        stacks.sp[stacks.count++] = sp;
+    }
+    free(line);
+    fclose(f);
+    return stacks;
+}
+
+int main(int argc, char **argv) {
+    ExtraOptions = Option_InitStacks;
+    uint64_t steplimit = parse_args(argc, argv);
+    cpu_t cpu = init_cpu();
+    const int32_t capacity = cpu.stack_capacity;
+
+    init_stacks_t stacks = {.count = LANES};
+    if (InitStacksFile)
+        stacks = read_init_stacks(InitStacksFile, capacity);
+
+    batch_t b = {.pmem = cpu.pmem, .program_size = cpu.program_size,
+                 .stack_capacity = capacity, .scratch = cpu};
+    b.stack = aligned_alloc(sizeof(lanes_t), capacity * sizeof(lanes_t));
+    if (b.stack == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the stacks.\n");
+        exit(2);
+    }
+
+    int ret = 0;
+    for (uint32_t first = 0; first < stacks.count; first += LANES) {
+        char *text[LANES] = {0};
+        size_t text_size[LANES] = {0};
+        memset(b.stack, 0, capacity * sizeof(lanes_t));
+        b.used = 0;
+        for (unsigned l = 0; l < LANES && first + l < stacks.count; l++) {
+            int32_t sp = stacks.values ? stacks.sp[first + l] : -1;
+            for (int32_t i = 0; i <= sp; i++)
+                b.stack[i][l] =
+                    stacks.values[(size_t)(first + l) * capacity + i];
+            b.pc[l] = 0;
+            b.sp[l] = sp;
+            b.state[l] = Cpu_Running;
+            b.steps[l] = 0;
+            b.out[l] = open_memstream(&text[l], &text_size[l]);
+            if (b.out[l] == NULL) {
+                fprintf(stderr, "Failed to allocate memory for output.\n");
+                exit(2);
+            }
+            b.used |= 1u << l;
+        }
+
+        run_batch(&b, steplimit);
+
+        FOR_EACH_LANE(l, b.used) {
+            fclose(b.out[l]);
+            printf("== instance %u\n", first + l);
+            fwrite(text[l], 1, text_size[l], stdout);
+            free(text[l]);
+
+            /* Print CPU state */
+            printf("CPU executed %ld steps. End state \"%s\".\n",
+                    b.steps[l], b.state[l] == Cpu_Halted? "Halted":
+                                b.state[l] == Cpu_Running? "Running": "Break");
+            printf("PC = %#x, SP = %d\n", b.pc[l], b.sp[l]);
+            printf("Stack: ");
+            for (int32_t i = b.sp[l]; i >= 0 ; i--) {
+                printf("%#10x ", b.stack[i][l]);
+            }
+            printf("%s\n", b.sp[l] == -1? "(empty)": "");
+
+            if (!(b.state[l] == Cpu_Halted ||
+                  (b.state[l] == Cpu_Running && b.steps[l] == steplimit)))
+                ret = 1;
+        }
+    }
+
+    free(b.stack);
+    free(stacks.values);
+    free(stacks.sp);
+    free(cpu.stack);
+    unload_program();
+    return ret;
+}
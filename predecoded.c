@@ -34,11 +34,24 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <errno.h>
 #include <limits.h>
 #include <math.h>
+#include <inttypes.h>
+#include <string.h>
 
 #include "common.h"
+#include "stackcache.h"
+#ifdef STATIC_SUPER
+#include "superinstructions.h"
+#endif
+#ifdef GUARD_PAGES
+#include <signal.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
-static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
-    assert(addr < PROGRAM_SIZE);
+static inline decode_t decode_at_address(const Instr_t* prog, uint32_t size,
+                                         uint32_t addr) {
+    assert(addr < size);
     decode_t result = {0};
     Instr_t raw_instr = prog[addr];
     result.opcode = raw_instr;
@@ -72,7 +85,7 @@ static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
     case Instr_JE:
     case Instr_Jump:
         result.length = 2;
-        if (!(addr+1 < PROGRAM_SIZE)) {
+        if (!(addr+1 < size)) {
             result.length = 1;
             result.opcode = Instr_Break;
             break;
@@ -93,8 +106,8 @@ static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
 
 static inline void push(cpu_t *pcpu, uint32_t v) {
     assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
+    if (pcpu->sp >= pcpu->stack_capacity-1) {
+        fprintf(pcpu->out, "Stack overflow\n");
         pcpu->state = Cpu_Break;
         return;
     }
@@ -104,7 +117,7 @@ static inline void push(cpu_t *pcpu, uint32_t v) {
 static inline uint32_t pop(cpu_t *pcpu) {
     assert(pcpu);
     if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
+        fprintf(pcpu->out, "Stack underflow\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
@@ -114,40 +127,521 @@ static inline uint32_t pop(cpu_t *pcpu) {
 static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
     assert(pcpu);
     if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
+        fprintf(pcpu->out, "Out of bound picking\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
     return pcpu->stack[pcpu->sp - pos];
 }
 
+/* Decode the whole program ahead of time */
 static void predecode_program(const Instr_t *prog,
-                           decode_t *dec, int len) {
+                           decode_t *dec, uint32_t len) {
     assert(prog);
     assert(dec);
-    /* The program is short, so we can decode it as a whole.
-       Otherwise, some sort of lazy decoding will be required */
-    for (int i=0; i < len; i++) {
-        dec[i] = decode_at_address(prog, i);
+    for (uint32_t i=0; i < len; i++) {
+        dec[i] = decode_at_address(prog, len, i);
     }
 }
 
-int main(int argc, char **argv) {
-    uint64_t steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
+/* Entries of the decoded program have zero length until the instruction
+   is decoded on its first execution, so that large programs start fast
+   and their unused parts stay untouched */
+static decode_t decode_lazily(decode_t *dec, const cpu_t *pcpu) {
+    assert(dec);
+    assert(pcpu);
+    dec[pcpu->pc] = decode_at_address(pcpu->pmem, pcpu->program_size,
+                                      pcpu->pc);
+    return dec[pcpu->pc];
+}
+
+/* Programs that pass verify_stack_depth() run with handlers that neither
+   check stack bounds nor test the state after every instruction.
+   The variants with the stack cache, superinstructions or profiling
+   always run the checked handlers */
+#if !STACK_CACHE && !defined(STATIC_SUPER) && !defined(PROFILE_NGRAMS)
+#define UNCHECKED_HANDLERS
+#elif defined(GUARD_PAGES)
+#error "Guard pages only work with the unchecked handlers"
+#endif
+
+#ifdef GUARD_PAGES
+/*** Guard pages ***/
+
+/* All programs run with the unchecked handlers. The stack and the decoded
+   program are surrounded by inaccessible memory, so that a stack overflow,
+   underflow or a PC out of bounds raise SIGSEGV. The handler returns to
+   run_unchecked(), which gives the instruction at fault to the checked
+   handlers of main() to report the error exactly as they do it */
+#define GUARD_PAGE_SIZE 4096
+/* The stack starts right after a guard page, so that an underflow faults
+   on slot -1. Its mapping is rounded up to whole pages, whatever the
+   capacity, so the handlers that grow the stack check for an overflow,
+   see GROW() */
+/* The decoded program is followed by a single guard page, which catches
+   a PC running off its end. Branches check their targets, see BRANCH() */
+
+static char *stack_region = NULL;
+static size_t stack_region_size = 0;
+static uint32_t *guarded_stack = NULL;
+static char *decoded_region = NULL;
+static size_t decoded_region_size = 0;
+
+static sigjmp_buf fault_env;
+/* The instruction being executed, stored before any of its accesses.
+   Handlers change nothing before the access that may fault, so this is
+   the state to restore after a fault */
+static struct {
+    uint32_t pc;
+    int32_t sp;
+    uint64_t steps;
+} fault_point;
+
+static void on_guard_fault(int sig, siginfo_t *info, void *context) {
+    (void)context;
+    const char *addr = info->si_addr;
+    if ((addr >= stack_region && addr < stack_region + stack_region_size)
+        || (addr >= decoded_region
+            && addr < decoded_region + decoded_region_size))
+        siglongjmp(fault_env, 1);
+    /* Not ours, crash as usual when the access is repeated */
+    signal(sig, SIG_DFL);
+}
+
+static void *map_region(size_t size, int prot) {
+    void *region = mmap(NULL, size, prot,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        exit(2);
+    }
+    return region;
+}
+
+/* Move the stack and the decoded program between guard pages.
+   Returns the guarded copy of the decoded program */
+static decode_t *setup_guard_pages(const decode_t *dec,
+                                   uint32_t program_size,
+                                   uint32_t stack_capacity) {
+    assert(dec);
+    if (sysconf(_SC_PAGESIZE) != GUARD_PAGE_SIZE) {
+        fprintf(stderr, "Guard pages need %d bytes pages\n", GUARD_PAGE_SIZE);
+        exit(2);
+    }
+    const size_t stack_size = stack_capacity * sizeof(uint32_t);
+    const size_t stack_mapped = (stack_size + GUARD_PAGE_SIZE - 1)
+                                / GUARD_PAGE_SIZE * GUARD_PAGE_SIZE;
+    stack_region_size = GUARD_PAGE_SIZE + stack_mapped;
+    stack_region = map_region(stack_region_size, PROT_NONE);
+    guarded_stack = (uint32_t *)(stack_region + GUARD_PAGE_SIZE);
+    if (mprotect(guarded_stack, stack_mapped, PROT_READ | PROT_WRITE)) {
+        perror("mprotect");
+        exit(2);
+    }
+
+    /* The decoded program ends where its guard region starts */
+    const size_t size = program_size * sizeof(decode_t);
+    const size_t mapped = (size + GUARD_PAGE_SIZE - 1)
+                          / GUARD_PAGE_SIZE * GUARD_PAGE_SIZE;
+    decoded_region_size = mapped + GUARD_PAGE_SIZE;
+    decoded_region = map_region(decoded_region_size, PROT_NONE);
+    if (mprotect(decoded_region, mapped, PROT_READ | PROT_WRITE)) {
+        perror("mprotect");
+        exit(2);
+    }
+    decode_t *guarded = (decode_t *)(decoded_region + mapped - size);
+    memcpy(guarded, dec, size);
 
-    decode_t decoded_cache[PROGRAM_SIZE];
-    predecode_program(cpu.pmem, decoded_cache, PROGRAM_SIZE);
+    struct sigaction action = {0};
+    action.sa_sigaction = on_guard_fault;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, NULL)) {
+        perror("sigaction");
+        exit(2);
+    }
+    return guarded;
+}
+
+#define STACK(i) stack[i]
+/* Reads a slot whose value is not needed, so that an underflow faults */
+#define PROBE(i) ((void)*(volatile uint32_t *)&STACK(i))
+/* Growing past the capacity is left to the checked handlers too */
+#define GROW() { \
+    if (cpu.sp + 1 >= cpu.stack_capacity) \
+        goto stop; \
+    cpu.sp++; \
+}
+/* A branch may go past the guard page, leave such targets to the checked
+   handlers as if the next instruction had faulted */
+#define BRANCH() { \
+    cpu.pc += decoded.immediate; \
+    if ((uint32_t)(cpu.pc + decoded.length) >= cpu.program_size) { \
+        cpu.pc += decoded.length; \
+        cpu.steps++; \
+        goto stop; \
+    } \
+}
+#else
+#define STACK(i) cpu.stack[i]
+#define PROBE(i) ((void)0)
+#define GROW() cpu.sp++
+#define BRANCH() cpu.pc += decoded.immediate
+#endif
+
+#ifdef UNCHECKED_HANDLERS
+#define S(k) STACK(cpu.sp + (k))
+/* Leave after the instruction that stopped the processor */
+#define STOP(new_state) { \
+    cpu.state = (new_state); \
+    cpu.pc += decoded.length; \
+    cpu.steps++; \
+    goto stop; \
+}
+
+static void run_unchecked(cpu_t *pcpu, decode_t *dec,
+                          uint64_t steplimit) {
+    assert(pcpu);
+    assert(dec);
+    cpu_t cpu = *pcpu;
+#ifdef GUARD_PAGES
+    uint32_t *const stack = guarded_stack;
+    for (int i = 0; i < cpu.stack_capacity; i++)
+        STACK(i) = cpu.stack[i];
+    if (sigsetjmp(fault_env, 1)) {
+        /* Let the checked handlers run the instruction at fault */
+        cpu.pc = fault_point.pc;
+        cpu.sp = fault_point.sp;
+        cpu.steps = fault_point.steps;
+        goto stop;
+    }
+#endif
+    while (cpu.steps < steplimit) {
+#ifdef GUARD_PAGES
+        fault_point.pc = cpu.pc;
+        fault_point.sp = cpu.sp;
+        fault_point.steps = cpu.steps;
+        /* Keeps the accesses of the instruction after the stores above */
+        __asm__ __volatile__("" ::: "memory");
+        decode_t decoded = dec[cpu.pc];
+#else
+        if (!(cpu.pc < cpu.program_size)) {
+            fprintf(cpu.out, "PC out of bounds\n");
+            cpu.state = Cpu_Break;
+            break;
+        }
+        decode_t decoded = dec[cpu.pc];
+        if (!decoded.length)
+            decoded = decode_lazily(dec, &cpu);
+#endif
+        uint32_t tmp1 = 0, tmp2 = 0;
+        switch(decoded.opcode) {
+        case Instr_Nop:
+            break;
+        case Instr_Halt:
+            STOP(Cpu_Halted);
+        case Instr_Push:
+            GROW();
+            STACK(cpu.sp) = decoded.immediate;
+            break;
+        case Instr_Print:
+            fprintf(cpu.out, "[%d]\n", STACK(cpu.sp--));
+            break;
+        case Instr_Swap:
+            tmp1 = S(0);
+            S(0) = S(-1);
+            S(-1) = tmp1;
+            break;
+        case Instr_Dup:
+            tmp1 = S(0);
+            GROW();
+            STACK(cpu.sp) = tmp1;
+            break;
+        case Instr_Over:
+            tmp1 = S(-1);
+            GROW();
+            STACK(cpu.sp) = tmp1;
+            break;
+        case Instr_Inc:
+            S(0)++;
+            break;
+        case Instr_Dec:
+            S(0)--;
+            break;
+        case Instr_Add:
+            S(-1) = S(0) + S(-1);
+            cpu.sp--;
+            break;
+        case Instr_Sub:
+            S(-1) = S(0) - S(-1);
+            cpu.sp--;
+            break;
+        case Instr_Mul:
+            S(-1) = S(0) * S(-1);
+            cpu.sp--;
+            break;
+        case Instr_Mod:
+            if (S(-1) == 0) {
+                cpu.sp -= 2;
+                STOP(Cpu_Break);
+            }
+            S(-1) = S(0) % S(-1);
+            cpu.sp--;
+            break;
+        case Instr_Rand:
+            GROW();
+            STACK(cpu.sp) = rand();
+            break;
+        case Instr_Drop:
+            PROBE(cpu.sp);
+            cpu.sp--;
+            break;
+        case Instr_JE:
+            if (STACK(cpu.sp--) == 0)
+                BRANCH();
+            break;
+        case Instr_JNE:
+            if (STACK(cpu.sp--) != 0)
+                BRANCH();
+            break;
+        case Instr_Jump:
+            BRANCH();
+            break;
+        case Instr_And:
+            S(-1) = S(0) & S(-1);
+            cpu.sp--;
+            break;
+        case Instr_Or:
+            S(-1) = S(0) | S(-1);
+            cpu.sp--;
+            break;
+        case Instr_Xor:
+            S(-1) = S(0) ^ S(-1);
+            cpu.sp--;
+            break;
+        case Instr_SHL:
+            S(-1) = S(0) << S(-1);
+            cpu.sp--;
+            break;
+        case Instr_SHR:
+            S(-1) = S(0) >> S(-1);
+            cpu.sp--;
+            break;
+        case Instr_Rot:
+            tmp1 = S(-2);
+            tmp2 = S(-1);
+            S(-2) = S(0);
+            S(-1) = tmp1;
+            S(0) = tmp2;
+            break;
+        case Instr_SQRT:
+            S(0) = sqrt(S(0));
+            break;
+        case Instr_Pick:
+            /* The position is data, so that it is still checked */
+            tmp1 = S(0);
+            if (cpu.sp - 2 < (int32_t)tmp1) {
+                fprintf(cpu.out, "Out of bound picking\n");
+                S(0) = 0;
+                STOP(Cpu_Break);
+            }
+#ifdef GUARD_PAGES
+            /* Positions out of the stack are left to the checked handler */
+            if ((uint32_t)(cpu.sp - 1 - (int32_t)tmp1)
+                >= (uint32_t)cpu.stack_capacity)
+                goto stop;
+#endif
+            S(0) = STACK(cpu.sp - 1 - (int32_t)tmp1);
+            break;
+        case Instr_Break:
+            STOP(Cpu_Break);
+        default:
+            assert("Unreachable" && false);
+            break;
+        }
+        cpu.pc += decoded.length; /* Advance PC */
+        cpu.steps++;
+    }
+stop:
+#ifdef GUARD_PAGES
+    for (int i = 0; i < cpu.stack_capacity; i++)
+        cpu.stack[i] = STACK(i);
+#endif
+    *pcpu = cpu;
+}
+#endif
+
+#ifdef STATIC_SUPER
+#if STACK_CACHE || defined(PROFILE_NGRAMS)
+#error "Superinstructions work with the stack in memory and are not profiled"
+#endif
+
+/* Replace decoded instructions that start a known sequence with
+   a superinstruction. The sequence may also be entered in the middle,
+   its other instructions stay decoded as usual */
+static void fuse_program(const decode_t *plain, decode_t *dec, uint32_t size) {
+    assert(plain);
+    assert(dec);
+    for (uint32_t pc = 0; pc < size; pc++) {
+        for (int i = 0; i < SUPER_COUNT; i++) {
+            uint32_t at = pc;
+            int32_t immediate = 0;
+            int j;
+            for (j = 0; j < SuperLengths[i]; j++) {
+                if (at >= size
+                    || plain[at].opcode != SuperComponents[i][j])
+                    break;
+                if (plain[at].length == 2)
+                    immediate = plain[at].immediate;
+                at += plain[at].length;
+            }
+            if (j < SuperLengths[i])
+                continue;
+            dec[pc].opcode = SUPER_OPCODE(i);
+            dec[pc].length = at - pc;
+            dec[pc].immediate = immediate;
+            break;
+        }
+    }
+}
+
+/* Superinstruction bodies work on the stack in memory, see supergen.c */
+#define SUPER_S(pos) cpu.stack[cpu.sp + (pos)]
+#define SUPER_SP(change) cpu.sp += (change)
+#define SUPER_IMM ((uint32_t)decoded.immediate)
+#define SUPER_CAPACITY cpu.stack_capacity
+#define SUPER_BRANCH(taken) if (taken) cpu.pc += decoded.immediate
+/* Stop at Mod the same way as the case for it does */
+#define SUPER_DIVZERO(done, offset) { \
+    cpu.state = Cpu_Break; \
+    cpu.pc += (offset) + 1 - decoded.length; \
+    cpu.steps += (done); \
+    break; \
+}
+
+/* Run a superinstruction if none of its instructions can fail with stack
+   bounds or hit the step limit. Otherwise execute its first instruction */
+#define SUPER_CASE(i, length, lowest, highest, body) \
+    case SUPER_OPCODE(i): \
+        if (!((uint32_t)(cpu.sp - (lowest)) \
+                <= (uint32_t)((highest) - (lowest)) \
+              && cpu.steps + (length) <= steplimit)) { \
+            decoded = plain_cache[cpu.pc]; \
+            goto execute; \
+        } \
+        body \
+        cpu.steps += (length) - 1; \
+        break;
+#endif
+
+#ifdef PROFILE_NGRAMS
+/* Profiling of sequences of instructions executed one right after another.
+   supergen uses the profile to choose superinstructions */
+#define MAX_NGRAM 5
+#define NGRAMS_FILE "ngrams.prof"
+
+/* ngram_counts[pc][n] counts executions of n instructions starting at pc
+   without branches between them. A branch may only end a sequence */
+static uint64_t (*ngram_counts)[MAX_NGRAM + 1];
+
+/* Write one line per sequence: its count and its instructions */
+static void write_ngrams(const decode_t *dec, uint32_t size) {
+    FILE *f = fopen(NGRAMS_FILE, "w");
+    if (!f) {
+        perror(NGRAMS_FILE);
+        exit(2);
+    }
+    for (uint32_t pc = 0; pc < size; pc++) {
+        for (int n = 2; n <= MAX_NGRAM; n++) {
+            if (!ngram_counts[pc][n])
+                continue;
+            fprintf(f, "%" PRIu64, ngram_counts[pc][n]);
+            uint32_t at = pc;
+            for (int i = 0; i < n; i++) {
+                fprintf(f, " %s", InstrNames[dec[at].opcode]);
+                at += dec[at].length;
+            }
+            fprintf(f, "\n");
+        }
+    }
+    fclose(f);
+}
+#endif
+
+/* Runs the CPU until it stops or the total of executed instructions
+   reaches steplimit. decoded_cache holds program_size entries, zeroed or
+   left by an earlier call for the same program */
+static void run_with_cache(cpu_t *pcpu, uint64_t steplimit,
+                           decode_t *decoded_cache) {
+    assert(pcpu);
+    cpu_t cpu = *pcpu;
+    stack_cache_t cache = {0};
+
+#if defined(STATIC_SUPER) || defined(GUARD_PAGES)
+    /* Superinstructions look ahead, guarded handlers do not check */
+    predecode_program(cpu.pmem, decoded_cache, cpu.program_size);
+#endif
+#ifdef STATIC_SUPER
+    decode_t *plain_cache = malloc(cpu.program_size * sizeof(decode_t));
+    if (!plain_cache) {
+        fprintf(stderr, "Failed to allocate memory for decoded program.\n");
+        exit(2);
+    }
+    memcpy(plain_cache, decoded_cache, cpu.program_size * sizeof(decode_t));
+    fuse_program(plain_cache, decoded_cache, cpu.program_size);
+#endif
+#if defined(GUARD_PAGES)
+    /* Stops before an instruction that faults for the loop below */
+    run_unchecked(&cpu, setup_guard_pages(decoded_cache, cpu.program_size,
+                                          cpu.stack_capacity),
+                  steplimit);
+#elif defined(UNCHECKED_HANDLERS)
+    /* Leaves nothing for the loop below to do. A CPU resumed from an
+       earlier call got there from PC 0 too, so the check still holds */
+    if (verify_stack_depth(cpu.pmem, cpu.program_size, cpu.stack_capacity))
+        run_unchecked(&cpu, decoded_cache, steplimit);
+#endif
+#ifdef PROFILE_NGRAMS
+    ngram_counts = calloc(cpu.program_size, sizeof(*ngram_counts));
+    if (!ngram_counts) {
+        fprintf(stderr, "Failed to allocate memory for the profile.\n");
+        exit(2);
+    }
+    /* Starts of the last instructions executed in a row, most recent first */
+    uint32_t history[MAX_NGRAM - 1];
+    int history_len = 0;
+    uint32_t fallthrough_pc = UINT32_MAX;
+#endif
 
     while (cpu.state == Cpu_Running && cpu.steps < steplimit) {
-        if (!(cpu.pc < PROGRAM_SIZE)) {
-            printf("PC out of bounds\n");
+        if (!(cpu.pc < cpu.program_size)) {
+            fprintf(cpu.out, "PC out of bounds\n");
             cpu.state = Cpu_Break;
             break;
         }
         decode_t decoded = decoded_cache[cpu.pc];
+        if (!decoded.length)
+            decoded = decode_lazily(decoded_cache, &cpu);
+#ifdef PROFILE_NGRAMS
+        if (cpu.pc != fallthrough_pc)
+            history_len = 0;
+        for (int k = 0; k < history_len; k++)
+            ngram_counts[history[k]][k + 2]++;
+        if (history_len < MAX_NGRAM - 1)
+            history_len++;
+        for (int k = history_len - 1; k > 0; k--)
+            history[k] = history[k - 1];
+        history[0] = cpu.pc;
+        fallthrough_pc = decoded.opcode == Instr_JE
+                         || decoded.opcode == Instr_JNE
+                         || decoded.opcode == Instr_Jump ?
+                         UINT32_MAX : cpu.pc + decoded.length;
+#endif
         uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
         /* Execute - a big switch */
+#ifdef STATIC_SUPER
+        execute:
+#endif
         switch(decoded.opcode) {
         case Instr_Nop:
             /* Do nothing */
@@ -156,86 +650,150 @@ int main(int argc, char **argv) {
             cpu.state = Cpu_Halted;
             break;
         case Instr_Push:
-            push(&cpu, decoded.immediate);
+            if (CACHED(0, 1)) {
+                PUSH_CACHED(decoded.immediate);
+                break;
+            }
+            PUSH(decoded.immediate);
             break;
         case Instr_Print:
-            tmp1 = pop(&cpu); BAIL_ON_ERROR();
-            printf("[%d]\n", tmp1);
+            tmp1 = POP(); BAIL_ON_ERROR();
+            fprintf(cpu.out, "[%d]\n", tmp1);
             break;
         case Instr_Swap:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                tmp1 = TOP();
+                SET_TOP(SECOND());
+                SET_SECOND(tmp1);
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
+            PUSH(tmp1);
+            PUSH(tmp2);
             break;
         case Instr_Dup:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 1)) {
+                PUSH_CACHED(TOP());
+                break;
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp1);
+            PUSH(tmp1);
+            PUSH(tmp1);
             break;
         case Instr_Over:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 1)) {
+                PUSH_CACHED(SECOND());
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp2);
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
+            PUSH(tmp2);
+            PUSH(tmp1);
+            PUSH(tmp2);
             break;
         case Instr_Inc:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                SET_TOP(TOP() + 1);
+                break;
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1+1);
+            PUSH(tmp1+1);
             break;
         case Instr_Add:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() + SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 + tmp2);
+            PUSH(tmp1 + tmp2);
             break;
         case Instr_Sub:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() - SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 - tmp2);
+            PUSH(tmp1 - tmp2);
             break;
         case Instr_Mod:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0) && SECOND() != 0) {
+                SET_TOP(TOP() % SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
             if (tmp2 == 0) {
                 cpu.state = Cpu_Break;
                 break;
             }
-            push(&cpu, tmp1 % tmp2);
+            PUSH(tmp1 % tmp2);
             break;
         case Instr_Mul:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() * SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 * tmp2);
+            PUSH(tmp1 * tmp2);
             break;
         case Instr_Rand:
             tmp1 = rand();
-            push(&cpu, tmp1);
+            PUSH(tmp1);
             break;
         case Instr_Dec:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                SET_TOP(TOP() - 1);
+                break;
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1-1);
+            PUSH(tmp1-1);
             break;
         case Instr_Drop:
-            (void)pop(&cpu);
+            if (CACHED(1, 0)) {
+                DROP_CACHED();
+                break;
+            }
+            (void)POP();
             break;
         case Instr_JE:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                tmp1 = TOP();
+                DROP_CACHED();
+                if (tmp1 == 0)
+                    cpu.pc += decoded.immediate;
+                break;
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
             if (tmp1 == 0)
                 cpu.pc += decoded.immediate;
             break;
         case Instr_JNE:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                tmp1 = TOP();
+                DROP_CACHED();
+                if (tmp1 != 0)
+                    cpu.pc += decoded.immediate;
+                break;
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
             if (tmp1 != 0)
                 cpu.pc += decoded.immediate;
@@ -244,57 +802,85 @@ int main(int argc, char **argv) {
             cpu.pc += decoded.immediate;
             break;
         case Instr_And:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() & SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 & tmp2);
+            PUSH(tmp1 & tmp2);
             break;
         case Instr_Or:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() | SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 | tmp2);
+            PUSH(tmp1 | tmp2);
             break;
         case Instr_Xor:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() ^ SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 ^ tmp2);
+            PUSH(tmp1 ^ tmp2);
             break;
         case Instr_SHL:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() << SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 << tmp2);
+            PUSH(tmp1 << tmp2);
             break;
         case Instr_SHR:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() >> SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 >> tmp2);
+            PUSH(tmp1 >> tmp2);
             break;
         case Instr_Rot:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            tmp3 = pop(&cpu);
+            tmp1 = POP();
+            tmp2 = POP();
+            tmp3 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp3);
-            push(&cpu, tmp2);
+            PUSH(tmp1);
+            PUSH(tmp3);
+            PUSH(tmp2);
             break;
         case Instr_SQRT:
-            tmp1 = pop(&cpu);
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, sqrt(tmp1));
+            PUSH(sqrt(tmp1));
             break;
         case Instr_Pick:
-            tmp1 = pop(&cpu);
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, pick(&cpu, tmp1));
+            PUSH(PICK(tmp1));
             break;
         case Instr_Break:
             cpu.state = Cpu_Break;
             break;
+#ifdef STATIC_SUPER
+        SUPERINSTRUCTIONS(SUPER_CASE)
+#endif
         default:
             assert("Unreachable" && false);
             break;
@@ -304,6 +890,49 @@ int main(int argc, char **argv) {
     }
 
     assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
+    FLUSH_STACK_CACHE();
+
+#ifdef PROFILE_NGRAMS
+    write_ngrams(decoded_cache, cpu.program_size);
+    free(ngram_counts);
+#endif
+#ifdef STATIC_SUPER
+    free(plain_cache);
+#endif
+    *pcpu = cpu;
+}
+
+/* Returns zeroed room for the decoded program of the CPU */
+static decode_t* alloc_decoded(const cpu_t *pcpu) {
+    decode_t *decoded_cache = calloc(pcpu->program_size, sizeof(decode_t));
+    if (!decoded_cache) {
+        fprintf(stderr, "Failed to allocate memory for decoded program.\n");
+        exit(2);
+    }
+    return decoded_cache;
+}
+
+#ifdef STACKVM_LIBRARY
+/* The library keeps the decoded program of a VM from call to call.
+   *decoded is NULL before the first call for a program, the caller frees
+   it when the program changes */
+void run_predecoded_reusing(cpu_t *pcpu, uint64_t steplimit, void **decoded) {
+    if (!*decoded)
+        *decoded = alloc_decoded(pcpu);
+    run_with_cache(pcpu, steplimit, *decoded);
+}
+#else
+void run_predecoded(cpu_t *pcpu, uint64_t steplimit) {
+    decode_t *decoded_cache = alloc_decoded(pcpu);
+    run_with_cache(pcpu, steplimit, decoded_cache);
+    free(decoded_cache);
+}
+
+int main(int argc, char **argv) {
+    uint64_t steplimit = parse_args(argc, argv);
+    cpu_t cpu = init_cpu();
+    run_predecoded(&cpu, steplimit);
+
     /* Print CPU state */
     printf("CPU executed %ld steps. End state \"%s\".\n",
             cpu.steps, cpu.state == Cpu_Halted? "Halted":
@@ -315,9 +944,11 @@ int main(int argc, char **argv) {
     }
     printf("%s\n", cpu.sp == -1? "(empty)": "");
 
-    free(LoadedProgram);
+    free(cpu.stack);
+    unload_program();
 
     return cpu.state == Cpu_Halted ||
            (cpu.state == Cpu_Running &&
             cpu.steps == steplimit)?0:1;
 }
+#endif
@@ -0,0 +1,660 @@
+/*  registerized.c - an interpreter running a register form of the code
+    of a stack virtual machine.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+
+#include "common.h"
+
+static inline decode_t decode_at_address(const Instr_t* prog, uint32_t size,
+                                         uint32_t addr) {
+    assert(addr < size);
+    decode_t result = {0};
+    Instr_t raw_instr = prog[addr];
+    result.opcode = raw_instr;
+    switch (raw_instr) {
+    case Instr_Nop:
+    case Instr_Halt:
+    case Instr_Print:
+    case Instr_Swap:
+    case Instr_Dup:
+    case Instr_Inc:
+    case Instr_Add:
+    case Instr_Sub:
+    case Instr_Mul:
+    case Instr_Rand:
+    case Instr_Dec:
+    case Instr_Drop:
+    case Instr_Over:
+    case Instr_Mod:
+    case Instr_And:
+    case Instr_Or:
+    case Instr_Xor:
+    case Instr_SHL:
+    case Instr_SHR:
+    case Instr_Rot:
+    case Instr_SQRT:
+    case Instr_Pick:
+        result.length = 1;
+        break;
+    case Instr_Push:
+    case Instr_JNE:
+    case Instr_JE:
+    case Instr_Jump:
+        result.length = 2;
+        if (!(addr+1 < size)) {
+            result.length = 1;
+            result.opcode = Instr_Break;
+            break;
+        }
+        result.immediate = (int32_t)prog[addr+1];
+        break;
+    case Instr_Break:
+    default: /* Undefined instructions equal to Break */
+        result.length = 1;
+        result.opcode = Instr_Break;
+        break;
+    }
+    return result;
+}
+
+/*** Service routines ***/
+#define BAIL_ON_ERROR() if (pcpu->state != Cpu_Running) break;
+
+static inline void push(cpu_t *pcpu, uint32_t v) {
+    assert(pcpu);
+    if (pcpu->sp >= pcpu->stack_capacity-1) {
+        printf("Stack overflow\n");
+        pcpu->state = Cpu_Break;
+        return;
+    }
+    pcpu->stack[++pcpu->sp] = v;
+}
+
+static inline uint32_t pop(cpu_t *pcpu) {
+    assert(pcpu);
+    if (pcpu->sp < 0) {
+        printf("Stack underflow\n");
+        pcpu->state = Cpu_Break;
+        return 0;
+    }
+    return pcpu->stack[pcpu->sp--];
+}
+
+static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
+    assert(pcpu);
+    if (pcpu->sp - 1 < pos) {
+        printf("Out of bound picking\n");
+        pcpu->state = Cpu_Break;
+        return 0;
+    }
+    return pcpu->stack[pcpu->sp - pos];
+}
+
+/* Instructions are decoded on their first use, entries of the decoded
+   program have zero length until then */
+static decode_t decoded_at(decode_t *dec, const cpu_t *pcpu, uint32_t pc) {
+    assert(dec);
+    assert(pcpu);
+    if (!dec[pc].length)
+        dec[pc] = decode_at_address(pcpu->pmem, pcpu->program_size, pc);
+    return dec[pc];
+}
+
+/* Execute one instruction on the stack. Used where the register form
+   cannot be used or has to be left */
+static void execute_instruction(cpu_t *pcpu, decode_t decoded) {
+    uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
+    switch(decoded.opcode) {
+    case Instr_Nop:
+        /* Do nothing */
+        break;
+    case Instr_Halt:
+        pcpu->state = Cpu_Halted;
+        break;
+    case Instr_Push:
+        push(pcpu, decoded.immediate);
+        break;
+    case Instr_Print:
+        tmp1 = pop(pcpu);
+        BAIL_ON_ERROR();
+        printf("[%d]\n", tmp1);
+        break;
+    case Instr_Swap:
+        tmp1 = pop(pcpu);
+        tmp2 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, tmp1);
+        push(pcpu, tmp2);
+        break;
+    case Instr_Dup:
+        tmp1 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, tmp1);
+        push(pcpu, tmp1);
+        break;
+    case Instr_Over:
+        tmp1 = pop(pcpu);
+        tmp2 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, tmp2);
+        push(pcpu, tmp1);
+        push(pcpu, tmp2);
+        break;
+    case Instr_Inc:
+        tmp1 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, tmp1+1);
+        break;
+    case Instr_Add:
+        tmp1 = pop(pcpu);
+        tmp2 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, tmp1 + tmp2);
+        break;
+    case Instr_Sub:
+        tmp1 = pop(pcpu);
+        tmp2 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, tmp1 - tmp2);
+        break;
+    case Instr_Mod:
+        tmp1 = pop(pcpu);
+        tmp2 = pop(pcpu);
+        BAIL_ON_ERROR();
+        if (tmp2 == 0) {
+            pcpu->state = Cpu_Break;
+            break;
+        }
+        push(pcpu, tmp1 % tmp2);
+        break;
+    case Instr_Mul:
+        tmp1 = pop(pcpu);
+        tmp2 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, tmp1 * tmp2);
+        break;
+    case Instr_Rand:
+        tmp1 = rand();
+        push(pcpu, tmp1);
+        break;
+    case Instr_Dec:
+        tmp1 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, tmp1-1);
+        break;
+    case Instr_Drop:
+        (void)pop(pcpu);
+        break;
+    case Instr_JE:
+        tmp1 = pop(pcpu);
+        BAIL_ON_ERROR();
+        if (tmp1 == 0)
+            pcpu->pc += decoded.immediate;
+        break;
+    case Instr_JNE:
+        tmp1 = pop(pcpu);
+        BAIL_ON_ERROR();
+        if (tmp1 != 0)
+            pcpu->pc += decoded.immediate;
+        break;
+    case Instr_Jump:
+        pcpu->pc += decoded.immediate;
+        break;
+    case Instr_And:
+        tmp1 = pop(pcpu);
+        tmp2 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, tmp1 & tmp2);
+        break;
+    case Instr_Or:
+        tmp1 = pop(pcpu);
+        tmp2 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, tmp1 | tmp2);
+        break;
+    case Instr_Xor:
+        tmp1 = pop(pcpu);
+        tmp2 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, tmp1 ^ tmp2);
+        break;
+    case Instr_SHL:
+        tmp1 = pop(pcpu);
+        tmp2 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, tmp1 << tmp2);
+        break;
+    case Instr_SHR:
+        tmp1 = pop(pcpu);
+        tmp2 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, tmp1 >> tmp2);
+        break;
+    case Instr_Rot:
+        tmp1 = pop(pcpu);
+        tmp2 = pop(pcpu);
+        tmp3 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, tmp1);
+        push(pcpu, tmp3);
+        push(pcpu, tmp2);
+        break;
+    case Instr_SQRT:
+        tmp1 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, sqrt(tmp1));
+        break;
+    case Instr_Pick:
+        tmp1 = pop(pcpu);
+        BAIL_ON_ERROR();
+        push(pcpu, pick(pcpu, tmp1));
+        break;
+    case Instr_Break:
+        pcpu->state = Cpu_Break;
+        break;
+    default:
+        assert("Unreachable" && false);
+        break;
+    }
+    pcpu->pc += decoded.length; /* Advance PC */
+    pcpu->steps++;
+}
+
+/*** Register form ***/
+
+/* Code is converted into blocks of register instructions one basic block
+   at a time. A block reads the stack slots it needs into registers,
+   computes new values in other registers, writes the changed slots back
+   and ends with at most one branch.
+   Instructions that only move values around (Dup, Over, Swap, Rot, Drop,
+   Pick of a constant position) produce no register instructions at all:
+   they rename which register holds which stack slot. */
+
+#define MAX_BLOCK_LENGTH 32
+#define MAX_REGISTERS (STACK_CAPACITY + MAX_BLOCK_LENGTH)
+
+typedef enum {
+    Ir_Imm, /* dst = imm */
+    Ir_Inc, /* dst = a + 1 */
+    Ir_Dec, /* dst = a - 1 */
+    Ir_Add, /* dst = a + b, the same for the rest */
+    Ir_Sub,
+    Ir_Mul,
+    Ir_Mod, /* fails if b is zero */
+    Ir_And,
+    Ir_Or,
+    Ir_Xor,
+    Ir_SHL,
+    Ir_SHR
+} ir_opcode_t;
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t dst, a, b;
+    uint32_t imm;
+} ir_instr_t;
+
+/* A stack slot at SP + slot (SP as of the block start) and its register */
+typedef struct {
+    int8_t slot;
+    uint8_t reg;
+} ir_move_t;
+
+typedef struct {
+    uint32_t length;      /* stack instructions covered, 0 for none */
+    int32_t lo, hi;       /* range of SP for which the block cannot fail */
+    int32_t sp_change;
+    Instr_t exit;         /* JE, JNE or Jump ending the block, Nop if none */
+    uint8_t cond;         /* register tested by a conditional exit */
+    uint32_t next_pc;     /* where the block falls through */
+    uint32_t target_pc;   /* where its exit branch goes */
+    uint32_t loads_count, instrs_count, stores_count;
+    ir_move_t loads[STACK_CAPACITY];
+    ir_instr_t instrs[MAX_BLOCK_LENGTH];
+    ir_move_t stores[STACK_CAPACITY + MAX_BLOCK_LENGTH];
+} block_t;
+
+/* Blocks by their start PC, allocated when built */
+static block_t **blocks;
+
+/* Stack positions are relative to SP at the block start.
+   A block reaches at most STACK_CAPACITY slots below it, a deeper stack
+   is left to the instructions after the block */
+#define MIN_POSITION (-STACK_CAPACITY)
+#define MAX_POSITION MAX_BLOCK_LENGTH
+#define NO_REG (-1)
+
+/* Symbolic state of the stack while a block is built */
+typedef struct {
+    block_t *block;
+    int depth;           /* current SP relative to the start */
+    int lowest, highest; /* required lower bound and reached top of SP */
+    int lowest_written;  /* lowest position that may have a new value */
+    int regs;            /* registers used */
+    /* Register with the value of each position, NO_REG if the position
+       still has its value from the block start */
+    int8_t values[MAX_POSITION - MIN_POSITION + 1];
+    /* Register loaded with the original value of each position */
+    int8_t loaded[MAX_POSITION - MIN_POSITION + 1];
+    bool constant[MAX_REGISTERS];
+    uint32_t constants[MAX_REGISTERS];
+} builder_t;
+
+#define VALUE(bd, pos) ((bd)->values[(pos) - MIN_POSITION])
+#define LOADED(bd, pos) ((bd)->loaded[(pos) - MIN_POSITION])
+
+/* The next instruction consumes n values. Returns false if they
+   cannot all be on the stack, such an instruction ends the block */
+static bool need(builder_t *bd, int n) {
+    if (bd->depth - n + 1 <= MIN_POSITION)
+        return false;
+    if (n - 1 - bd->depth > bd->lowest)
+        bd->lowest = n - 1 - bd->depth;
+    return true;
+}
+
+#define NEED(n) if (!need(&bd, (n))) { done = true; continue; }
+
+/* Register holding the value at position pos */
+static int read_value(builder_t *bd, int pos) {
+    if (VALUE(bd, pos) != NO_REG)
+        return VALUE(bd, pos);
+    assert(pos <= 0);
+    if (LOADED(bd, pos) == NO_REG) {
+        block_t *b = bd->block;
+        LOADED(bd, pos) = bd->regs++;
+        b->loads[b->loads_count++] = (ir_move_t){pos, LOADED(bd, pos)};
+    }
+    return LOADED(bd, pos);
+}
+
+static void write_value(builder_t *bd, int pos, int reg) {
+    VALUE(bd, pos) = reg;
+    if (pos < bd->lowest_written)
+        bd->lowest_written = pos;
+}
+
+static void push_value(builder_t *bd, int reg) {
+    bd->depth++;
+    if (bd->depth > bd->highest)
+        bd->highest = bd->depth;
+    write_value(bd, bd->depth, reg);
+}
+
+static int emit(builder_t *bd, ir_opcode_t opcode, int a, int b,
+                uint32_t imm) {
+    block_t *block = bd->block;
+    int dst = bd->regs++;
+    block->instrs[block->instrs_count++] =
+        (ir_instr_t){opcode, dst, a, b, imm};
+    bd->constant[dst] = opcode == Ir_Imm;
+    bd->constants[dst] = imm;
+    return dst;
+}
+
+/* Convert the basic block starting at pc */
+static void build_block(decode_t *dec, const cpu_t *pcpu, uint32_t pc,
+                        block_t *block) {
+    builder_t bd = {.block = block, .depth = 0, .lowest = -1, .highest = 0,
+                    .lowest_written = 1, .regs = 0};
+    for (int i = 0; i <= MAX_POSITION - MIN_POSITION; i++)
+        bd.values[i] = bd.loaded[i] = NO_REG;
+    block->length = 0;
+    block->loads_count = block->instrs_count = block->stores_count = 0;
+    block->exit = Instr_Nop;
+
+    bool done = false;
+    while (!done && pc < pcpu->program_size
+           && block->length < MAX_BLOCK_LENGTH) {
+        const decode_t decoded = decoded_at(dec, pcpu, pc);
+        const int d = bd.depth;
+        int a = 0, b = 0, c = 0;
+        ir_opcode_t opcode = Ir_Add;
+        switch (decoded.opcode) {
+        case Instr_Nop:
+            break;
+        case Instr_Push:
+            push_value(&bd, emit(&bd, Ir_Imm, 0, 0, decoded.immediate));
+            break;
+        case Instr_Dup:
+            NEED(1);
+            push_value(&bd, read_value(&bd, d));
+            break;
+        case Instr_Over:
+            NEED(2);
+            push_value(&bd, read_value(&bd, d - 1));
+            break;
+        case Instr_Swap:
+            NEED(2);
+            a = read_value(&bd, d);
+            b = read_value(&bd, d - 1);
+            write_value(&bd, d, b);
+            write_value(&bd, d - 1, a);
+            break;
+        case Instr_Rot:
+            NEED(3);
+            a = read_value(&bd, d);
+            b = read_value(&bd, d - 1);
+            c = read_value(&bd, d - 2);
+            write_value(&bd, d - 2, a);
+            write_value(&bd, d - 1, c);
+            write_value(&bd, d, b);
+            break;
+        case Instr_Drop:
+            NEED(1);
+            bd.depth--;
+            break;
+        case Instr_Pick: {
+            /* Only a constant position is known in advance */
+            if (VALUE(&bd, d) == NO_REG || !bd.constant[VALUE(&bd, d)]
+                || bd.constants[VALUE(&bd, d)] >= STACK_CAPACITY) {
+                done = true;
+                continue;
+            }
+            int32_t pos = bd.constants[VALUE(&bd, d)];
+            NEED(1);
+            bd.depth--;
+            /* pick() wants SP > pos after the position is popped */
+            if (!need(&bd, pos + 2)) {
+                bd.depth++;
+                done = true;
+                continue;
+            }
+            push_value(&bd, read_value(&bd, d - 1 - pos));
+            break;
+        }
+        case Instr_Inc:
+        case Instr_Dec:
+            NEED(1);
+            a = read_value(&bd, d);
+            write_value(&bd, d, emit(&bd, decoded.opcode == Instr_Inc ?
+                                          Ir_Inc : Ir_Dec, a, 0, 0));
+            break;
+        case Instr_Add: opcode = Ir_Add; goto binary;
+        case Instr_Sub: opcode = Ir_Sub; goto binary;
+        case Instr_Mul: opcode = Ir_Mul; goto binary;
+        case Instr_Mod: opcode = Ir_Mod; goto binary;
+        case Instr_And: opcode = Ir_And; goto binary;
+        case Instr_Or:  opcode = Ir_Or;  goto binary;
+        case Instr_Xor: opcode = Ir_Xor; goto binary;
+        case Instr_SHL: opcode = Ir_SHL; goto binary;
+        case Instr_SHR: opcode = Ir_SHR; goto binary;
+        binary:
+            NEED(2);
+            a = read_value(&bd, d);
+            b = read_value(&bd, d - 1);
+            bd.depth--;
+            write_value(&bd, d - 1, emit(&bd, opcode, a, b, 0));
+            break;
+        case Instr_JE:
+        case Instr_JNE:
+            NEED(1);
+            block->cond = read_value(&bd, d);
+            bd.depth--;
+            /* fallthrough */
+        case Instr_Jump:
+            block->exit = decoded.opcode;
+            block->target_pc = pc + decoded.length + decoded.immediate;
+            done = true;
+            break;
+        default:
+            /* Print, Rand, SQRT, Halt and Break stay on the stack */
+            done = true;
+            continue;
+        }
+        block->length++;
+        pc += decoded.length;
+    }
+    block->next_pc = pc;
+
+    /* Write back positions that got new values */
+    for (int pos = bd.lowest_written; pos <= bd.depth; pos++) {
+        int reg = VALUE(&bd, pos);
+        if (reg == NO_REG || (pos <= 0 && reg == LOADED(&bd, pos)))
+            continue;
+        block->stores[block->stores_count++] = (ir_move_t){pos, reg};
+    }
+    block->sp_change = bd.depth;
+    block->lo = bd.lowest;
+    block->hi = pcpu->stack_capacity - 1 - bd.highest;
+    if (block->hi < block->lo)
+        block->length = 0; /* Can never fit on the stack */
+}
+
+/* Run a block. Returns false and leaves the CPU state untouched
+   if the block cannot complete */
+static bool run_block(cpu_t *pcpu, const block_t *block) {
+    uint32_t regs[MAX_REGISTERS];
+    const int32_t sp = pcpu->sp;
+    for (uint32_t i = 0; i < block->loads_count; i++)
+        regs[block->loads[i].reg] = pcpu->stack[sp + block->loads[i].slot];
+    for (uint32_t i = 0; i < block->instrs_count; i++) {
+        const ir_instr_t *in = &block->instrs[i];
+        const uint32_t a = regs[in->a], b = regs[in->b];
+        switch (in->opcode) {
+        case Ir_Imm: regs[in->dst] = in->imm; break;
+        case Ir_Inc: regs[in->dst] = a + 1; break;
+        case Ir_Dec: regs[in->dst] = a - 1; break;
+        case Ir_Add: regs[in->dst] = a + b; break;
+        case Ir_Sub: regs[in->dst] = a - b; break;
+        case Ir_Mul: regs[in->dst] = a * b; break;
+        case Ir_Mod:
+            if (b == 0)
+                return false; /* Nothing is written back yet */
+            regs[in->dst] = a % b;
+            break;
+        case Ir_And: regs[in->dst] = a & b; break;
+        case Ir_Or:  regs[in->dst] = a | b; break;
+        case Ir_Xor: regs[in->dst] = a ^ b; break;
+        case Ir_SHL: regs[in->dst] = a << b; break;
+        case Ir_SHR: regs[in->dst] = a >> b; break;
+        default:
+            assert("Unreachable" && false);
+            break;
+        }
+    }
+    for (uint32_t i = 0; i < block->stores_count; i++)
+        pcpu->stack[sp + block->stores[i].slot] = regs[block->stores[i].reg];
+    pcpu->sp = sp + block->sp_change;
+    pcpu->steps += block->length;
+    bool taken = block->exit == Instr_Jump
+                 || (block->exit == Instr_JE && regs[block->cond] == 0)
+                 || (block->exit == Instr_JNE && regs[block->cond] != 0);
+    pcpu->pc = taken ? block->target_pc : block->next_pc;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    uint64_t steplimit = parse_args(argc, argv);
+    cpu_t cpu = init_cpu();
+
+    decode_t *decoded_cache = calloc(cpu.program_size, sizeof(decode_t));
+    blocks = calloc(cpu.program_size, sizeof(block_t *));
+    if (!decoded_cache || !blocks) {
+        fprintf(stderr, "Failed to allocate memory for decoded program.\n");
+        exit(2);
+    }
+
+    while (cpu.state == Cpu_Running && cpu.steps < steplimit) {
+        if (!(cpu.pc < cpu.program_size)) {
+            printf("PC out of bounds\n");
+            cpu.state = Cpu_Break;
+            break;
+        }
+        block_t *block = blocks[cpu.pc];
+        if (!block) {
+            block = blocks[cpu.pc] = malloc(sizeof(block_t));
+            if (!block) {
+                fprintf(stderr, "Failed to allocate memory for a block.\n");
+                exit(2);
+            }
+            build_block(decoded_cache, &cpu, cpu.pc, block);
+        }
+        /* Take the whole block if none of its instructions can fail
+           with stack bounds or hit the step limit. Otherwise, or if
+           it has to stop at division by zero, go step by step */
+        if (block->length == 0
+            || (uint32_t)(cpu.sp - block->lo)
+                   > (uint32_t)(block->hi - block->lo)
+            || cpu.steps + block->length > steplimit
+            || !run_block(&cpu, block))
+            execute_instruction(&cpu, decoded_at(decoded_cache, &cpu, cpu.pc));
+    }
+
+    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
+    /* Print CPU state */
+    printf("CPU executed %ld steps. End state \"%s\".\n",
+            cpu.steps, cpu.state == Cpu_Halted? "Halted":
+                       cpu.state == Cpu_Running? "Running": "Break");
+    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
+    printf("Stack: ");
+    for (int32_t i=cpu.sp; i >= 0 ; i--) {
+        printf("%#10x ", cpu.stack[i]);
+    }
+    printf("%s\n", cpu.sp == -1? "(empty)": "");
+
+    for (uint32_t pc = 0; pc < cpu.program_size; pc++)
+        free(blocks[pc]);
+    free(blocks);
+    free(decoded_cache);
+    free(cpu.stack);
+    unload_program();
+
+    return cpu.state == Cpu_Halted ||
+           (cpu.state == Cpu_Running &&
+            cpu.steps == steplimit)?0:1;
+}
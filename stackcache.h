@@ -0,0 +1,213 @@
+/*  stackcache.h - keeping topmost slots of the stack of a stack virtual
+    machine in host registers.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef STACKCACHE_H_
+#define STACKCACHE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/* Number of topmost stack slots kept in local variables of an interpreter
+   instead of cpu.stack[]: 0 (no caching), 1 or 2.
+   It is the same idea as OPT_CACHED in asmoptll.S */
+#ifndef STACK_CACHE
+#define STACK_CACHE 0
+#endif
+
+#if STACK_CACHE < 0 || STACK_CACHE > 2
+#error "STACK_CACHE must be 0, 1 or 2"
+#endif
+
+/* When the stack holds n values, the topmost min(n, STACK_CACHE) of them
+   live here and their copies in cpu.stack[] are stale. The interpreter
+   keeps it in a local variable so that the compiler can put it in
+   registers. */
+typedef struct {
+    uint32_t top;  /* stack[sp], valid when sp >= 0 */
+    uint32_t next; /* stack[sp-1], valid when sp >= 1 and STACK_CACHE == 2 */
+} stack_cache_t;
+
+#if STACK_CACHE
+
+/* Refill the deepest cached slot after the stack shrunk */
+static inline void sc_refill(cpu_t *pcpu, stack_cache_t *c) {
+#if STACK_CACHE == 2
+    if (pcpu->sp >= 1)
+        c->next = pcpu->stack[pcpu->sp - 1];
+#else
+    if (pcpu->sp >= 0)
+        c->top = pcpu->stack[pcpu->sp];
+#endif
+}
+
+/* Push without checks, the caller knows that there is space */
+static inline void sc_push_unchecked(cpu_t *pcpu, stack_cache_t *c,
+                                     uint32_t v) {
+#if STACK_CACHE == 2
+    if (pcpu->sp >= 1)
+        pcpu->stack[pcpu->sp - 1] = c->next;
+    c->next = c->top;
+#else
+    if (pcpu->sp >= 0)
+        pcpu->stack[pcpu->sp] = c->top;
+#endif
+    c->top = v;
+    pcpu->sp++;
+}
+
+/* Drop the topmost value without checks */
+static inline void sc_drop_unchecked(cpu_t *pcpu, stack_cache_t *c) {
+#if STACK_CACHE == 2
+    c->top = c->next;
+#endif
+    pcpu->sp--;
+    sc_refill(pcpu, c);
+}
+
+/* Drop the value under the topmost one without checks */
+static inline void sc_nip_unchecked(cpu_t *pcpu, stack_cache_t *c) {
+    pcpu->sp--;
+#if STACK_CACHE == 2
+    sc_refill(pcpu, c);
+#endif
+}
+
+static inline uint32_t sc_second(const cpu_t *pcpu, const stack_cache_t *c) {
+#if STACK_CACHE == 2
+    (void)pcpu;
+    return c->next;
+#else
+    (void)c;
+    return pcpu->stack[pcpu->sp - 1];
+#endif
+}
+
+static inline void sc_set_second(cpu_t *pcpu, stack_cache_t *c, uint32_t v) {
+#if STACK_CACHE == 2
+    (void)pcpu;
+    c->next = v;
+#else
+    (void)c;
+    pcpu->stack[pcpu->sp - 1] = v;
+#endif
+}
+
+/* Write cached values back to cpu.stack[] */
+static inline void sc_flush(cpu_t *pcpu, const stack_cache_t *c) {
+    if (pcpu->sp >= 0)
+        pcpu->stack[pcpu->sp] = c->top;
+#if STACK_CACHE == 2
+    if (pcpu->sp >= 1)
+        pcpu->stack[pcpu->sp - 1] = c->next;
+#endif
+}
+
+/* Cache-aware versions of push(), pop() and pick().
+   They behave exactly as their uncached counterparts in the interpreters */
+static inline void sc_push(cpu_t *pcpu, stack_cache_t *c, uint32_t v) {
+    if (pcpu->sp >= pcpu->stack_capacity-1) {
+        fprintf(pcpu->out, "Stack overflow\n");
+        pcpu->state = Cpu_Break;
+        return;
+    }
+    sc_push_unchecked(pcpu, c, v);
+}
+
+static inline uint32_t sc_pop(cpu_t *pcpu, stack_cache_t *c) {
+    if (pcpu->sp < 0) {
+        fprintf(pcpu->out, "Stack underflow\n");
+        pcpu->state = Cpu_Break;
+        return 0;
+    }
+    /* Leave the value in memory as pop() does, Pick reads it back */
+    uint32_t v = c->top;
+    pcpu->stack[pcpu->sp] = v;
+    sc_drop_unchecked(pcpu, c);
+    return v;
+}
+
+static inline uint32_t sc_pick(cpu_t *pcpu, stack_cache_t *c, int32_t pos) {
+    if (pcpu->sp - 1 < pos) {
+        fprintf(pcpu->out, "Out of bound picking\n");
+        pcpu->state = Cpu_Break;
+        return 0;
+    }
+    if (pos == 0)
+        return c->top;
+    if (pos == 1)
+        return sc_second(pcpu, c);
+    /* A negative position reads above the top. Write the cache back so
+       that, as with pick(), the slot just popped holds the position */
+    if (pos < 0)
+        sc_flush(pcpu, c);
+    return pcpu->stack[pcpu->sp - pos];
+}
+
+#define PUSH(v)   sc_push(&cpu, &cache, (v))
+#define POP()     sc_pop(&cpu, &cache)
+#define PICK(pos) sc_pick(&cpu, &cache, (pos))
+
+/* True when an operation consuming `needs` values and growing the stack
+   by at most `grows` values can neither underflow nor overflow it.
+   Such operations may work on cached values directly */
+#define CACHED(needs, grows) \
+    ((uint32_t)(cpu.sp - ((needs) - 1)) \
+        <= (uint32_t)(cpu.stack_capacity - 1 - (grows) - ((needs) - 1)))
+
+#define TOP()            (cache.top)
+#define SET_TOP(v)       (cache.top = (v))
+#define SECOND()         sc_second(&cpu, &cache)
+#define SET_SECOND(v)    sc_set_second(&cpu, &cache, (v))
+#define PUSH_CACHED(v)   sc_push_unchecked(&cpu, &cache, (v))
+#define DROP_CACHED()    sc_drop_unchecked(&cpu, &cache)
+#define NIP_CACHED()     sc_nip_unchecked(&cpu, &cache)
+#define FLUSH_STACK_CACHE() sc_flush(&cpu, &cache)
+
+#else /* No caching, use plain memory accesses */
+
+#define PUSH(v)   push(&cpu, (v))
+#define POP()     pop(&cpu)
+#define PICK(pos) pick(&cpu, (pos))
+
+/* Fast paths are never taken, but have to compile */
+#define CACHED(needs, grows) false
+#define TOP()            (cache.top)
+#define SET_TOP(v)       (cache.top = (v))
+#define SECOND()         (cache.next)
+#define SET_SECOND(v)    (cache.next = (v))
+#define PUSH_CACHED(v)   ((void)(v))
+#define DROP_CACHED()    ((void)0)
+#define NIP_CACHED()     ((void)0)
+#define FLUSH_STACK_CACHE() ((void)cache)
+
+#endif /* STACK_CACHE */
+
+#endif /* STACKCACHE_H_ */
@@ -0,0 +1,268 @@
+/*  stackvm.c - libstackvm, interpreters of the stack virtual machine
+    to be embedded into other programs.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "stackvm.h"
+
+/* Run loops of the engines, built from their sources with STACKVM_LIBRARY.
+   Those that decode the program keep it in *decoded between calls */
+void run_switched(cpu_t *pcpu, uint64_t steplimit);
+void run_predecoded_reusing(cpu_t *pcpu, uint64_t steplimit, void **decoded);
+void run_threaded_cached_reusing(cpu_t *pcpu, uint64_t steplimit,
+                                 void **decoded);
+unsigned run_interleaved(cpu_t *const *cpus, const uint64_t *steplimits,
+                         unsigned count);
+
+typedef void (*run_t)(cpu_t *pcpu, uint64_t steplimit, void **decoded);
+
+/* Decodes every instruction it runs */
+static void run_switched_reusing(cpu_t *pcpu, uint64_t steplimit,
+                                 void **decoded) {
+    (void)decoded;
+    run_switched(pcpu, steplimit);
+}
+
+static const run_t engines[] = {
+    [Vm_Switched] = run_switched_reusing,
+    [Vm_Predecoded] = run_predecoded_reusing,
+    [Vm_ThreadedCached] = run_threaded_cached_reusing,
+};
+
+struct vm {
+    run_t run;
+    cpu_t cpu;
+    Instr_t *program;
+    void *decoded; /* Kept by the engine for the program, NULL until run */
+};
+
+vm_t* vm_create(vm_engine_t engine, uint32_t stack_capacity) {
+    if ((unsigned)engine >= sizeof(engines) / sizeof(engines[0])
+        || stack_capacity < MIN_STACK_CAPACITY
+        || stack_capacity > MAX_STACK_CAPACITY)
+        return NULL;
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (vm == NULL)
+        return NULL;
+    vm->run = engines[engine];
+    vm->program = NULL;
+    vm->decoded = NULL;
+    vm->cpu = make_cpu(NULL, 0, stack_capacity);
+    if (vm->cpu.stack == NULL) {
+        free(vm);
+        return NULL;
+    }
+    /* Nothing to run yet */
+    vm->cpu.state = Cpu_Break;
+    return vm;
+}
+
+void vm_destroy(vm_t *vm) {
+    if (vm == NULL)
+        return;
+    free(vm->cpu.stack);
+    free(vm->program);
+    free(vm->decoded);
+    free(vm);
+}
+
+bool vm_load(vm_t *vm, const Instr_t *prog, uint32_t size) {
+    assert(vm);
+    assert(prog || size == 0);
+    if (size > MAX_PROGRAM_SIZE)
+        return false;
+    const uint32_t padded_size = size < PROGRAM_SIZE ? PROGRAM_SIZE : size;
+    Instr_t *program = calloc(padded_size, sizeof(Instr_t));
+    if (program == NULL)
+        return false;
+    if (size > 0)
+        memcpy(program, prog, size * sizeof(Instr_t));
+    free(vm->program);
+    vm->program = program;
+    free(vm->decoded);
+    vm->decoded = NULL;
+    vm->cpu.program_size = padded_size;
+    vm_reset(vm);
+    return true;
+}
+
+void vm_reset(vm_t *vm) {
+    assert(vm);
+    if (vm->program == NULL)
+        return; /* Nothing to run yet */
+    uint32_t *stack = vm->cpu.stack;
+    const uint32_t capacity = vm->cpu.stack_capacity;
+    memset(stack, 0, capacity * sizeof(uint32_t));
+    vm->cpu = (cpu_t){.pc = 0, .sp = -1, .state = Cpu_Running,
+                      .steps = 0, .stack = stack,
+                      .stack_capacity = capacity,
+                      .pmem = vm->program,
+                      .program_size = vm->cpu.program_size,
+                      .out = vm->cpu.out};
+}
+
+cpu_state_t vm_run(vm_t *vm, uint64_t steps) {
+    assert(vm);
+    if (vm->cpu.state != Cpu_Running || steps == 0)
+        return vm->cpu.state;
+    const uint64_t steplimit = steps > UINT64_MAX - vm->cpu.steps ?
+                               UINT64_MAX : vm->cpu.steps + steps;
+    vm->run(&vm->cpu, steplimit, &vm->decoded);
+    return vm->cpu.state;
+}
+
+unsigned vm_run_interleaved(vm_t *const *vms, const uint64_t *steps,
+                            unsigned count) {
+    assert(vms);
+    assert(steps);
+    assert(count > 0);
+    cpu_t *cpus[count];
+    uint64_t steplimits[count];
+    for (unsigned i = 0; i < count; i++) {
+        cpu_t *cpu = &vms[i]->cpu;
+        if (cpu->state != Cpu_Running || steps[i] == 0)
+            return i;
+        cpus[i] = cpu;
+        steplimits[i] = steps[i] > UINT64_MAX - cpu->steps ?
+                        UINT64_MAX : cpu->steps + steps[i];
+    }
+    return run_interleaved(cpus, steplimits, count);
+}
+
+void vm_set_output(vm_t *vm, FILE *out) {
+    assert(vm);
+    assert(out);
+    vm->cpu.out = out;
+}
+
+const cpu_t* vm_cpu(const vm_t *vm) {
+    assert(vm);
+    return &vm->cpu;
+}
+
+/* A VM waiting for its turn and where it has to stop */
+typedef struct {
+    vm_t *vm;
+    uint64_t steplimit;
+} sched_entry_t;
+
+/* Ready VMs in a ring buffer, first the one to run next */
+struct vm_scheduler {
+    uint64_t quantum;
+    sched_entry_t *ready;
+    uint32_t allocated; /* A power of two */
+    uint32_t first;
+    uint32_t count;
+};
+
+vm_scheduler_t* vm_scheduler_create(uint64_t quantum) {
+    if (quantum == 0)
+        return NULL;
+    vm_scheduler_t *sched = malloc(sizeof(vm_scheduler_t));
+    if (sched == NULL)
+        return NULL;
+    *sched = (vm_scheduler_t){.quantum = quantum, .allocated = 64};
+    sched->ready = malloc(sched->allocated * sizeof(sched_entry_t));
+    if (sched->ready == NULL) {
+        free(sched);
+        return NULL;
+    }
+    return sched;
+}
+
+void vm_scheduler_destroy(vm_scheduler_t *sched) {
+    if (sched == NULL)
+        return;
+    free(sched->ready);
+    free(sched);
+}
+
+static bool enqueue(vm_scheduler_t *sched, sched_entry_t entry) {
+    if (sched->count == sched->allocated) {
+        if (sched->allocated > UINT32_MAX / 2)
+            return false;
+        sched_entry_t *ready =
+            malloc(2 * sched->allocated * sizeof(sched_entry_t));
+        if (ready == NULL)
+            return false;
+        /* Unwrap the ring at the start of the new buffer */
+        for (uint32_t i = 0; i < sched->count; i++)
+            ready[i] = sched->ready[(sched->first + i)
+                                    & (sched->allocated - 1)];
+        free(sched->ready);
+        sched->ready = ready;
+        sched->allocated *= 2;
+        sched->first = 0;
+    }
+    sched->ready[(sched->first + sched->count) & (sched->allocated - 1)] =
+        entry;
+    sched->count++;
+    return true;
+}
+
+bool vm_scheduler_add(vm_scheduler_t *sched, vm_t *vm, uint64_t steps) {
+    assert(sched);
+    assert(vm);
+    const uint64_t steplimit = steps > UINT64_MAX - vm->cpu.steps ?
+                               UINT64_MAX : vm->cpu.steps + steps;
+    return enqueue(sched, (sched_entry_t){.vm = vm, .steplimit = steplimit});
+}
+
+vm_t* vm_scheduler_run(vm_scheduler_t *sched) {
+    assert(sched);
+    while (sched->count > 0) {
+        sched_entry_t entry = sched->ready[sched->first];
+        sched->first = (sched->first + 1) & (sched->allocated - 1);
+        sched->count--;
+
+        cpu_t *cpu = &entry.vm->cpu;
+        if (cpu->state == Cpu_Running && cpu->steps < entry.steplimit) {
+            /* The step limit of the engines is where the quantum ends */
+            const uint64_t left = entry.steplimit - cpu->steps;
+            entry.vm->run(cpu, cpu->steps +
+                               (left < sched->quantum ? left : sched->quantum),
+                          &entry.vm->decoded);
+        }
+        if (cpu->state != Cpu_Running || cpu->steps >= entry.steplimit)
+            return entry.vm;
+        /* There is room, the entry has just left the ring */
+        enqueue(sched, entry);
+    }
+    return NULL;
+}
+
+uint32_t vm_scheduler_count(const vm_scheduler_t *sched) {
+    assert(sched);
+    return sched->count;
+}
@@ -0,0 +1,107 @@
+/*  stackvm.h - interface of libstackvm, interpreters of the stack virtual
+    machine to be embedded into other programs.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef STACKVM_H_
+#define STACKVM_H_
+
+#include "common.h"
+
+/* Engines available in the library. They run programs the same way
+   as the standalone variants of the same names */
+typedef enum {
+    Vm_Switched = 0,
+    Vm_Predecoded,
+    Vm_ThreadedCached
+} vm_engine_t;
+
+/* A virtual machine: a CPU, its stack and its copy of the program.
+   Instances share nothing, so that different threads may run different
+   instances at the same time. Print and error messages of the guest go to
+   the standard output unless vm_set_output() tells otherwise */
+typedef struct vm vm_t;
+
+/* Returns NULL if the engine or the stack capacity is not valid,
+   or if there is no memory. The VM has no program until vm_load() */
+vm_t* vm_create(vm_engine_t engine, uint32_t stack_capacity);
+void vm_destroy(vm_t *vm);
+
+/* Copies the program into the VM, padded with Break up to PROGRAM_SIZE,
+   and resets the CPU to its start. Returns false if the program is longer
+   than MAX_PROGRAM_SIZE words or if there is no memory for it */
+bool vm_load(vm_t *vm, const Instr_t *prog, uint32_t size);
+
+/* Resets the CPU to the start of the loaded program with an empty stack.
+   Unlike loading the program again, it keeps the program as decoded by
+   the engine for the next runs */
+void vm_reset(vm_t *vm);
+
+/* Runs the program for at most steps more instructions, none if steps is
+   zero. Returns the state of the CPU, Cpu_Running if the program may go on
+   with another call */
+cpu_state_t vm_run(vm_t *vm, uint64_t steps);
+
+/* Runs the VMs together in one dispatch loop, a block of instructions of
+   each in turn, so that a single thread gets more work done by overlapping
+   them. Each VM runs for at most steps[i] more instructions. Returns
+   as soon as one of them stops or uses up its steps: the index of
+   the first such VM, which may have been so before the call. The others
+   can go on with another call. The engines of the VMs are not used,
+   all of them run on the interleaved engine */
+unsigned vm_run_interleaved(vm_t *const *vms, const uint64_t *steps,
+                            unsigned count);
+
+/* Sends the output of the guest to the stream, kept across vm_load() */
+void vm_set_output(vm_t *vm, FILE *out);
+
+/* State of the CPU after the last vm_run() */
+const cpu_t* vm_cpu(const vm_t *vm);
+
+/* A cooperative scheduler running many VMs on the calling thread. VMs take
+   turns in the order they were added, each runs for a quantum of steps and
+   then goes to the back of the queue. Nothing is lost by preempting: a VM
+   resumes at the instruction where its quantum ran out */
+typedef struct vm_scheduler vm_scheduler_t;
+
+/* Returns NULL if the quantum is zero or if there is no memory */
+vm_scheduler_t* vm_scheduler_create(uint64_t quantum);
+/* The VMs still in the scheduler are left to the caller */
+void vm_scheduler_destroy(vm_scheduler_t *sched);
+
+/* Queues a loaded VM to run for at most steps more instructions in all.
+   Returns false if there is no memory */
+bool vm_scheduler_add(vm_scheduler_t *sched, vm_t *vm, uint64_t steps);
+
+/* Runs the queued VMs in turn until one of them stops or uses up its steps,
+   and returns it, out of the scheduler. Returns NULL if none are left */
+vm_t* vm_scheduler_run(vm_scheduler_t *sched);
+
+/* VMs in the scheduler */
+uint32_t vm_scheduler_count(const vm_scheduler_t *sched);
+
+#endif /* STACKVM_H_ */
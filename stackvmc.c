@@ -0,0 +1,252 @@
+/*  stackvmc.c - a client of the stack virtual machine server.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#define _DEFAULT_SOURCE /* for clock_gettime() */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "stackvmd.h"
+
+static bool read_full(int fd, void *buf, size_t size) {
+    char *p = buf;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t size) {
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* Reads the whole file as program words, a partial last word is padded
+   with zeros. Returns NULL if the file cannot be read */
+static Instr_t* read_program(const char *path, uint32_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    Instr_t *prog = NULL;
+    long length = -1;
+    if (!fseek(f, 0, SEEK_END))
+        length = ftell(f);
+    if (length >= 0 && (uint64_t)length <= MAX_PROGRAM_SIZE * sizeof(Instr_t)
+        && !fseek(f, 0, SEEK_SET)) {
+        *size = (length + sizeof(Instr_t) - 1) / sizeof(Instr_t);
+        prog = calloc(*size ? *size : 1, sizeof(Instr_t));
+        if (prog && fread(prog, 1, length, f) != (size_t)length) {
+            free(prog);
+            prog = NULL;
+        }
+    }
+    fclose(f);
+    return prog;
+}
+
+/* Result of a request as sent by the server */
+typedef struct {
+    stackvmd_response_t response;
+    char *output;
+    uint32_t *stack;
+} result_t;
+
+static bool receive(int fd, result_t *result) {
+    if (!read_full(fd, &result->response, sizeof(result->response))
+        || result->response.magic != STACKVMD_RESPONSE_MAGIC)
+        return false;
+    const stackvmd_response_t *r = &result->response;
+    if (r->status != Stackvmd_Ok)
+        return true;
+    if (r->sp < -1 || r->sp >= (int32_t)MAX_STACK_CAPACITY)
+        return false;
+    result->output = realloc(result->output, r->output_size + 1);
+    result->stack = realloc(result->stack, (r->sp + 2) * sizeof(uint32_t));
+    if (result->output == NULL || result->stack == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the result.\n");
+        exit(2);
+    }
+    return read_full(fd, result->output, r->output_size)
+        && read_full(fd, result->stack, (r->sp + 1) * sizeof(uint32_t));
+}
+
+/* Asks for the program by its hash first, and sends it only if the server
+   does not have it */
+static bool run(int fd, const Instr_t *prog, uint32_t size, uint64_t steplimit,
+                result_t *result) {
+    stackvmd_request_t request = {.magic = STACKVMD_REQUEST_MAGIC,
+                                  .steplimit = steplimit,
+                                  .program_hash = stackvmd_hash(prog, size),
+                                  .program_size = size};
+    if (!write_full(fd, &request, sizeof(request)) || !receive(fd, result))
+        return false;
+    if (result->response.status != Stackvmd_UnknownProgram)
+        return result->response.status == Stackvmd_Ok;
+    request.flags = STACKVMD_WITH_PROGRAM;
+    return write_full(fd, &request, sizeof(request))
+        && write_full(fd, prog, size * sizeof(Instr_t))
+        && receive(fd, result)
+        && result->response.status == Stackvmd_Ok;
+}
+
+static const char *socket_opt = "--socket=";
+static const char *inp_prog_opt = "--inp-prog=";
+static const char *steplimit_opt = "--steplimit=";
+static const char *repeat_opt = "--repeat=";
+
+static void report_usage_and_exit(char *exec_name, int ret_code) {
+    fprintf(stderr, "Usage: %s %s<path> %s<str> %s<num> %s<num>\n",
+            exec_name, socket_opt, inp_prog_opt, steplimit_opt, repeat_opt);
+    exit(ret_code);
+}
+
+int main(int argc, char **argv) {
+    const char *socket_path = "stackvmd.sock";
+    const char *prog_file = NULL;
+    uint64_t steplimit = LLONG_MAX;
+    unsigned long repeat = 1;
+
+    for (int i = 1; i < argc; ++i) {
+        char *endptr = NULL;
+        errno = 0;
+        if (!strcmp(argv[i], "--help")) {
+            report_usage_and_exit(argv[0], 0);
+        } else if (!strncmp(argv[i], socket_opt, strlen(socket_opt))) {
+            socket_path = argv[i] + strlen(socket_opt);
+        } else if (!strncmp(argv[i], inp_prog_opt, strlen(inp_prog_opt))) {
+            prog_file = argv[i] + strlen(inp_prog_opt);
+        } else if (!strncmp(argv[i], steplimit_opt, strlen(steplimit_opt))) {
+            steplimit = strtoll(argv[i] + strlen(steplimit_opt), &endptr, 10);
+            if (errno || *endptr != '\0') {
+                fprintf(stderr, "Invalid steplimit: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+        } else if (!strncmp(argv[i], repeat_opt, strlen(repeat_opt))) {
+            repeat = strtoul(argv[i] + strlen(repeat_opt), &endptr, 10);
+            if (errno || *endptr != '\0' || repeat == 0) {
+                fprintf(stderr, "Invalid number of repeats: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+        } else {
+            fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+            report_usage_and_exit(argv[0], 2);
+        }
+    }
+
+    uint32_t size = PROGRAM_SIZE;
+    Instr_t *prog = NULL;
+    if (prog_file) {
+        prog = read_program(prog_file, &size);
+        if (prog == NULL) {
+            fprintf(stderr, "Cannot read target program file: %s\n",
+                    prog_file);
+            exit(2);
+        }
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", socket_path);
+        exit(2);
+    }
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", socket_path,
+                strerror(errno));
+        exit(2);
+    }
+
+    /* Repeated requests find the program on the server */
+    result_t result = {0};
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long i = 0; i < repeat; i++) {
+        if (!run(fd, prog ? prog : DefProgram, size, steplimit, &result)) {
+            const stackvmd_status_t status = result.response.status;
+            fprintf(stderr, "Request failed%s\n",
+                    status == Stackvmd_OutputTooLong
+                        ? ": the program printed too much"
+                    : status == Stackvmd_ServerError
+                        ? ": the server could not run it" : "");
+            exit(2);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(fd);
+    if (repeat > 1)
+        fprintf(stderr, "%.1f us per request\n",
+                ((end.tv_sec - start.tv_sec) * 1e9
+                 + (end.tv_nsec - start.tv_nsec)) / 1e3 / repeat);
+
+    const stackvmd_response_t *r = &result.response;
+    fwrite(result.output, 1, r->output_size, stdout);
+
+    /* Print CPU state */
+    printf("CPU executed %ld steps. End state \"%s\".\n",
+            r->steps, r->state == Cpu_Halted? "Halted":
+                      r->state == Cpu_Running? "Running": "Break");
+    printf("PC = %#x, SP = %d\n", r->pc, r->sp);
+    printf("Stack: ");
+    for (int32_t i=r->sp; i >= 0 ; i--) {
+        printf("%#10x ", result.stack[i]);
+    }
+    printf("%s\n", r->sp == -1? "(empty)": "");
+
+    free(result.output);
+    free(result.stack);
+    free(prog);
+    return r->state == Cpu_Halted ||
+           (r->state == Cpu_Running && r->steps == steplimit)?0:1;
+}
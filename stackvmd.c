@@ -0,0 +1,394 @@
+/*  stackvmd.c - a server running programs for clients on a pool of threads.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#define _DEFAULT_SOURCE /* for fmemopen() and sysconf() */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "stackvm.h"
+#include "stackvmd.h"
+
+static vm_engine_t engine = Vm_ThreadedCached;
+static uint32_t stack_capacity = STACK_CAPACITY;
+static const char *socket_path = "stackvmd.sock";
+
+/*** Programs kept by hash ***/
+
+/* Clients may leave the program out of a request for one the server has
+   seen. Programs are kept in a direct-mapped table, a newer one takes
+   the place of an older one with the same slot */
+#define KEPT_PROGRAMS 1024
+
+typedef struct {
+    uint64_t hash;
+    uint32_t size;
+    Instr_t *words; /* NULL for an empty slot */
+} kept_program_t;
+
+static kept_program_t kept[KEPT_PROGRAMS];
+static pthread_rwlock_t kept_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void keep_program(uint64_t hash, const Instr_t *prog, uint32_t size) {
+    Instr_t *words = malloc(size ? size * sizeof(Instr_t) : 1);
+    if (words == NULL)
+        return; /* Only a missed chance to keep it */
+    memcpy(words, prog, size * sizeof(Instr_t));
+    kept_program_t *slot = &kept[hash % KEPT_PROGRAMS];
+    pthread_rwlock_wrlock(&kept_lock);
+    free(slot->words);
+    *slot = (kept_program_t){.hash = hash, .size = size, .words = words};
+    pthread_rwlock_unlock(&kept_lock);
+}
+
+/* Copies the kept program into prog, which has room for size words */
+static bool find_program(uint64_t hash, Instr_t *prog, uint32_t size) {
+    const kept_program_t *slot = &kept[hash % KEPT_PROGRAMS];
+    bool found = false;
+    pthread_rwlock_rdlock(&kept_lock);
+    if (slot->words && slot->hash == hash && slot->size == size) {
+        memcpy(prog, slot->words, size * sizeof(Instr_t));
+        found = true;
+    }
+    pthread_rwlock_unlock(&kept_lock);
+    return found;
+}
+
+/*** Connections ***/
+
+static bool read_full(int fd, void *buf, size_t size) {
+    char *p = buf;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t size) {
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* Accepted connections waiting for a worker */
+#define PENDING_CONNECTIONS 256
+
+static int pending[PENDING_CONNECTIONS];
+static unsigned pending_first;
+static unsigned pending_count;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_added = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pending_taken = PTHREAD_COND_INITIALIZER;
+
+static void add_connection(int fd) {
+    pthread_mutex_lock(&pending_lock);
+    while (pending_count == PENDING_CONNECTIONS)
+        pthread_cond_wait(&pending_taken, &pending_lock);
+    pending[(pending_first + pending_count++) % PENDING_CONNECTIONS] = fd;
+    pthread_cond_signal(&pending_added);
+    pthread_mutex_unlock(&pending_lock);
+}
+
+static int take_connection(void) {
+    pthread_mutex_lock(&pending_lock);
+    while (pending_count == 0)
+        pthread_cond_wait(&pending_added, &pending_lock);
+    int fd = pending[pending_first];
+    pending_first = (pending_first + 1) % PENDING_CONNECTIONS;
+    pending_count--;
+    pthread_cond_signal(&pending_taken);
+    pthread_mutex_unlock(&pending_lock);
+    return fd;
+}
+
+/* Guest output of a request is kept to this many bytes, a program that
+   prints more is stopped. The output is looked at every so many steps */
+#define MAX_OUTPUT_SIZE (1u << 20)
+#define OUTPUT_CHECK_STEPS (1u << 20)
+
+/* Buffers of a worker, reused from request to request */
+typedef struct {
+    vm_t *vm;
+    /* The program in the VM, so that the next request for it only resets
+       the VM and keeps the program as decoded by the engine */
+    bool loaded;
+    uint64_t loaded_hash;
+    uint32_t loaded_size;
+    Instr_t *prog;
+    uint32_t prog_allocated;
+    char *output; /* MAX_OUTPUT_SIZE bytes and a terminating zero */
+} worker_t;
+
+static bool respond(int fd, const stackvmd_response_t *response,
+                    const char *output, const cpu_t *cpu) {
+    return write_full(fd, response, sizeof(*response))
+        && write_full(fd, output, response->output_size)
+        && (cpu == NULL || write_full(fd, cpu->stack,
+                                      (cpu->sp + 1) * sizeof(uint32_t)));
+}
+
+/* Serves one request. Returns false when the connection is to be closed */
+static bool serve_request(worker_t *w, int fd) {
+    stackvmd_request_t request;
+    if (!read_full(fd, &request, sizeof(request)))
+        return false;
+    stackvmd_response_t response = {.magic = STACKVMD_RESPONSE_MAGIC};
+    if (request.magic != STACKVMD_REQUEST_MAGIC
+        || request.program_size > MAX_PROGRAM_SIZE) {
+        response.status = Stackvmd_BadRequest;
+        respond(fd, &response, NULL, NULL);
+        return false;
+    }
+
+    const uint32_t size = request.program_size;
+    if (size > w->prog_allocated) {
+        Instr_t *prog = realloc(w->prog, size * sizeof(Instr_t));
+        if (prog == NULL) {
+            response.status = Stackvmd_BadRequest;
+            respond(fd, &response, NULL, NULL);
+            return false;
+        }
+        w->prog = prog;
+        w->prog_allocated = size;
+    }
+    uint64_t hash = request.program_hash;
+    if (request.flags & STACKVMD_WITH_PROGRAM) {
+        if (!read_full(fd, w->prog, size * sizeof(Instr_t)))
+            return false;
+        hash = stackvmd_hash(w->prog, size);
+        keep_program(hash, w->prog, size);
+    }
+    if (w->loaded && w->loaded_hash == hash && w->loaded_size == size) {
+        vm_reset(w->vm);
+    } else {
+        if (!(request.flags & STACKVMD_WITH_PROGRAM)
+            && !find_program(hash, w->prog, size)) {
+            response.status = Stackvmd_UnknownProgram;
+            return respond(fd, &response, NULL, NULL);
+        }
+        if (!vm_load(w->vm, w->prog, size)) {
+            response.status = Stackvmd_BadRequest;
+            respond(fd, &response, NULL, NULL);
+            return false;
+        }
+        w->loaded = true;
+        w->loaded_hash = hash;
+        w->loaded_size = size;
+    }
+
+    /* Failures of a single request leave the connection open */
+    FILE *out = fmemopen(w->output, MAX_OUTPUT_SIZE + 1, "w");
+    if (out == NULL) {
+        response.status = Stackvmd_ServerError;
+        return respond(fd, &response, NULL, NULL);
+    }
+    vm_set_output(w->vm, out);
+    bool overflow = false;
+    uint64_t left = request.steplimit; /* Nothing to run for zero steps */
+    while (left > 0 && !overflow
+           && vm_cpu(w->vm)->state == Cpu_Running) {
+        const uint64_t slice =
+            left < OUTPUT_CHECK_STEPS ? left : OUTPUT_CHECK_STEPS;
+        vm_run(w->vm, slice);
+        left -= slice;
+        overflow = fflush(out) != 0 || ferror(out);
+    }
+    vm_set_output(w->vm, stdout);
+    const long output_size = ftell(out);
+    fclose(out);
+    if (overflow || output_size < 0 || output_size > MAX_OUTPUT_SIZE) {
+        response.status = Stackvmd_OutputTooLong;
+        return respond(fd, &response, NULL, NULL);
+    }
+
+    const cpu_t *cpu = vm_cpu(w->vm);
+    response.status = Stackvmd_Ok;
+    response.steps = cpu->steps;
+    response.state = cpu->state;
+    response.pc = cpu->pc;
+    response.sp = cpu->sp;
+    response.output_size = output_size;
+    return respond(fd, &response, w->output, cpu);
+}
+
+/* Each worker has a VM of its own and serves one connection at a time,
+   until the client closes it */
+static void* work(void *arg) {
+    (void)arg;
+    worker_t w = {.vm = vm_create(engine, stack_capacity),
+                  .output = malloc(MAX_OUTPUT_SIZE + 1)};
+    if (w.vm == NULL || w.output == NULL) {
+        fprintf(stderr, "Failed to create a virtual machine.\n");
+        exit(2);
+    }
+    while (true) {
+        int fd = take_connection();
+        while (serve_request(&w, fd))
+            ;
+        close(fd);
+    }
+    return NULL;
+}
+
+static void remove_socket(int sig) {
+    unlink(socket_path);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static const char *socket_opt = "--socket=";
+static const char *threads_opt = "--threads=";
+static const char *engine_opt = "--engine=";
+static const char *stack_capacity_opt = "--stack-capacity=";
+static const char *const engine_names[] = {
+    [Vm_Switched] = "switched",
+    [Vm_Predecoded] = "predecoded",
+    [Vm_ThreadedCached] = "threaded-cached",
+};
+
+static void report_usage_and_exit(char *exec_name, int ret_code) {
+    fprintf(stderr, "Usage: %s %s<path> %s<num>"
+            " %s<switched|predecoded|threaded-cached> %s<num>\n", exec_name,
+            socket_opt, threads_opt, engine_opt, stack_capacity_opt);
+    exit(ret_code);
+}
+
+int main(int argc, char **argv) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned workers_count = online > 0 ? online : 1;
+
+    for (int i = 1; i < argc; ++i) {
+        char *endptr = NULL;
+        errno = 0;
+        if (!strcmp(argv[i], "--help")) {
+            report_usage_and_exit(argv[0], 0);
+        } else if (!strncmp(argv[i], socket_opt, strlen(socket_opt))) {
+            socket_path = argv[i] + strlen(socket_opt);
+        } else if (!strncmp(argv[i], threads_opt, strlen(threads_opt))) {
+            unsigned long n = strtoul(argv[i] + strlen(threads_opt), &endptr, 10);
+            if (errno || *endptr != '\0' || n == 0 || n > 1024) {
+                fprintf(stderr, "Invalid number of threads: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+            workers_count = n;
+        } else if (!strncmp(argv[i], engine_opt, strlen(engine_opt))) {
+            const char *name = argv[i] + strlen(engine_opt);
+            unsigned e;
+            for (e = 0; e < sizeof(engine_names) / sizeof(engine_names[0]); e++)
+                if (!strcmp(name, engine_names[e]))
+                    break;
+            if (e == sizeof(engine_names) / sizeof(engine_names[0])) {
+                fprintf(stderr, "Unknown engine: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+            engine = e;
+        } else if (!strncmp(argv[i], stack_capacity_opt,
+                            strlen(stack_capacity_opt))) {
+            unsigned long capacity =
+                strtoul(argv[i] + strlen(stack_capacity_opt), &endptr, 10);
+            if (errno || *endptr != '\0' || capacity < MIN_STACK_CAPACITY
+                || capacity > MAX_STACK_CAPACITY) {
+                fprintf(stderr, "Invalid stack capacity: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+            stack_capacity = capacity;
+        } else {
+            fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+            report_usage_and_exit(argv[0], 2);
+        }
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", socket_path);
+        exit(2);
+    }
+    strcpy(addr.sun_path, socket_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+        exit(2);
+    }
+    unlink(socket_path);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr))
+        || listen(listener, SOMAXCONN)) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", socket_path,
+                strerror(errno));
+        exit(2);
+    }
+    /* A client going away must not take the server with it */
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, remove_socket);
+    signal(SIGTERM, remove_socket);
+
+    for (unsigned i = 0; i < workers_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, work, NULL)) {
+            fprintf(stderr, "Cannot start worker thread\n");
+            exit(2);
+        }
+        pthread_detach(thread);
+    }
+    while (true) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                fprintf(stderr, "Cannot accept connection: %s\n",
+                        strerror(errno));
+            continue;
+        }
+        add_connection(fd);
+    }
+    return 0;
+}
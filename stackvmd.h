@@ -0,0 +1,88 @@
+/*  stackvmd.h - protocol of the stack virtual machine server.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef STACKVMD_H_
+#define STACKVMD_H_
+
+#include <stdint.h>
+
+#include "common.h"
+
+/* A client connects to the Unix domain socket of the server and sends
+   requests, one after another, on the same connection. Every request gets
+   a response before the server reads the next one. Fields are in the byte
+   order of the host, as the client and the server run on the same one */
+
+#define STACKVMD_REQUEST_MAGIC  0x51564d53u /* "SMVQ" */
+#define STACKVMD_RESPONSE_MAGIC 0x52564d53u /* "SMVR" */
+
+/* The program words follow the request. Without the flag the server runs
+   the program it keeps under the hash and size of the request, if any */
+#define STACKVMD_WITH_PROGRAM 1u
+
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t steplimit;
+    uint64_t program_hash;  /* stackvmd_hash() of the program */
+    uint32_t program_size;  /* in words */
+    uint32_t reserved;
+} stackvmd_request_t;
+
+typedef enum {
+    Stackvmd_Ok = 0,
+    Stackvmd_UnknownProgram, /* send the request again with the program */
+    Stackvmd_BadRequest,     /* the server closes the connection */
+    Stackvmd_OutputTooLong,  /* the program printed more than the server
+                                keeps, it was stopped */
+    Stackvmd_ServerError     /* the server could not run the request */
+} stackvmd_status_t;
+
+/* Followed by output_size bytes of guest output, then by the sp + 1
+   entries of the stack, from the bottom up */
+typedef struct {
+    uint32_t magic;
+    uint32_t status;
+    uint64_t steps;
+    uint32_t state;         /* cpu_state_t */
+    uint32_t pc;
+    int32_t sp;
+    uint32_t output_size;
+} stackvmd_response_t;
+
+/* FNV-1a over the words of the program */
+static inline uint64_t stackvmd_hash(const Instr_t *prog, uint32_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (uint32_t i = 0; i < size; i++) {
+        hash ^= prog[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+#endif /* STACKVMD_H_ */
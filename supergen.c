@@ -0,0 +1,420 @@
+/*  supergen.c - a generator of static superinstructions for interpreters
+    of a stack virtual machine.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* Reads a profile of instruction sequences written by predecoded-profile
+   and prints a header with superinstructions for the most frequent of them.
+   Usage: supergen <profile> [<number of superinstructions>] */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "common.h"
+
+#define MAX_LENGTH 5
+#define MAX_SEQUENCES 4096
+#define DEFAULT_COUNT 8
+
+typedef struct {
+    Instr_t ops[MAX_LENGTH];
+    int length;
+    uint64_t count;
+} sequence_t;
+
+static sequence_t sequences[MAX_SEQUENCES];
+static int sequences_count = 0;
+
+static bool has_immediate(Instr_t op) {
+    return op == Instr_Push || op == Instr_JE || op == Instr_JNE
+           || op == Instr_Jump;
+}
+
+static bool is_branch(Instr_t op) {
+    return op == Instr_JE || op == Instr_JNE || op == Instr_Jump;
+}
+
+/* Instructions that can be fused: they cannot fail if the stack has
+   enough values and space, and do not need libc */
+static bool is_fusable(Instr_t op) {
+    switch (op) {
+    case Instr_Nop: case Instr_Push: case Instr_Swap: case Instr_Dup:
+    case Instr_Over: case Instr_Inc: case Instr_Dec: case Instr_Drop:
+    case Instr_Add: case Instr_Sub: case Instr_Mul: case Instr_Mod:
+    case Instr_And: case Instr_Or: case Instr_Xor:
+    case Instr_SHL: case Instr_SHR: case Instr_Rot:
+    case Instr_JE: case Instr_JNE: case Instr_Jump:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* A superinstruction has at most one immediate operand, which goes into
+   its decoded immediate, and a branch may only end it */
+static bool is_legal(const sequence_t *s) {
+    int immediates = 0;
+    for (int i = 0; i < s->length; i++) {
+        if (!is_fusable(s->ops[i]))
+            return false;
+        if (is_branch(s->ops[i]) && i != s->length - 1)
+            return false;
+        immediates += has_immediate(s->ops[i]);
+    }
+    return immediates <= 1;
+}
+
+static int find_opcode(const char *name) {
+    for (int op = 0; op <= Instr_Pick; op++) {
+        if (!strcmp(InstrNames[op], name))
+            return op;
+    }
+    return -1;
+}
+
+/* Parse lines like "<count> <mnemonic> <mnemonic>...".
+   The same sequence may appear many times, counts are summed */
+static void read_profile(FILE *f) {
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        sequence_t s = {{0}, 0, 0};
+        char *token = strtok(line, " \n");
+        if (!token)
+            continue;
+        s.count = strtoull(token, NULL, 10);
+        while ((token = strtok(NULL, " \n"))) {
+            int op = find_opcode(token);
+            if (op < 0) {
+                fprintf(stderr, "Unknown instruction %s\n", token);
+                exit(2);
+            }
+            if (s.length == MAX_LENGTH)
+                break;
+            s.ops[s.length++] = op;
+        }
+        if (s.length < 2 || !is_legal(&s))
+            continue;
+        int i;
+        for (i = 0; i < sequences_count; i++) {
+            if (sequences[i].length == s.length
+                && !memcmp(sequences[i].ops, s.ops, sizeof(s.ops)))
+                break;
+        }
+        if (i == sequences_count) {
+            if (sequences_count == MAX_SEQUENCES) {
+                fprintf(stderr, "Too many sequences in the profile\n");
+                exit(2);
+            }
+            sequences[sequences_count++] = s;
+        } else {
+            sequences[i].count += s.count;
+        }
+    }
+}
+
+/* Dispatches saved by fusing a sequence */
+static uint64_t score(const sequence_t *s) {
+    return s->count * (s->length - 1);
+}
+
+static int by_score(const void *a, const void *b) {
+    uint64_t sa = score(a), sb = score(b);
+    return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+static int by_length(const void *a, const void *b) {
+    return ((const sequence_t*)b)->length - ((const sequence_t*)a)->length;
+}
+
+/* A sequence that is always executed as a part of a longer one
+   is not worth a superinstruction of its own */
+static bool is_covered(const sequence_t *s, const sequence_t *by) {
+    if (by->count < s->count)
+        return false;
+    for (int start = 0; start + s->length <= by->length; start++) {
+        if (!memcmp(by->ops + start, s->ops, s->length * sizeof(Instr_t)))
+            return true;
+    }
+    return false;
+}
+
+/*** Code generation ***/
+
+/* The generator executes a sequence on a symbolic stack. Values are names
+   of C variables or expressions. Slots of the original stack are loaded
+   only when used and stored back only if they changed */
+
+#define MAX_DEPTH 16 /* Enough for MAX_LENGTH instructions */
+#define NO_ORIGIN INT32_MIN
+
+typedef struct {
+    char expr[32];
+    int origin; /* stack position the value was loaded from */
+} value_t;
+
+typedef struct {
+    value_t slots[2 * MAX_DEPTH + 1]; /* indexed by position + MAX_DEPTH */
+    bool known[2 * MAX_DEPTH + 1];
+    int depth;     /* position of the top relative to SP on entry */
+    int temps;     /* C variables used so far */
+    int lowest;    /* the lowest SP on entry that has all needed values */
+    int highest;   /* the highest depth reached */
+    char body[4096];
+} generator_t;
+
+static void append(generator_t *g, const char *line) {
+    assert(strlen(g->body) + strlen(line) + 4 < sizeof(g->body));
+    strcat(g->body, line);
+    strcat(g->body, " \\\n");
+}
+
+static value_t new_temp(generator_t *g, const char *expr) {
+    value_t v = {"", NO_ORIGIN};
+    char line[128];
+    snprintf(v.expr, sizeof(v.expr), "t%d", g->temps++);
+    snprintf(line, sizeof(line), "        uint32_t %s = %s;", v.expr, expr);
+    append(g, line);
+    return v;
+}
+
+static value_t pop(generator_t *g) {
+    int pos = g->depth--;
+    assert(pos > -MAX_DEPTH);
+    if (-pos > g->lowest)
+        g->lowest = -pos;
+    if (!g->known[pos + MAX_DEPTH]) {
+        char load[32];
+        snprintf(load, sizeof(load), "SUPER_S(%d)", pos);
+        value_t v = new_temp(g, load);
+        v.origin = pos;
+        g->slots[pos + MAX_DEPTH] = v;
+        g->known[pos + MAX_DEPTH] = true;
+    }
+    return g->slots[pos + MAX_DEPTH];
+}
+
+static void push(generator_t *g, value_t v) {
+    int pos = ++g->depth;
+    assert(pos < MAX_DEPTH);
+    if (pos > g->highest)
+        g->highest = pos;
+    g->slots[pos + MAX_DEPTH] = v;
+    g->known[pos + MAX_DEPTH] = true;
+}
+
+static value_t binary(generator_t *g, value_t a, const char *op, value_t b) {
+    char expr[80];
+    snprintf(expr, sizeof(expr), "%s %s %s", a.expr, op, b.expr);
+    return new_temp(g, expr);
+}
+
+/* Emit stores of changed values and the SP update */
+static void write_back(generator_t *g, const char *indent) {
+    char line[128];
+    for (int pos = -MAX_DEPTH + 1; pos <= g->depth; pos++) {
+        const value_t *v = &g->slots[pos + MAX_DEPTH];
+        if (!g->known[pos + MAX_DEPTH] || v->origin == pos)
+            continue;
+        snprintf(line, sizeof(line), "%sSUPER_S(%d) = %s;",
+                 indent, pos, v->expr);
+        append(g, line);
+    }
+    if (g->depth) {
+        snprintf(line, sizeof(line), "%sSUPER_SP(%d);", indent, g->depth);
+        append(g, line);
+    }
+}
+
+/* Body of a superinstruction in terms of SUPER_* macros of interpreters */
+static void generate(generator_t *g, const sequence_t *s) {
+    memset(g, 0, sizeof(*g));
+    g->lowest = -1;
+    char line[128];
+    int offset = 0; /* of the current instruction from the start, in words */
+    value_t a, b, c;
+    const value_t imm = {"SUPER_IMM", NO_ORIGIN};
+    const value_t one = {"1", NO_ORIGIN};
+    append(g, "    {");
+    for (int i = 0; i < s->length; i++) {
+        switch (s->ops[i]) {
+        case Instr_Nop:
+            break;
+        case Instr_Push:
+            push(g, imm);
+            break;
+        case Instr_Swap:
+            a = pop(g); b = pop(g);
+            push(g, a); push(g, b);
+            break;
+        case Instr_Dup:
+            a = pop(g);
+            push(g, a); push(g, a);
+            break;
+        case Instr_Over:
+            a = pop(g); b = pop(g);
+            push(g, b); push(g, a); push(g, b);
+            break;
+        case Instr_Rot:
+            a = pop(g); b = pop(g); c = pop(g);
+            push(g, a); push(g, c); push(g, b);
+            break;
+        case Instr_Drop:
+            (void)pop(g);
+            break;
+        case Instr_Inc:
+            a = pop(g);
+            push(g, binary(g, a, "+", one));
+            break;
+        case Instr_Dec:
+            a = pop(g);
+            push(g, binary(g, a, "-", one));
+            break;
+        case Instr_Add: a = pop(g); b = pop(g); push(g, binary(g, a, "+", b)); break;
+        case Instr_Sub: a = pop(g); b = pop(g); push(g, binary(g, a, "-", b)); break;
+        case Instr_Mul: a = pop(g); b = pop(g); push(g, binary(g, a, "*", b)); break;
+        case Instr_And: a = pop(g); b = pop(g); push(g, binary(g, a, "&", b)); break;
+        case Instr_Or:  a = pop(g); b = pop(g); push(g, binary(g, a, "|", b)); break;
+        case Instr_Xor: a = pop(g); b = pop(g); push(g, binary(g, a, "^", b)); break;
+        case Instr_SHL: a = pop(g); b = pop(g); push(g, binary(g, a, "<<", b)); break;
+        case Instr_SHR: a = pop(g); b = pop(g); push(g, binary(g, a, ">>", b)); break;
+        case Instr_Mod:
+            a = pop(g); b = pop(g);
+            /* Leave the stack as the interpreter would and stop */
+            snprintf(line, sizeof(line), "        if (%s == 0) {", b.expr);
+            append(g, line);
+            write_back(g, "            ");
+            snprintf(line, sizeof(line), "            SUPER_DIVZERO(%d, %d);",
+                     i, offset);
+            append(g, line);
+            append(g, "        }");
+            push(g, binary(g, a, "%", b));
+            break;
+        case Instr_JE:
+        case Instr_JNE:
+        case Instr_Jump:
+            assert(i == s->length - 1);
+            break;
+        default:
+            assert("Unreachable" && false);
+            break;
+        }
+        offset += has_immediate(s->ops[i]) ? 2 : 1;
+    }
+    Instr_t last = s->ops[s->length - 1];
+    if (last == Instr_JE || last == Instr_JNE)
+        a = pop(g);
+    write_back(g, "        ");
+    if (last == Instr_JE || last == Instr_JNE) {
+        snprintf(line, sizeof(line), "        SUPER_BRANCH(%s %s 0);",
+                 a.expr, last == Instr_JE ? "==" : "!=");
+        append(g, line);
+    } else if (last == Instr_Jump) {
+        append(g, "        SUPER_BRANCH(true);");
+    }
+    strcat(g->body, "    }");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <profile> [<number of superinstructions>]\n",
+                argv[0]);
+        return 2;
+    }
+    FILE *f = fopen(argv[1], "r");
+    if (!f) {
+        perror(argv[1]);
+        return 2;
+    }
+    read_profile(f);
+    fclose(f);
+    int wanted = argc == 3 ? atoi(argv[2]) : DEFAULT_COUNT;
+
+    /* Choose the sequences saving the most dispatches */
+    qsort(sequences, sequences_count, sizeof(sequence_t), by_score);
+    sequence_t chosen[MAX_SEQUENCES];
+    int count = 0;
+    for (int i = 0; i < sequences_count && count < wanted; i++) {
+        bool covered = false;
+        for (int j = 0; j < count && !covered; j++)
+            covered = is_covered(&sequences[i], &chosen[j]);
+        if (!covered)
+            chosen[count++] = sequences[i];
+    }
+    /* Interpreters take the first superinstruction that matches */
+    qsort(chosen, count, sizeof(sequence_t), by_length);
+
+    printf("/*  superinstructions.h - superinstructions for predecoded and\n"
+           "    threaded-cached interpreters.\n"
+           "    Generated by supergen from %s, do not edit.\n"
+           "    Use \"make superinstructions\" to regenerate it. */\n\n",
+           argv[1]);
+    printf("#ifndef SUPERINSTRUCTIONS_H_\n#define SUPERINSTRUCTIONS_H_\n\n");
+    printf("#define SUPER_COUNT %d\n", count);
+    printf("#define SUPER_MAX_LENGTH %d\n\n", MAX_LENGTH);
+    printf("/* Internal opcodes of superinstructions follow the ISA ones */\n");
+    printf("#define SUPER_OPCODE(i) (Instr_Pick + 1 + (i))\n\n");
+
+    printf("/* Instructions fused into superinstructions */\n");
+    printf("static const int SuperLengths[] = {");
+    for (int i = 0; i < count; i++)
+        printf("%s%d", i ? ", " : "", chosen[i].length);
+    printf("};\n\n");
+    printf("static const Instr_t SuperComponents[][SUPER_MAX_LENGTH] = {\n");
+    for (int i = 0; i < count; i++) {
+        printf("    {");
+        for (int j = 0; j < chosen[i].length; j++)
+            printf("%sInstr_%s", j ? ", " : "", InstrNames[chosen[i].ops[j]]);
+        printf("},\n");
+    }
+    printf("};\n\n");
+
+    printf("/* X(index, instructions, lowest SP, highest SP, body)\n"
+           "   Bodies work on the stack with SUPER_S(position relative to SP),\n"
+           "   SUPER_SP(change) and SUPER_IMM; end with SUPER_BRANCH(taken)\n"
+           "   if the last instruction is a branch; and use\n"
+           "   SUPER_DIVZERO(instructions done, offset of Mod) to stop.\n"
+           "   The highest SP depends on SUPER_CAPACITY, the capacity of the stack.\n"
+           "   Interpreters provide all of them */\n");
+    printf("#define SUPERINSTRUCTIONS(X) \\\n");
+    for (int i = 0; i < count; i++) {
+        generator_t g;
+        generate(&g, &chosen[i]);
+        printf("    /*");
+        for (int j = 0; j < chosen[i].length; j++)
+            printf(" %s", InstrNames[chosen[i].ops[j]]);
+        printf(", executed %" PRIu64 " times */ \\\n", chosen[i].count);
+        printf("    X(%d, %d, %d, SUPER_CAPACITY - 1 - %d, \\\n%s) \\\n",
+               i, chosen[i].length, g.lowest, g.highest, g.body);
+    }
+    printf("\n#endif /* SUPERINSTRUCTIONS_H_ */\n");
+    return 0;
+}
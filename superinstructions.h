@@ -0,0 +1,109 @@
+/*  superinstructions.h - superinstructions for predecoded and
+    threaded-cached interpreters.
+    Generated by supergen from ngrams.prof, do not edit.
+    Use "make superinstructions" to regenerate it. */
+
+#ifndef SUPERINSTRUCTIONS_H_
+#define SUPERINSTRUCTIONS_H_
+
+#define SUPER_COUNT 8
+#define SUPER_MAX_LENGTH 5
+
+/* Internal opcodes of superinstructions follow the ISA ones */
+#define SUPER_OPCODE(i) (Instr_Pick + 1 + (i))
+
+/* Instructions fused into superinstructions */
+static const int SuperLengths[] = {5, 5, 5, 4, 3, 2, 2, 2};
+
+static const Instr_t SuperComponents[][SUPER_MAX_LENGTH] = {
+    {Instr_Over, Instr_Over, Instr_Swap, Instr_Sub, Instr_JE},
+    {Instr_Over, Instr_Over, Instr_Swap, Instr_Mod, Instr_JE},
+    {Instr_Push, Instr_Over, Instr_Over, Instr_Swap, Instr_Sub},
+    {Instr_Over, Instr_Over, Instr_Sub, Instr_JE},
+    {Instr_Over, Instr_Over, Instr_Swap},
+    {Instr_Over, Instr_Over},
+    {Instr_Sub, Instr_JE},
+    {Instr_Inc, Instr_Jump},
+};
+
+/* X(index, instructions, lowest SP, highest SP, body)
+   Bodies work on the stack with SUPER_S(position relative to SP),
+   SUPER_SP(change) and SUPER_IMM; end with SUPER_BRANCH(taken)
+   if the last instruction is a branch; and use
+   SUPER_DIVZERO(instructions done, offset of Mod) to stop.
+   The highest SP depends on SUPER_CAPACITY, the capacity of the stack.
+   Interpreters provide all of them */
+#define SUPERINSTRUCTIONS(X) \
+    /* Over Over Swap Sub JE, executed 455198741 times */ \
+    X(0, 5, 1, SUPER_CAPACITY - 1 - 2, \
+    { \
+        uint32_t t0 = SUPER_S(0); \
+        uint32_t t1 = SUPER_S(-1); \
+        uint32_t t2 = t1 - t0; \
+        SUPER_BRANCH(t2 == 0); \
+    }) \
+    /* Over Over Swap Mod JE, executed 455189149 times */ \
+    X(1, 5, 1, SUPER_CAPACITY - 1 - 2, \
+    { \
+        uint32_t t0 = SUPER_S(0); \
+        uint32_t t1 = SUPER_S(-1); \
+        if (t0 == 0) { \
+            SUPER_DIVZERO(3, 3); \
+        } \
+        uint32_t t2 = t1 % t0; \
+        SUPER_BRANCH(t2 == 0); \
+    }) \
+    /* Push Over Over Swap Sub, executed 99998 times */ \
+    X(2, 5, 0, SUPER_CAPACITY - 1 - 3, \
+    { \
+        uint32_t t0 = SUPER_S(0); \
+        uint32_t t1 = t0 - SUPER_IMM; \
+        SUPER_S(1) = SUPER_IMM; \
+        SUPER_S(2) = t1; \
+        SUPER_SP(2); \
+    }) \
+    /* Over Over Sub JE, executed 99999 times */ \
+    X(3, 4, 1, SUPER_CAPACITY - 1 - 2, \
+    { \
+        uint32_t t0 = SUPER_S(0); \
+        uint32_t t1 = SUPER_S(-1); \
+        uint32_t t2 = t0 - t1; \
+        SUPER_BRANCH(t2 == 0); \
+    }) \
+    /* Over Over Swap, executed 910387890 times */ \
+    X(4, 3, 1, SUPER_CAPACITY - 1 - 2, \
+    { \
+        uint32_t t0 = SUPER_S(0); \
+        uint32_t t1 = SUPER_S(-1); \
+        SUPER_S(1) = t0; \
+        SUPER_S(2) = t1; \
+        SUPER_SP(2); \
+    }) \
+    /* Over Over, executed 910487889 times */ \
+    X(5, 2, 1, SUPER_CAPACITY - 1 - 2, \
+    { \
+        uint32_t t0 = SUPER_S(0); \
+        uint32_t t1 = SUPER_S(-1); \
+        SUPER_S(1) = t1; \
+        SUPER_S(2) = t0; \
+        SUPER_SP(2); \
+    }) \
+    /* Sub JE, executed 455298740 times */ \
+    X(6, 2, 1, SUPER_CAPACITY - 1 - 0, \
+    { \
+        uint32_t t0 = SUPER_S(0); \
+        uint32_t t1 = SUPER_S(-1); \
+        uint32_t t2 = t0 - t1; \
+        SUPER_SP(-2); \
+        SUPER_BRANCH(t2 == 0); \
+    }) \
+    /* Inc Jump, executed 455198741 times */ \
+    X(7, 2, 0, SUPER_CAPACITY - 1 - 0, \
+    { \
+        uint32_t t0 = SUPER_S(0); \
+        uint32_t t1 = t0 + 1; \
+        SUPER_S(0) = t1; \
+        SUPER_BRANCH(true); \
+    }) \
+
+#endif /* SUPERINSTRUCTIONS_H_ */
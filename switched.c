@@ -36,16 +36,17 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <math.h>
 
 #include "common.h"
+#include "stackcache.h"
 
 static inline Instr_t fetch(const cpu_t *pcpu) {
     assert(pcpu);
-    assert(pcpu->pc < PROGRAM_SIZE);
+    assert(pcpu->pc < pcpu->program_size);
     return pcpu->pmem[pcpu->pc];
 };
 
 static inline Instr_t fetch_checked(cpu_t *pcpu) {
-    if (!(pcpu->pc < PROGRAM_SIZE)) {
-        printf("PC out of bounds\n");
+    if (!(pcpu->pc < pcpu->program_size)) {
+        fprintf(pcpu->out, "PC out of bounds\n");
         pcpu->state = Cpu_Break;
         return Instr_Break;
     }
@@ -87,8 +88,8 @@ static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
     case Instr_JE:
     case Instr_Jump:
         result.length = 2;
-        if (!(pcpu->pc+1 < PROGRAM_SIZE)) {
-            printf("PC+1 out of bounds\n");
+        if (!(pcpu->pc+1 < pcpu->program_size)) {
+            fprintf(pcpu->out, "PC+1 out of bounds\n");
             result.length = 1;
             result.opcode = Instr_Break;
             break;
@@ -109,8 +110,8 @@ static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
 
 static inline void push(cpu_t *pcpu, uint32_t v) {
     assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
+    if (pcpu->sp >= pcpu->stack_capacity-1) {
+        fprintf(pcpu->out, "Stack overflow\n");
         pcpu->state = Cpu_Break;
         return;
     }
@@ -120,7 +121,7 @@ static inline void push(cpu_t *pcpu, uint32_t v) {
 static inline uint32_t pop(cpu_t *pcpu) {
     assert(pcpu);
     if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
+        fprintf(pcpu->out, "Stack underflow\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
@@ -130,16 +131,19 @@ static inline uint32_t pop(cpu_t *pcpu) {
 static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
     assert(pcpu);
     if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
+        fprintf(pcpu->out, "Out of bound picking\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
     return pcpu->stack[pcpu->sp - pos];
 }
 
-int main(int argc, char **argv) {
-    uint64_t steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
+/* Runs the CPU until it stops or the total of executed instructions
+   reaches steplimit. Keeps no state of its own between calls */
+void run_switched(cpu_t *pcpu, uint64_t steplimit) {
+    assert(pcpu);
+    cpu_t cpu = *pcpu;
+    stack_cache_t cache = {0};
 
     while (cpu.state == Cpu_Running && cpu.steps < steplimit) {
         Instr_t raw_instr = fetch_checked(&cpu);
@@ -156,86 +160,150 @@ int main(int argc, char **argv) {
             cpu.state = Cpu_Halted;
             break;
         case Instr_Push:
-            push(&cpu, decoded.immediate);
+            if (CACHED(0, 1)) {
+                PUSH_CACHED(decoded.immediate);
+                break;
+            }
+            PUSH(decoded.immediate);
             break;
         case Instr_Print:
-            tmp1 = pop(&cpu); BAIL_ON_ERROR();
-            printf("[%d]\n", tmp1);
+            tmp1 = POP(); BAIL_ON_ERROR();
+            fprintf(cpu.out, "[%d]\n", tmp1);
             break;
         case Instr_Swap:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                tmp1 = TOP();
+                SET_TOP(SECOND());
+                SET_SECOND(tmp1);
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
+            PUSH(tmp1);
+            PUSH(tmp2);
             break;
         case Instr_Dup:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 1)) {
+                PUSH_CACHED(TOP());
+                break;
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp1);
+            PUSH(tmp1);
+            PUSH(tmp1);
             break;
         case Instr_Over:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 1)) {
+                PUSH_CACHED(SECOND());
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp2);
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
+            PUSH(tmp2);
+            PUSH(tmp1);
+            PUSH(tmp2);
             break;
         case Instr_Inc:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                SET_TOP(TOP() + 1);
+                break;
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1+1);
+            PUSH(tmp1+1);
             break;
         case Instr_Add:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() + SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 + tmp2);
+            PUSH(tmp1 + tmp2);
             break;
         case Instr_Sub:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() - SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 - tmp2);
+            PUSH(tmp1 - tmp2);
             break;
         case Instr_Mod:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0) && SECOND() != 0) {
+                SET_TOP(TOP() % SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
             if (tmp2 == 0) {
                 cpu.state = Cpu_Break;
                 break;
             }
-            push(&cpu, tmp1 % tmp2);
+            PUSH(tmp1 % tmp2);
             break;
         case Instr_Mul:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() * SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 * tmp2);
+            PUSH(tmp1 * tmp2);
             break;
         case Instr_Rand:
             tmp1 = rand();
-            push(&cpu, tmp1);
+            PUSH(tmp1);
             break;
         case Instr_Dec:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                SET_TOP(TOP() - 1);
+                break;
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1-1);
+            PUSH(tmp1-1);
             break;
         case Instr_Drop:
-            (void)pop(&cpu);
+            if (CACHED(1, 0)) {
+                DROP_CACHED();
+                break;
+            }
+            (void)POP();
             break;
         case Instr_JE:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                tmp1 = TOP();
+                DROP_CACHED();
+                if (tmp1 == 0)
+                    cpu.pc += decoded.immediate;
+                break;
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
             if (tmp1 == 0)
                 cpu.pc += decoded.immediate;
             break;
         case Instr_JNE:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                tmp1 = TOP();
+                DROP_CACHED();
+                if (tmp1 != 0)
+                    cpu.pc += decoded.immediate;
+                break;
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
             if (tmp1 != 0)
                 cpu.pc += decoded.immediate;
@@ -244,53 +312,78 @@ int main(int argc, char **argv) {
             cpu.pc += decoded.immediate;
             break;
         case Instr_And:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() & SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 & tmp2);
+            PUSH(tmp1 & tmp2);
             break;
         case Instr_Or:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() | SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 | tmp2);
+            PUSH(tmp1 | tmp2);
             break;
         case Instr_Xor:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() ^ SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 ^ tmp2);
+            PUSH(tmp1 ^ tmp2);
             break;
         case Instr_SHL:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() << SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 << tmp2);
+            PUSH(tmp1 << tmp2);
             break;
         case Instr_SHR:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() >> SECOND());
+                NIP_CACHED();
+                break;
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 >> tmp2);
+            PUSH(tmp1 >> tmp2);
             break;
         case Instr_Rot:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            tmp3 = pop(&cpu);
+            tmp1 = POP();
+            tmp2 = POP();
+            tmp3 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp3);
-            push(&cpu, tmp2);
+            PUSH(tmp1);
+            PUSH(tmp3);
+            PUSH(tmp2);
             break;
         case Instr_SQRT:
-            tmp1 = pop(&cpu);
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, sqrt(tmp1));
+            PUSH(sqrt(tmp1));
             break;
         case Instr_Pick:
-            tmp1 = pop(&cpu);
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, pick(&cpu, tmp1));
+            PUSH(PICK(tmp1));
             break;
         case Instr_Break:
             cpu.state = Cpu_Break;
@@ -304,6 +397,16 @@ int main(int argc, char **argv) {
     }
 
     assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
+    FLUSH_STACK_CACHE();
+    *pcpu = cpu;
+}
+
+#ifndef STACKVM_LIBRARY
+int main(int argc, char **argv) {
+    uint64_t steplimit = parse_args(argc, argv);
+    cpu_t cpu = init_cpu();
+    run_switched(&cpu, steplimit);
+
     /* Print CPU state */
     printf("CPU executed %ld steps. End state \"%s\".\n",
             cpu.steps, cpu.state == Cpu_Halted? "Halted":
@@ -315,9 +418,11 @@ int main(int argc, char **argv) {
     }
     printf("%s\n", cpu.sp == -1? "(empty)": "");
 
-    free(LoadedProgram);
+    free(cpu.stack);
+    unload_program();
 
     return cpu.state == Cpu_Halted ||
            (cpu.state == Cpu_Running &&
             cpu.steps == steplimit)?0:1;
 }
+#endif
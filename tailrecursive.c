@@ -38,17 +38,14 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include "common.h"
 
-/* TODO:a global - not good. Should be moved into cpu state or somewhere else */
-static uint64_t steplimit = LLONG_MAX;
-
 static inline Instr_t fetch(const cpu_t *pcpu) {
     assert(pcpu);
-    assert(pcpu->pc < PROGRAM_SIZE);
+    assert(pcpu->pc < pcpu->program_size);
     return pcpu->pmem[pcpu->pc];
 };
 
 static inline Instr_t fetch_checked(cpu_t *pcpu) {
-    if (!(pcpu->pc < PROGRAM_SIZE)) {
+    if (!(pcpu->pc < pcpu->program_size)) {
         printf("PC out of bounds\n");
         pcpu->state = Cpu_Break;
         return Instr_Break;
@@ -89,7 +86,7 @@ static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
     case Instr_JNE:
     case Instr_JE:
     case Instr_Jump:
-        if (!(pcpu->pc+1 < PROGRAM_SIZE)) {
+        if (!(pcpu->pc+1 < pcpu->program_size)) {
             printf("PC+1 out of bounds\n");
             result.length = 1;
             result.opcode = Instr_Break;
@@ -119,12 +116,12 @@ static inline decode_t fetch_decode(cpu_t *pcpu) {
 #define ADVANCE_PC() do {\
     pcpu->pc += pdecoded->length;\
     pcpu->steps++; \
-    if (pcpu->state != Cpu_Running || pcpu->steps >= steplimit) return;\
+    if (pcpu->state != Cpu_Running || pcpu->steps >= pcpu->steplimit) return;\
 } while(0);
 
 static inline void push(cpu_t *pcpu, uint32_t v) {
     assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
+    if (pcpu->sp >= pcpu->stack_capacity-1) {
         printf("Stack overflow\n");
         pcpu->state = Cpu_Break;
         return;
@@ -422,8 +419,9 @@ service_routine_t service_routines[] = {
     };
 
 int main(int argc, char **argv) {
-    steplimit = parse_args(argc, argv);
+    const uint64_t steplimit = parse_args(argc, argv);
     cpu_t cpu = init_cpu();
+    cpu.steplimit = steplimit;
 
     decode_t decoded = fetch_decode(&cpu);
     service_routines[decoded.opcode](&cpu, &decoded);
@@ -440,7 +438,8 @@ int main(int argc, char **argv) {
     }
     printf("%s\n", cpu.sp == -1? "(empty)": "");
 
-    free(LoadedProgram);
+    free(cpu.stack);
+    unload_program();
 
     return cpu.state == Cpu_Halted ||
            (cpu.state == Cpu_Running &&
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Checks of the jobs files of batch, run from the top directory
+# by "make check"
+
+set -u
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+FAILED=0
+
+fail () {
+    echo "batch-test: $1" >&2
+    FAILED=1
+}
+
+# Jobs run as the standalone variant runs them
+printf 'factorial.raw 100\nfactorial.raw\n' > "$TMP/jobs"
+{
+    echo "== factorial.raw"
+    ./threaded-cached --inp-prog=factorial.raw --steplimit=100
+    echo "== factorial.raw"
+    ./threaded-cached --inp-prog=factorial.raw
+} > "$TMP/expected"
+./batch --threads=2 "$TMP/jobs" > "$TMP/out" || fail "valid jobs failed"
+cmp -s "$TMP/out" "$TMP/expected" || fail "output differs from threaded-cached"
+
+# Step limits are positive
+for LIMIT in 0 -5 -18446744073709551615; do
+    printf 'factorial.raw %s\n' "$LIMIT" > "$TMP/jobs"
+    ./batch "$TMP/jobs" > /dev/null 2> "$TMP/err"
+    [ $? -eq 2 ] && grep -q "Invalid job" "$TMP/err" \
+        || fail "step limit $LIMIT is not rejected"
+done
+
+exit $FAILED
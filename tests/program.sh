@@ -0,0 +1,14 @@
+# Helpers of the checks, sourced from the top directory
+
+# Writes the little-endian words given as arguments to a program file
+program () {
+    OUT=$1
+    shift
+    : > "$OUT"
+    for WORD in "$@"; do
+        printf "\\$(printf %03o $((WORD & 255)))" >> "$OUT"
+        printf "\\$(printf %03o $((WORD >> 8 & 255)))" >> "$OUT"
+        printf "\\$(printf %03o $((WORD >> 16 & 255)))" >> "$OUT"
+        printf "\\$(printf %03o $((WORD >> 24 & 255)))" >> "$OUT"
+    done
+}
@@ -0,0 +1,133 @@
+/*  stackvm-test.c - checks of the library of engines, see stackvm.h.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "stackvm.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s failed for %s\n", __FILE__, __LINE__, \
+                    #cond, engine_names[engine]); \
+            failures++; \
+        } \
+    } while (0)
+
+static const char *const engine_names[] = {
+    [Vm_Switched] = "switched",
+    [Vm_Predecoded] = "predecoded",
+    [Vm_ThreadedCached] = "threaded-cached",
+};
+
+static FILE *null_out;
+
+static vm_t* loaded_vm(vm_engine_t engine) {
+    vm_t *vm = vm_create(engine, STACK_CAPACITY);
+    if (vm == NULL || !vm_load(vm, DefProgram, PROGRAM_SIZE)) {
+        fprintf(stderr, "Cannot create a VM for %s\n", engine_names[engine]);
+        exit(2);
+    }
+    vm_set_output(vm, null_out);
+    return vm;
+}
+
+static bool same_cpu(const cpu_t *a, const cpu_t *b) {
+    return a->pc == b->pc && a->sp == b->sp && a->state == b->state
+        && a->steps == b->steps
+        && !memcmp(a->stack, b->stack, (a->sp + 1) * sizeof(uint32_t));
+}
+
+/* Running for zero steps does nothing, at the start and in between */
+static void check_zero_steps(vm_engine_t engine) {
+    vm_t *vm = loaded_vm(engine);
+    CHECK(vm_run(vm, 0) == Cpu_Running);
+    CHECK(vm_cpu(vm)->steps == 0 && vm_cpu(vm)->pc == 0);
+    CHECK(vm_run(vm, 100) == Cpu_Running);
+    CHECK(vm_cpu(vm)->steps == 100);
+    const uint32_t pc = vm_cpu(vm)->pc;
+    CHECK(vm_run(vm, 0) == Cpu_Running);
+    CHECK(vm_cpu(vm)->steps == 100 && vm_cpu(vm)->pc == pc);
+
+    vm_t *other = loaded_vm(engine);
+    vm_t *vms[] = {vm, other};
+    const uint64_t steps[] = {0, 10};
+    CHECK(vm_run_interleaved(vms, steps, 2) == 0);
+    CHECK(vm_cpu(vm)->steps == 100 && vm_cpu(other)->steps == 0);
+    vm_destroy(other);
+    vm_destroy(vm);
+}
+
+/* Running in slices ends where a single run does */
+static void check_slices(vm_engine_t engine) {
+    vm_t *whole = loaded_vm(engine);
+    vm_t *sliced = loaded_vm(engine);
+    vm_run(whole, 100000);
+    for (int i = 0; i < 1000; i++)
+        vm_run(sliced, 100);
+    CHECK(same_cpu(vm_cpu(whole), vm_cpu(sliced)));
+    vm_destroy(sliced);
+    vm_destroy(whole);
+}
+
+/* A reset VM runs again as a freshly loaded one does */
+static void check_reset(vm_engine_t engine) {
+    vm_t *fresh = loaded_vm(engine);
+    vm_t *reset = loaded_vm(engine);
+    vm_run(reset, 12345);
+    vm_reset(reset);
+    CHECK(vm_cpu(reset)->steps == 0 && vm_cpu(reset)->pc == 0
+          && vm_cpu(reset)->sp == -1);
+    vm_run(fresh, 100000);
+    vm_run(reset, 100000);
+    CHECK(same_cpu(vm_cpu(fresh), vm_cpu(reset)));
+    vm_destroy(reset);
+    vm_destroy(fresh);
+}
+
+int main(void) {
+    null_out = fopen("/dev/null", "w");
+    if (null_out == NULL) {
+        fprintf(stderr, "Cannot open /dev/null\n");
+        return 2;
+    }
+    for (unsigned engine = 0;
+         engine < sizeof(engine_names) / sizeof(engine_names[0]); engine++) {
+        check_zero_steps(engine);
+        check_slices(engine);
+        check_reset(engine);
+    }
+    fclose(null_out);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Checks that the variants counting steps by runs of instructions stop
+# where threaded-cached does, run from the top directory by "make check"
+
+set -u
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+FAILED=0
+
+fail () {
+    echo "steps-test: $1" >&2
+    FAILED=1
+}
+
+. tests/program.sh
+
+# Push 5; Dec; Dup; JNE -4; Halt
+program "$TMP/countdown.raw" 3 5 14 7 5 4294967292 2
+# Push 1; Push 2; Sub; Dup; Swap; Add; Jump -8
+program "$TMP/swap-loop.raw" 3 1 3 2 11 7 6 10 18 4294967288
+# Push 7; Push 5; Over; Mod; Print; Jump -6
+program "$TMP/print-loop.raw" 3 7 3 5 16 17 4 18 4294967290
+# Push 1; Push 0; Dup; Dup; Mod; Halt: stops inside a run
+program "$TMP/mod-zero.raw" 3 1 3 0 7 7 17 2
+
+for VARIANT in threaded-cached-blocks translated tiered; do
+    for PROG in "$TMP"/*.raw factorial.raw; do
+        for LIMIT in 1 2 3 4 5 6 7 8 9 10 100 1000 1001 100000; do
+            ./threaded-cached --inp-prog="$PROG" --steplimit=$LIMIT \
+                > "$TMP/expected"
+            ./$VARIANT --inp-prog="$PROG" --steplimit=$LIMIT > "$TMP/out"
+            cmp -s "$TMP/out" "$TMP/expected" \
+                || fail "$VARIANT differs on $(basename "$PROG") at $LIMIT steps"
+        done
+    done
+done
+
+exit $FAILED
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Checks that the variants caching the top of the stack behave as the
+# variants they are built from, run from the top directory by "make check"
+
+set -u
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+FAILED=0
+
+fail () {
+    echo "tos-test: $1" >&2
+    FAILED=1
+}
+
+. tests/program.sh
+
+# Pick of a negative position reads the slot just popped:
+# Push 5, Push 6, Push -1, Pick, Print, Print, Print, Halt
+program "$TMP/negative-pick.raw" 3 5 3 6 3 4294967295 26 4 4 4 2
+
+for VARIANT in switched threaded predecoded threaded-cached; do
+    for PROG in "$TMP"/*.raw factorial.raw; do
+        ./$VARIANT --inp-prog="$PROG" > "$TMP/expected"
+        ./$VARIANT-tos --inp-prog="$PROG" > "$TMP/out"
+        cmp -s "$TMP/out" "$TMP/expected" \
+            || fail "$VARIANT-tos differs from $VARIANT on $(basename "$PROG")"
+    done
+done
+
+exit $FAILED
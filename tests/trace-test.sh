@@ -0,0 +1,38 @@
+#!/bin/sh
+# Checks that the variants running host code for superinstructions and
+# traces stop where threaded-cached does, run from the top directory by
+# "make check"
+
+set -u
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+FAILED=0
+
+fail () {
+    echo "trace-test: $1" >&2
+    FAILED=1
+}
+
+. tests/program.sh
+
+# Loops with the fragments using scratch registers
+# Push 1; Push 2; Sub; Dup; Swap; Add; Jump -8
+program "$TMP/swap-loop.raw" 3 1 3 2 11 7 6 10 18 4294967288
+# Push 1; Push 2; Push 3; Rot; Jump -3
+program "$TMP/rot-loop.raw" 3 1 3 2 3 3 25 18 4294967293
+# Push 7; Push 5; Over; Mod; Drop; Jump -7
+program "$TMP/mod-loop.raw" 3 7 3 5 16 17 15 18 4294967289
+
+for VARIANT in threaded-cached-dynsuper threaded-cached-trace; do
+    for PROG in "$TMP"/*.raw; do
+        for LIMIT in 100 1000 1001 100000; do
+            ./threaded-cached --inp-prog="$PROG" --steplimit=$LIMIT \
+                > "$TMP/expected"
+            ./$VARIANT --inp-prog="$PROG" --steplimit=$LIMIT > "$TMP/out"
+            cmp -s "$TMP/out" "$TMP/expected" \
+                || fail "$VARIANT differs on $(basename "$PROG") at $LIMIT steps"
+        done
+    done
+done
+
+exit $FAILED
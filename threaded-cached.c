@@ -37,9 +37,25 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <math.h>
 
 #include "common.h"
+#include "stackcache.h"
+#ifdef STATIC_SUPER
+#include <string.h>
+#include "superinstructions.h"
+#endif
+#if defined(DYNAMIC_SUPER) || defined(TRACING)
+/* Host code of superinstructions and traces is glued in fragments.c */
+#include "fragments.h"
+#if defined(DYNAMIC_SUPER) && defined(TRACING)
+#error "Choose either dynamic superinstructions or tracing"
+#endif
+#if STACK_CACHE
+#error "Code fragments work with the stack in memory"
+#endif
+#endif
 
-static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
-    assert(addr < PROGRAM_SIZE);
+static inline decode_t decode_at_address(const Instr_t* prog, uint32_t size,
+                                         uint32_t addr, FILE *out) {
+    assert(addr < size);
     decode_t result = {0};
     Instr_t raw_instr = prog[addr];
     result.opcode = raw_instr;
@@ -72,8 +88,8 @@ static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
     case Instr_JNE:
     case Instr_JE:
     case Instr_Jump:
-        if (!(addr+1 < PROGRAM_SIZE)) {
-            printf("PC+1 out of bounds\n");
+        if (!(addr+1 < size)) {
+            fprintf(out, "PC+1 out of bounds\n");
             result.length = 1;
             result.opcode = Instr_Break;
             break;
@@ -93,20 +109,112 @@ static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
 /*** Service routines ***/
 #define BAIL_ON_ERROR() if (cpu.state != Cpu_Running) break;
 
+/* Running off the end of the program right at the step limit is not
+   an error */
 #define DISPATCH()\
-    if (!(cpu.pc < PROGRAM_SIZE)) {cpu.state = Cpu_Break; break;};\
+    if (!(cpu.pc < cpu.program_size)) { \
+        if (cpu.steps < steplimit) cpu.state = Cpu_Break; \
+        break; \
+    }; \
+    DECODE_LAZILY(); \
+    RECORD_TRACE(); \
     decoded = decoded_cache[cpu.pc]; \
     goto *decoded.sr;
 
+#if defined(STATIC_SUPER) || defined(DYNAMIC_SUPER) || defined(BLOCK_STEPS)
+/* These look at the whole program ahead of time, so that it is decoded
+   as a whole */
+#define DECODE_LAZILY()
+#else
+/* Entries of the decoded program have no service routine until
+   the instruction is decoded on its first execution */
+#define DECODE_LAZILY() \
+    if (!decoded_cache[cpu.pc].sr) \
+        decode_lazily(decoded_cache, handlers, \
+                      cpu.pmem, cpu.program_size, cpu.pc, cpu.out)
+#endif
+
+#ifdef TRACING
+/* Record instructions while a trace is being recorded */
+#define RECORD_TRACE() \
+    if (recorder.active) \
+        record_step(decoded_cache, cpu.pc, cpu.stack_capacity, &&sr_Trace)
+/* Count a taken backward branch, its target is the loop header.
+   Used after PC got the branch offset added */
+#define COUNT_LOOP() \
+    if (decoded.immediate + (int32_t)decoded.length <= 0) \
+        count_loop(cpu.pc + decoded.length, cpu.program_size)
+#else
+#define RECORD_TRACE()
+#define COUNT_LOOP()
+#endif
+
+#ifdef BLOCK_STEPS
+/* Steps are charged for a whole run of instructions up to the next branch
+   when it is entered, so that instructions inside a run only check
+   the state. A run that would cross the step limit is charged up to
+   the limit, and the instruction there is replaced with sr_StepLimit */
+#define REMAINING(pc) ((pc) < cpu.program_size ? run_length[pc] : 0)
+
+#define ADVANCE_PC() \
+    cpu.pc += decoded.length;\
+    if (cpu.state != Cpu_Running) break;
+
+/* The slow path is taken once at most, since the program stops after it */
+#define ENTER_RUN() \
+    if (cpu.pc < cpu.program_size \
+        && cpu.steps + run_length[cpu.pc] <= steplimit) { \
+        cpu.steps += run_length[cpu.pc]; \
+    } else { \
+        run_tail = REMAINING(cpu.pc); \
+        if (cpu.steps >= steplimit) break; \
+        if (!(cpu.pc < cpu.program_size)) {cpu.state = Cpu_Break; break;}; \
+        uint32_t stop = limit_run(decoded_cache, cpu.pc, \
+                                  steplimit - cpu.steps, &&sr_StepLimit); \
+        cpu.steps = steplimit; \
+        run_tail = run_length[stop]; \
+    }
+
+/* Halt and Break end a run, all of it has been executed */
+#define END_RUN() run_tail = REMAINING(cpu.pc + decoded.length)
+
+/* Uncharge instructions of the current run that were not executed */
+#define UNCHARGE_RUN() cpu.steps -= REMAINING(cpu.pc) - run_tail
+#else
 #define ADVANCE_PC() \
     cpu.pc += decoded.length;\
     cpu.steps++; \
     if (cpu.state != Cpu_Running || cpu.steps >= steplimit) break;
 
+#define ENTER_RUN()
+#define END_RUN()
+#define UNCHARGE_RUN()
+#endif
+
+/* Programs that pass verify_stack_depth() run with handlers that neither
+   check stack bounds nor test the state after the instruction. Only Halt,
+   Break, Mod and Pick share the checked handlers or stop the loop.
+   The variants with the stack cache or static superinstructions always
+   run the checked handlers */
+#if !STACK_CACHE && !defined(STATIC_SUPER)
+#define UNCHECKED_HANDLERS
+
+#define S(k) cpu.stack[cpu.sp + (k)]
+
+#ifdef BLOCK_STEPS
+#define ADVANCE_PC_UNCHECKED() cpu.pc += decoded.length;
+#else
+#define ADVANCE_PC_UNCHECKED() \
+    cpu.pc += decoded.length;\
+    cpu.steps++; \
+    if (cpu.steps >= steplimit) break;
+#endif
+#endif
+
 static inline void push(cpu_t *pcpu, uint32_t v) {
     assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
+    if (pcpu->sp >= pcpu->stack_capacity-1) {
+        fprintf(pcpu->out, "Stack overflow\n");
         pcpu->state = Cpu_Break;
         return;
     }
@@ -116,7 +224,7 @@ static inline void push(cpu_t *pcpu, uint32_t v) {
 static inline uint32_t pop(cpu_t *pcpu) {
     assert(pcpu);
     if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
+        fprintf(pcpu->out, "Stack underflow\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
@@ -126,7 +234,7 @@ static inline uint32_t pop(cpu_t *pcpu) {
 static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
     assert(pcpu);
     if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
+        fprintf(pcpu->out, "Out of bound picking\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
@@ -134,21 +242,155 @@ static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
 }
 
 static void predecode_program(const Instr_t *prog, const void* *in_sr,
-                           decode_t *dec, int len) {
+                           decode_t *dec, uint32_t len, FILE *out) {
     assert(prog);
     assert(in_sr);
     assert(dec);
-    /* The program is short, so we can decode it as a whole.
-       Otherwise, some sort of lazy decoding will be required */
-    for (int i=0; i < len; i++) {
-        decode_t decoded = decode_at_address(prog, i);
+    for (uint32_t i=0; i < len; i++) {
+        decode_t decoded = decode_at_address(prog, len, i, out);
         decoded.sr = in_sr[decoded.opcode];
         dec[i] = decoded;
     }
 }
 
+/* Takes the CPU fields by value: handing out the address of the CPU
+   would let the compiler assume that every store to the stack may
+   change the registers, and reload them in each service routine */
+static void decode_lazily(decode_t *dec, const void* *in_sr,
+                          const Instr_t *prog, uint32_t size, uint32_t pc,
+                          FILE *out) {
+    assert(dec);
+    assert(in_sr);
+    assert(prog);
+    decode_t decoded = decode_at_address(prog, size, pc, out);
+    decoded.sr = in_sr[decoded.opcode];
+    dec[pc] = decoded;
+}
 
-int main(int argc, char **argv) {
+#ifdef BLOCK_STEPS
+/*** Step accounting by runs of instructions ***/
+
+#if defined(STATIC_SUPER) || defined(DYNAMIC_SUPER) || defined(TRACING)
+#error "Superinstructions and traces count steps on their own"
+#endif
+
+static bool ends_run(Instr_t opcode) {
+    return opcode == Instr_JE || opcode == Instr_JNE || opcode == Instr_Jump
+           || opcode == Instr_Halt || opcode == Instr_Break;
+}
+
+/* Number of instructions from every PC up to and including the end of
+   its run: the next branch, Halt, Break or the end of the program */
+static void measure_runs(const decode_t *dec, uint32_t size,
+                         uint32_t *run_length) {
+    assert(dec);
+    assert(run_length);
+    for (int64_t pc = (int64_t)size - 1; pc >= 0; pc--) {
+        uint32_t next = pc + dec[pc].length;
+        run_length[pc] = 1;
+        if (!ends_run(dec[pc].opcode) && next < size)
+            run_length[pc] += run_length[next];
+    }
+}
+
+/* Make the program stop after count instructions of the run at pc.
+   Returns PC of the first instruction that will not be executed */
+static uint32_t limit_run(decode_t *dec, uint32_t pc, uint64_t count,
+                          const void *limit_sr) {
+    assert(dec);
+    for (uint64_t i = 0; i < count; i++)
+        pc += dec[pc].length;
+    dec[pc].sr = limit_sr;
+    return pc;
+}
+#endif
+
+#ifdef STATIC_SUPER
+/*** Static superinstructions ***/
+
+#if STACK_CACHE || defined(DYNAMIC_SUPER)
+#error "Superinstructions work with the stack in memory"
+#endif
+
+/* Replace decoded instructions that start a known sequence with
+   a superinstruction. The sequence may also be entered in the middle,
+   its other instructions stay decoded as usual */
+static void fuse_program(const decode_t *plain, const void* *in_sr,
+                         decode_t *dec, uint32_t size) {
+    assert(plain);
+    assert(in_sr);
+    assert(dec);
+    for (uint32_t pc = 0; pc < size; pc++) {
+        for (int i = 0; i < SUPER_COUNT; i++) {
+            uint32_t at = pc;
+            int32_t immediate = 0;
+            int j;
+            for (j = 0; j < SuperLengths[i]; j++) {
+                if (at >= size
+                    || plain[at].opcode != SuperComponents[i][j])
+                    break;
+                if (plain[at].length == 2)
+                    immediate = plain[at].immediate;
+                at += plain[at].length;
+            }
+            if (j < SuperLengths[i])
+                continue;
+            dec[pc].opcode = SUPER_OPCODE(i);
+            dec[pc].length = at - pc;
+            dec[pc].immediate = immediate;
+            dec[pc].sr = in_sr[SUPER_OPCODE(i)];
+            break;
+        }
+    }
+}
+
+/* Superinstruction bodies work on the stack in memory, see supergen.c */
+#define SUPER_S(pos) cpu.stack[cpu.sp + (pos)]
+#define SUPER_SP(change) cpu.sp += (change)
+#define SUPER_IMM ((uint32_t)decoded.immediate)
+#define SUPER_CAPACITY cpu.stack_capacity
+#define SUPER_BRANCH(taken) if (taken) cpu.pc += decoded.immediate
+/* Stop at Mod the same way as its service routine does */
+#define SUPER_DIVZERO(done, offset) { \
+    cpu.state = Cpu_Break; \
+    cpu.pc += (offset); \
+    cpu.steps += (done); \
+    break; \
+}
+
+#define SUPER_LABEL(i, length, lowest, highest, body) &&sr_Super##i,
+
+/* Run a superinstruction if none of its instructions can fail with stack
+   bounds or hit the step limit. Otherwise execute its first instruction */
+#define SUPER_HANDLER(i, length, lowest, highest, body) \
+    sr_Super##i: \
+        if (!((uint32_t)(cpu.sp - (lowest)) \
+                <= (uint32_t)((highest) - (lowest)) \
+              && cpu.steps + (length) <= steplimit)) { \
+            decoded = plain_cache[cpu.pc]; \
+            goto *decoded.sr; \
+        } \
+        body \
+        cpu.steps += (length) - 1; \
+        ADVANCE_PC(); \
+        DISPATCH();
+#endif /* STATIC_SUPER */
+
+
+/* The decoded program and what is known about it before it runs */
+typedef struct {
+    bool stack_verified; /* see verify_stack_depth() */
+    decode_t entries[];  /* program_size of them */
+} decoded_program_t;
+
+/* Runs the CPU until it stops or the total of executed instructions
+   reaches steplimit. The decoded program is fresh or left by an earlier
+   call for the same program */
+static void run_with_cache(cpu_t *pcpu, uint64_t steplimit,
+                           decoded_program_t *program) {
+    assert(pcpu);
+    assert(program);
+    decode_t *decoded_cache = program->entries;
 
     const void* service_routines[] = {
         &&sr_Break, &&sr_Nop, &&sr_Halt, &&sr_Push, &&sr_Print,
@@ -157,195 +399,592 @@ int main(int argc, char **argv) {
         &&sr_Drop, &&sr_Over, &&sr_Mod, &&sr_Jump,
         &&sr_And, &&sr_Or, &&sr_Xor,
         &&sr_SHL, &&sr_SHR,
-        &&sr_SQRT, &&sr_Rot, &&sr_Pick, NULL /* This NULL seems to be essential to keep GCC from over-optimizing? */
+        &&sr_SQRT, &&sr_Rot, &&sr_Pick,
+#ifdef STATIC_SUPER
+        SUPERINSTRUCTIONS(SUPER_LABEL)
+#endif
+        NULL /* This NULL seems to be essential to keep GCC from over-optimizing? */
     };
+#ifdef UNCHECKED_HANDLERS
+    const void* unchecked_routines[] = {
+        &&sr_Break, &&sr_Nop, &&sr_Halt, &&sr_UncheckedPush, &&sr_UncheckedPrint,
+        &&sr_UncheckedJne, &&sr_UncheckedSwap, &&sr_UncheckedDup, &&sr_UncheckedJe, &&sr_UncheckedInc,
+        &&sr_UncheckedAdd, &&sr_UncheckedSub, &&sr_UncheckedMul, &&sr_UncheckedRand, &&sr_UncheckedDec,
+        &&sr_UncheckedDrop, &&sr_UncheckedOver, &&sr_UncheckedMod, &&sr_Jump,
+        &&sr_UncheckedAnd, &&sr_UncheckedOr, &&sr_UncheckedXor,
+        &&sr_UncheckedSHL, &&sr_UncheckedSHR,
+        &&sr_UncheckedSQRT, &&sr_UncheckedRot, &&sr_Pick,
+        NULL
+    };
+    const void* *handlers = program->stack_verified ? unchecked_routines
+                                                    : service_routines;
+#else
+    const void* *handlers = service_routines;
+#endif
 
-    uint64_t steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
+    /* The loop below runs an instruction before it checks the limit */
+    if (pcpu->state != Cpu_Running || pcpu->steps >= steplimit)
+        return;
 
-    decode_t decoded_cache[PROGRAM_SIZE];
-    predecode_program(cpu.pmem, service_routines, decoded_cache, PROGRAM_SIZE);
+    cpu_t cpu = *pcpu;
+    stack_cache_t cache = {0};
+
+#if defined(STATIC_SUPER) || defined(DYNAMIC_SUPER) || defined(BLOCK_STEPS)
+    predecode_program(cpu.pmem, handlers, decoded_cache,
+                      cpu.program_size, cpu.out);
+#endif
+#ifdef DYNAMIC_SUPER
+    compile_supers(decoded_cache, cpu.program_size, cpu.stack_capacity,
+                   &&sr_Super);
+    const super_t *super = NULL;
+#endif
+#ifdef TRACING
+    traces = calloc(cpu.program_size, sizeof(trace_t));
+    if (!traces) {
+        fprintf(stderr, "Failed to allocate memory for traces.\n");
+        exit(2);
+    }
+    const trace_t *trace = NULL;
+#endif
+#ifdef STATIC_SUPER
+    decode_t *plain_cache = malloc(cpu.program_size * sizeof(decode_t));
+    if (!plain_cache) {
+        fprintf(stderr, "Failed to allocate memory for decoded program.\n");
+        exit(2);
+    }
+    memcpy(plain_cache, decoded_cache, cpu.program_size * sizeof(decode_t));
+    fuse_program(plain_cache, service_routines, decoded_cache,
+                 cpu.program_size);
+#endif
+#ifdef BLOCK_STEPS
+    uint32_t *run_length = malloc(cpu.program_size * sizeof(uint32_t));
+    if (!run_length) {
+        fprintf(stderr, "Failed to allocate memory for run lengths.\n");
+        exit(2);
+    }
+    measure_runs(decoded_cache, cpu.program_size, run_length);
+    uint64_t run_tail = 0; /* Charged steps of the run not to be executed */
+#endif
 
     uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
     decode_t decoded = {0};
     do {
+        ENTER_RUN();
         DISPATCH();
+#ifdef BLOCK_STEPS
+        sr_StepLimit:
+            /* The run was charged up to here */
+            break;
+#endif
+#ifdef DYNAMIC_SUPER
+        sr_Super:
+            /* Run the superinstruction if none of its instructions can hit
+               stack bounds or the step limit, otherwise go step by step */
+            super = &supers[cpu.pc];
+            if ((uint32_t)(cpu.sp - super->lo)
+                    <= (uint32_t)(super->hi - super->lo)
+                && cpu.steps + super->length <= steplimit) {
+                super->code(&cpu);
+                if (cpu.state != Cpu_Running || cpu.steps >= steplimit) break;
+                DISPATCH();
+            }
+            goto *super->sr;
+#endif
+#ifdef TRACING
+        sr_Trace:
+            /* Run the loop trace while its iterations cannot hit stack
+               bounds or the step limit, otherwise go step by step */
+            trace = &traces[cpu.pc];
+            if ((uint32_t)(cpu.sp - trace->lo)
+                    <= (uint32_t)(trace->hi - trace->lo)
+                && cpu.steps + trace->length <= steplimit) {
+                trace->code(&cpu, steplimit - trace->length);
+                if (cpu.state != Cpu_Running || cpu.steps >= steplimit) break;
+                DISPATCH();
+            }
+            goto *trace->sr;
+#endif
+#ifdef STATIC_SUPER
+        SUPERINSTRUCTIONS(SUPER_HANDLER)
+#endif
+#ifdef UNCHECKED_HANDLERS
+        sr_UncheckedPush:
+            cpu.stack[++cpu.sp] = decoded.immediate;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedPrint:
+            fprintf(cpu.out, "[%d]\n", cpu.stack[cpu.sp--]);
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedSwap:
+            tmp1 = S(0);
+            S(0) = S(-1);
+            S(-1) = tmp1;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedDup:
+            tmp1 = S(0);
+            cpu.stack[++cpu.sp] = tmp1;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedOver:
+            tmp1 = S(-1);
+            cpu.stack[++cpu.sp] = tmp1;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedInc:
+            S(0)++;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedDec:
+            S(0)--;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedAdd:
+            S(-1) = S(0) + S(-1);
+            cpu.sp--;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedSub:
+            S(-1) = S(0) - S(-1);
+            cpu.sp--;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedMul:
+            S(-1) = S(0) * S(-1);
+            cpu.sp--;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedMod:
+            if (S(-1) == 0) {
+                cpu.sp -= 2;
+                cpu.state = Cpu_Break;
+                break;
+            }
+            S(-1) = S(0) % S(-1);
+            cpu.sp--;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedRand:
+            tmp1 = rand();
+            cpu.stack[++cpu.sp] = tmp1;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedDrop:
+            cpu.sp--;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedJe:
+            if (cpu.stack[cpu.sp--] == 0) {
+                cpu.pc += decoded.immediate;
+                COUNT_LOOP();
+            }
+            ADVANCE_PC_UNCHECKED();
+            ENTER_RUN();
+            DISPATCH();
+        sr_UncheckedJne:
+            if (cpu.stack[cpu.sp--] != 0) {
+                cpu.pc += decoded.immediate;
+                COUNT_LOOP();
+            }
+            ADVANCE_PC_UNCHECKED();
+            ENTER_RUN();
+            DISPATCH();
+        sr_UncheckedAnd:
+            S(-1) = S(0) & S(-1);
+            cpu.sp--;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedOr:
+            S(-1) = S(0) | S(-1);
+            cpu.sp--;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedXor:
+            S(-1) = S(0) ^ S(-1);
+            cpu.sp--;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedSHL:
+            S(-1) = S(0) << S(-1);
+            cpu.sp--;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedSHR:
+            S(-1) = S(0) >> S(-1);
+            cpu.sp--;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedRot:
+            tmp1 = S(0);
+            S(0) = S(-1);
+            S(-1) = S(-2);
+            S(-2) = tmp1;
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+        sr_UncheckedSQRT:
+            S(0) = sqrt(S(0));
+            ADVANCE_PC_UNCHECKED();
+            DISPATCH();
+#endif
         sr_Nop:
             /* Do nothing */
             ADVANCE_PC();
             DISPATCH();
         sr_Halt:
             cpu.state = Cpu_Halted;
+            END_RUN();
             ADVANCE_PC();
             /* No need to dispatch after Halt */
         sr_Push:
-            push(&cpu, decoded.immediate);
+            if (CACHED(0, 1)) {
+                PUSH_CACHED(decoded.immediate);
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            PUSH(decoded.immediate);
             ADVANCE_PC();
             DISPATCH();
         sr_Print:
-            tmp1 = pop(&cpu); BAIL_ON_ERROR();
-            printf("[%d]\n", tmp1);
+            tmp1 = POP(); BAIL_ON_ERROR();
+            fprintf(cpu.out, "[%d]\n", tmp1);
             ADVANCE_PC();
             DISPATCH();
         sr_Swap:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                tmp1 = TOP();
+                SET_TOP(SECOND());
+                SET_SECOND(tmp1);
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
+            PUSH(tmp1);
+            PUSH(tmp2);
             ADVANCE_PC();
             DISPATCH();
         sr_Dup:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 1)) {
+                PUSH_CACHED(TOP());
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp1);
+            PUSH(tmp1);
+            PUSH(tmp1);
             ADVANCE_PC();
             DISPATCH();
         sr_Over:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 1)) {
+                PUSH_CACHED(SECOND());
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp2);
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
+            PUSH(tmp2);
+            PUSH(tmp1);
+            PUSH(tmp2);
             ADVANCE_PC();
             DISPATCH();
         sr_Inc:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                SET_TOP(TOP() + 1);
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1+1);
+            PUSH(tmp1+1);
             ADVANCE_PC();
             DISPATCH();
         sr_Add:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() + SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 + tmp2);
+            PUSH(tmp1 + tmp2);
             ADVANCE_PC();
             DISPATCH();
         sr_Sub:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() - SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 - tmp2);
+            PUSH(tmp1 - tmp2);
             ADVANCE_PC();
             DISPATCH();
         sr_Mod:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0) && SECOND() != 0) {
+                SET_TOP(TOP() % SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
             if (tmp2 == 0) {
                 cpu.state = Cpu_Break;
                 break;
             }
-            push(&cpu, tmp1 % tmp2);
+            PUSH(tmp1 % tmp2);
             ADVANCE_PC();
             DISPATCH();
         sr_Mul:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() * SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 * tmp2);
+            PUSH(tmp1 * tmp2);
             ADVANCE_PC();
             DISPATCH();
         sr_Rand:
             tmp1 = rand();
-            push(&cpu, tmp1);
+            PUSH(tmp1);
             ADVANCE_PC();
             DISPATCH();
         sr_Dec:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                SET_TOP(TOP() - 1);
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1-1);
+            PUSH(tmp1-1);
             ADVANCE_PC();
             DISPATCH();
         sr_Drop:
-            (void)pop(&cpu);
+            if (CACHED(1, 0)) {
+                DROP_CACHED();
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            (void)POP();
             ADVANCE_PC();
             DISPATCH();
         sr_Je:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                tmp1 = TOP();
+                DROP_CACHED();
+                if (tmp1 == 0) {
+                    cpu.pc += decoded.immediate;
+                    COUNT_LOOP();
+                }
+                ADVANCE_PC();
+                ENTER_RUN();
+                DISPATCH();
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            if (tmp1 == 0)
+            if (tmp1 == 0) {
                 cpu.pc += decoded.immediate;
+                COUNT_LOOP();
+            }
             ADVANCE_PC();
+            ENTER_RUN();
             DISPATCH();
         sr_Jne:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                tmp1 = TOP();
+                DROP_CACHED();
+                if (tmp1 != 0) {
+                    cpu.pc += decoded.immediate;
+                    COUNT_LOOP();
+                }
+                ADVANCE_PC();
+                ENTER_RUN();
+                DISPATCH();
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            if (tmp1 != 0)
+            if (tmp1 != 0) {
                 cpu.pc += decoded.immediate;
+                COUNT_LOOP();
+            }
             ADVANCE_PC();
+            ENTER_RUN();
             DISPATCH();
         sr_Jump:
             cpu.pc += decoded.immediate;
+            COUNT_LOOP();
             ADVANCE_PC();
+            ENTER_RUN();
             DISPATCH();
         sr_And:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() & SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 & tmp2);
+            PUSH(tmp1 & tmp2);
             ADVANCE_PC();
             DISPATCH();
         sr_Or:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() | SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 | tmp2);
+            PUSH(tmp1 | tmp2);
             ADVANCE_PC();
             DISPATCH();
         sr_Xor:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() ^ SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 ^ tmp2);
+            PUSH(tmp1 ^ tmp2);
             ADVANCE_PC();
             DISPATCH();
         sr_SHL:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() << SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 << tmp2);
+            PUSH(tmp1 << tmp2);
             ADVANCE_PC();
             DISPATCH();
         sr_SHR:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() >> SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 >> tmp2);
+            PUSH(tmp1 >> tmp2);
             ADVANCE_PC();
             DISPATCH();
         sr_Rot:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            tmp3 = pop(&cpu);
+            tmp1 = POP();
+            tmp2 = POP();
+            tmp3 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp3);
-            push(&cpu, tmp2);
+            PUSH(tmp1);
+            PUSH(tmp3);
+            PUSH(tmp2);
             ADVANCE_PC();
             DISPATCH();
         sr_SQRT:
-            tmp1 = pop(&cpu);
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, sqrt(tmp1));
+            PUSH(sqrt(tmp1));
             ADVANCE_PC();
             DISPATCH();
         sr_Pick:
-            tmp1 = pop(&cpu);
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, pick(&cpu, tmp1));
+            PUSH(PICK(tmp1));
             ADVANCE_PC();
             DISPATCH();
         sr_Break:
             cpu.state = Cpu_Break;
+            END_RUN();
             ADVANCE_PC();
             /* No need to dispatch after Break */
     } while(cpu.state == Cpu_Running);
+    UNCHARGE_RUN();
 
     assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
+    FLUSH_STACK_CACHE();
+
+#ifdef BLOCK_STEPS
+    free(run_length);
+#endif
+#ifdef STATIC_SUPER
+    free(plain_cache);
+#endif
+#ifdef TRACING
+    free(traces);
+#endif
+#ifdef DYNAMIC_SUPER
+    free(supers);
+#endif
+    *pcpu = cpu;
+}
+
+/* Returns zeroed room for the decoded program of the CPU. A CPU resumed
+   from an earlier call got there from PC 0 too, so the stack depth is
+   verified for the program as a whole */
+static decoded_program_t* alloc_decoded(const cpu_t *pcpu) {
+    decoded_program_t *program = calloc(1, sizeof(decoded_program_t)
+                                       + pcpu->program_size * sizeof(decode_t));
+    if (!program) {
+        fprintf(stderr, "Failed to allocate memory for decoded program.\n");
+        exit(2);
+    }
+#ifdef UNCHECKED_HANDLERS
+    program->stack_verified = verify_stack_depth(pcpu->pmem, pcpu->program_size,
+                                                 pcpu->stack_capacity);
+#endif
+    return program;
+}
+
+#ifdef STACKVM_LIBRARY
+#ifdef TRACING
+#error "Traces patched into the decoded program live for one call only"
+#endif
+/* The library keeps the decoded program of a VM from call to call.
+   *decoded is NULL before the first call for a program, the caller frees
+   it when the program changes */
+void run_threaded_cached_reusing(cpu_t *pcpu, uint64_t steplimit, void **decoded) {
+    if (!*decoded)
+        *decoded = alloc_decoded(pcpu);
+    run_with_cache(pcpu, steplimit, *decoded);
+}
+#else
+void run_threaded_cached(cpu_t *pcpu, uint64_t steplimit) {
+    decoded_program_t *program = alloc_decoded(pcpu);
+    run_with_cache(pcpu, steplimit, program);
+    free(program);
+}
+
+int main(int argc, char **argv) {
+    uint64_t steplimit = parse_args(argc, argv);
+    cpu_t cpu = init_cpu();
+    run_threaded_cached(&cpu, steplimit);
+
     /* Print CPU state */
     printf("CPU executed %ld steps. End state \"%s\".\n",
             cpu.steps, cpu.state == Cpu_Halted? "Halted":
@@ -357,9 +996,11 @@ int main(int argc, char **argv) {
     }
     printf("%s\n", cpu.sp == -1? "(empty)": "");
 
-    free(LoadedProgram);
+    free(cpu.stack);
+    unload_program();
 
     return cpu.state == Cpu_Halted ||
            (cpu.state == Cpu_Running &&
             cpu.steps == steplimit)?0:1;
 }
+#endif
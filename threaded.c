@@ -36,15 +36,16 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <math.h>
 
 #include "common.h"
+#include "stackcache.h"
 
 static inline Instr_t fetch(const cpu_t *pcpu) {
     assert(pcpu);
-    assert(pcpu->pc < PROGRAM_SIZE);
+    assert(pcpu->pc < pcpu->program_size);
     return pcpu->pmem[pcpu->pc];
 };
 
 static inline Instr_t fetch_checked(cpu_t *pcpu) {
-    if (!(pcpu->pc < PROGRAM_SIZE)) {
+    if (!(pcpu->pc < pcpu->program_size)) {
         printf("PC out of bounds\n");
         pcpu->state = Cpu_Break;
         return Instr_Break;
@@ -86,7 +87,7 @@ static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
     case Instr_JE:
     case Instr_Jump:
         result.length = 2;
-        if (!(pcpu->pc+1 < PROGRAM_SIZE)) {
+        if (!(pcpu->pc+1 < pcpu->program_size)) {
             printf("PC+1 out of bounds\n");
             result.length = 1;
             result.opcode = Instr_Break;
@@ -129,7 +130,7 @@ __asm__ __volatile__("nopl 0x55667788(%%rax)":::"memory");
 
 static inline void push(cpu_t *pcpu, uint32_t v) {
     assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
+    if (pcpu->sp >= pcpu->stack_capacity-1) {
         printf("Stack overflow\n");
         pcpu->state = Cpu_Break;
         return;
@@ -172,6 +173,7 @@ int main(int argc, char **argv) {
 
     uint64_t steplimit = parse_args(argc, argv);
     cpu_t cpu = init_cpu();
+    stack_cache_t cache = {0};
 
     uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
     decode_t decoded = fetch_decode(&cpu);
@@ -188,106 +190,187 @@ int main(int argc, char **argv) {
             ADVANCE_PC();
             /* No need to dispatch after Halt */
         sr_Push:
-            push(&cpu, decoded.immediate);
+            if (CACHED(0, 1)) {
+                PUSH_CACHED(decoded.immediate);
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            PUSH(decoded.immediate);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Print:
-            tmp1 = pop(&cpu); BAIL_ON_ERROR();
+            tmp1 = POP(); BAIL_ON_ERROR();
             printf("[%d]\n", tmp1);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Swap:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                tmp1 = TOP();
+                SET_TOP(SECOND());
+                SET_SECOND(tmp1);
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
+            PUSH(tmp1);
+            PUSH(tmp2);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Dup:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 1)) {
+                PUSH_CACHED(TOP());
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp1);
+            PUSH(tmp1);
+            PUSH(tmp1);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Over:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 1)) {
+                PUSH_CACHED(SECOND());
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp2);
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
+            PUSH(tmp2);
+            PUSH(tmp1);
+            PUSH(tmp2);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Inc:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                SET_TOP(TOP() + 1);
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1+1);
+            PUSH(tmp1+1);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Add:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() + SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 + tmp2);
+            PUSH(tmp1 + tmp2);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Sub:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() - SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 - tmp2);
+            PUSH(tmp1 - tmp2);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Mod:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0) && SECOND() != 0) {
+                SET_TOP(TOP() % SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
             if (tmp2 == 0) {
                 cpu.state = Cpu_Break;
                 break;
             }
-            push(&cpu, tmp1 % tmp2);
+            PUSH(tmp1 % tmp2);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Mul:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() * SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 * tmp2);
+            PUSH(tmp1 * tmp2);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Rand:
             tmp1 = rand();
-            push(&cpu, tmp1);
+            PUSH(tmp1);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Dec:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                SET_TOP(TOP() - 1);
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1-1);
+            PUSH(tmp1-1);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Drop:
-            (void)pop(&cpu);
+            if (CACHED(1, 0)) {
+                DROP_CACHED();
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            (void)POP();
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Je:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                tmp1 = TOP();
+                DROP_CACHED();
+                if (tmp1 == 0)
+                    cpu.pc += decoded.immediate;
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
             if (tmp1 == 0)
                 cpu.pc += decoded.immediate;
@@ -295,7 +378,16 @@ int main(int argc, char **argv) {
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Jne:
-            tmp1 = pop(&cpu);
+            if (CACHED(1, 0)) {
+                tmp1 = TOP();
+                DROP_CACHED();
+                if (tmp1 != 0)
+                    cpu.pc += decoded.immediate;
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
             BAIL_ON_ERROR();
             if (tmp1 != 0)
                 cpu.pc += decoded.immediate;
@@ -308,67 +400,102 @@ int main(int argc, char **argv) {
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_And:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() & SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 & tmp2);
+            PUSH(tmp1 & tmp2);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Or:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() | SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 | tmp2);
+            PUSH(tmp1 | tmp2);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Xor:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() ^ SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 ^ tmp2);
+            PUSH(tmp1 ^ tmp2);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_SHL:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() << SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 << tmp2);
+            PUSH(tmp1 << tmp2);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_SHR:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            if (CACHED(2, 0)) {
+                SET_TOP(TOP() >> SECOND());
+                NIP_CACHED();
+                ADVANCE_PC();
+                decoded = fetch_decode(&cpu);
+                DISPATCH();
+            }
+            tmp1 = POP();
+            tmp2 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 >> tmp2);
+            PUSH(tmp1 >> tmp2);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Rot:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            tmp3 = pop(&cpu);
+            tmp1 = POP();
+            tmp2 = POP();
+            tmp3 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp3);
-            push(&cpu, tmp2);
+            PUSH(tmp1);
+            PUSH(tmp3);
+            PUSH(tmp2);
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_SQRT:
-            tmp1 = pop(&cpu);
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, sqrt(tmp1));
+            PUSH(sqrt(tmp1));
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
         sr_Pick:
-            tmp1 = pop(&cpu);
+            tmp1 = POP();
             BAIL_ON_ERROR();
-            push(&cpu, pick(&cpu, tmp1));
+            PUSH(PICK(tmp1));
             ADVANCE_PC();
             decoded = fetch_decode(&cpu);
             DISPATCH();
@@ -379,6 +506,7 @@ int main(int argc, char **argv) {
     } while(cpu.state == Cpu_Running);
 
     assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
+    FLUSH_STACK_CACHE();
     /* Print CPU state */
     printf("CPU executed %ld steps. End state \"%s\".\n",
             cpu.steps, cpu.state == Cpu_Halted? "Halted":
@@ -390,7 +518,8 @@ int main(int argc, char **argv) {
     }
     printf("%s\n", cpu.sp == -1? "(empty)": "");
 
-    free(LoadedProgram);
+    free(cpu.stack);
+    unload_program();
 
     return cpu.state == Cpu_Halted ||
            (cpu.state == Cpu_Running &&
@@ -33,6 +33,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #error Sorry.
 #endif
 
+#define _GNU_SOURCE /* for memfd_create() */
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -41,9 +43,18 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <errno.h>
 #include <limits.h>
 #include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <setjmp.h>
 #include <math.h>
+#ifdef BACKGROUND_COMPILE
+#include <pthread.h>
+#include <semaphore.h>
+#endif
 
 #include "common.h"
 
@@ -54,18 +65,113 @@ static jmp_buf return_buf;
    Uses GNU extension to statically occupy host R15 register. */
 register cpu_t * pcpu asm("r15");
 
-/* Area for generated code. It is put into the .text section to be reachable
-   from the rest of the code (relative branch to fit in 32 bits) */
-/* For explanation of '#' character,
-   see https://gcc.gnu.org/ml/gcc-help/2010-09/msg00088.html */
-char gen_code[JIT_CODE_SIZE] __attribute__ ((section (".text#")))
-                             __attribute__ ((aligned(4096)));
+/* Area for generated code. Address space for it is reserved at once and
+   backed with memory chunk by chunk as translations accumulate.
+   Where the host allows it, the memory is mapped twice: writable for
+   the translator and executable for running it, so that no page is ever
+   writable and executable at the same time. */
+typedef struct {
+    char *rx;         /* executable view, addresses in generated code refer to it */
+    char *rw;         /* writable view of the same memory */
+    size_t committed; /* bytes backed with memory */
+    size_t used;      /* bytes handed out for generated code */
+    int fd;           /* memory shared by the views, -1 if there is one view */
+} arena_t;
+
+static arena_t arena;
+
+_Static_assert(JIT_ARENA_SIZE <= INT32_MAX,
+               "Relative branches must reach across the whole arena");
+_Static_assert(JIT_CODE_SIZE % 4096 == 0, "Chunks must be whole pages");
+
+/* Far calls from generated code go through trampolines placed at the arena
+   start, so that C functions are reachable with CALL rel32 wherever
+   the arena lands. Each one is "jmp [rip+0]" followed by an address. */
+#define TRAMPOLINE_SIZE 16
+#define TRAMPOLINES_AREA_SIZE 4096
+
+/* A map of guest PCs to translated code, filled on demand.
+   Entries are published atomically after the code they point to
+   is complete, so that it can be filled from another thread */
+static void* *entrypoints;
+/* Words in the guest program and entries in its stack, set before any
+   translation happens. Unlike pcpu, they are seen by the compiler thread */
+static uint32_t program_size;
+static int32_t stack_capacity;
+/* Set when verify_stack_depth() proved that the program stays within
+   the stack, so that translations have no stack checks */
+static bool stack_verified;
+
+static inline void* entrypoint(uint32_t pc) {
+    return __atomic_load_n(&entrypoints[pc], __ATOMIC_ACQUIRE);
+}
 
-/* TODO:a global - not good. Should be moved into cpu state or somewhere else */
-static uint64_t steplimit = LLONG_MAX;
+#ifdef TIER_UP_THRESHOLD
+/* Tiered execution: code starts running in an interpreter and only blocks
+   reached often enough by branches are translated.
+   Counts how many times a branch went to each guest PC */
+static uint32_t *heat;
+
+/* Count one more branch to pc, returns true once pc is worth translating */
+static bool warm_up(uint32_t pc) {
+    assert(pc < program_size);
+    if (heat[pc] < TIER_UP_THRESHOLD)
+        heat[pc]++;
+    return heat[pc] >= TIER_UP_THRESHOLD;
+}
+#endif
 
-static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
-    assert(addr < PROGRAM_SIZE);
+#ifdef BACKGROUND_COMPILE
+#ifndef TIER_UP_THRESHOLD
+#error "Background compilation is only done for tiered execution"
+#endif
+/* Hot blocks are translated by a separate compiler thread while
+   the interpreter goes on. The executing thread passes guest PCs to it
+   through a single producer single consumer ring */
+#define COMPILE_QUEUE_SIZE 64
+static uint32_t compile_queue[COMPILE_QUEUE_SIZE];
+static uint32_t queue_head; /* advanced by the compiler thread */
+static uint32_t queue_tail; /* advanced by the executing thread */
+static sem_t queue_items;   /* lets the compiler thread sleep while idle */
+
+/* PCs already passed to the compiler, used by the executing thread only */
+static bool *requested;
+
+/* Held by the compiler thread while it translates. The executing thread
+   takes it to flush translations and to patch branches, as both change
+   the arena */
+static pthread_mutex_t translator_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Set by the compiler thread when the translation cache is full */
+static bool flush_requested;
+static bool compiler_quit;
+static pthread_t compiler;
+
+/* Ask to translate code at pc. If the queue is full,
+   the request is dropped and repeated on the next branch to pc */
+static void request_translation(uint32_t pc) {
+    if (requested[pc])
+        return;
+    uint32_t tail = queue_tail;
+    if (tail - __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE)
+        == COMPILE_QUEUE_SIZE)
+        return;
+    compile_queue[tail % COMPILE_QUEUE_SIZE] = pc;
+    __atomic_store_n(&queue_tail, tail + 1, __ATOMIC_RELEASE);
+    requested[pc] = true;
+    sem_post(&queue_items);
+}
+
+static bool flush_pending() {
+    return __atomic_load_n(&flush_requested, __ATOMIC_ACQUIRE);
+}
+#endif
+
+/* The guest data stack, addressed from generated code through host R13 */
+register uint32_t * stack_base asm("r13");
+
+static inline decode_t decode_at_address(const Instr_t* prog, uint32_t size,
+                                         uint32_t addr) {
+    assert(addr < size);
     decode_t result = {0};
     Instr_t raw_instr = prog[addr];
     result.opcode = raw_instr;
@@ -99,7 +205,13 @@ static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
     case Instr_JE:
     case Instr_Jump:
         result.length = 2;
-        assert(addr+1 < PROGRAM_SIZE);
+        if (!(addr+1 < size)) {
+            /* Translation is lazy, so this is only reached if
+               the truncated instruction is about to be executed */
+            result.length = 1;
+            result.opcode = Instr_Break;
+            break;
+        }
         result.immediate = (int32_t)prog[addr+1];
         break;
     case Instr_Break:
@@ -111,6 +223,62 @@ static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
     return result;
 }
 
+static char* reserve_address_space(size_t size) {
+    void *area = mmap(NULL, size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED) {
+        perror("mmap");
+        exit(2);
+    }
+    return area;
+}
+
+static void init_arena() {
+    arena.rx = reserve_address_space(JIT_ARENA_SIZE);
+    arena.rw = arena.rx;
+    arena.committed = 0;
+    arena.used = 0;
+    arena.fd = -1;
+#ifdef MFD_CLOEXEC
+    arena.fd = memfd_create("translated", MFD_CLOEXEC);
+#endif
+    if (arena.fd >= 0)
+        arena.rw = reserve_address_space(JIT_ARENA_SIZE);
+}
+
+/* Back the first size bytes of the arena with memory */
+static void commit_arena(size_t size) {
+    assert(size <= JIT_ARENA_SIZE);
+    assert(size > arena.committed);
+    size_t offset = arena.committed;
+    size_t length = size - offset;
+    if (arena.fd < 0) {
+        /* No separate views, have to make the memory writable and executable */
+        if (mprotect(arena.rx + offset, length,
+                     PROT_READ | PROT_WRITE | PROT_EXEC)) {
+            perror("mprotect");
+            exit(2);
+        }
+    } else if (ftruncate(arena.fd, size)
+               || mmap(arena.rx + offset, length, PROT_READ | PROT_EXEC,
+                       MAP_SHARED | MAP_FIXED, arena.fd, offset) == MAP_FAILED
+               || mmap(arena.rw + offset, length, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_FIXED, arena.fd, offset) == MAP_FAILED) {
+        perror("mmap");
+        exit(2);
+    }
+    /* Pre-populate code memory with INT3 (machine code 0xCC).
+       This will help to catch jumps to wrong locations */
+    memset(arena.rw + offset, 0xcc, length);
+    arena.committed = size;
+}
+
+/* Returns the writable alias of executable code address */
+static char* writable(char *code) {
+    assert(code >= arena.rx && code < arena.rx + arena.committed);
+    return arena.rw + (code - arena.rx);
+}
+
 static void enter_generated_code(void* addr) {
     __asm__ __volatile__ ( "jmp *%0"::"r"(addr):);
 }
@@ -124,13 +292,13 @@ static void exit_generated_code() {
 #define ADVANCE_PC(length) do {\
     pcpu->pc += length;\
     pcpu->steps++; \
-    if (pcpu->state != Cpu_Running || pcpu->steps >= steplimit) \
+    if (pcpu->state != Cpu_Running || pcpu->steps >= pcpu->steplimit) \
         exit_generated_code(); \
 } while(0);
 
 static inline void push(cpu_t *pcpu, uint32_t v) {
     assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
+    if (pcpu->sp >= pcpu->stack_capacity-1) {
         printf("Stack overflow\n");
         pcpu->state = Cpu_Break;
         exit_generated_code();
@@ -361,89 +529,988 @@ const service_routine_t service_routines[] = {
         &sr_Pick
     };
 
-static void translate_program(const Instr_t *prog,
-                           char *out_code, void **entrypoints, int len) {
-    assert(prog);
-    assert(out_code);
-    assert(entrypoints);
+#define SERVICE_ROUTINES_COUNT \
+    (sizeof(service_routines) / sizeof(service_routines[0]))
+
+/* Trampolines to functions called from generated code */
+static char *sr_trampolines[SERVICE_ROUTINES_COUNT];
+static char *link_trampoline;
+
+/*** Code generation ***/
+
+/* Generated code addresses the simulated CPU, the step limit included,
+   relative to R15 (pcpu) and its stack relative to R13 (stack_base).
+   These registers are callee-saved, so they survive calls to service
+   routines. */
+#define PC_OFF    offsetof(cpu_t, pc)
+#define SP_OFF    offsetof(cpu_t, sp)
+#define STEPS_OFF offsetof(cpu_t, steps)
+#define LIMIT_OFF offsetof(cpu_t, steplimit)
+/* SIB byte of [r13 + index*4], index is RAX or R8 after REX.X */
+#define STACK_SIB 0x85
+/* Displacement of stack[sp+d] when host RAX holds the guest SP */
+#define SLOT(d)   (4 * (d))
+
+_Static_assert(STEPS_OFF < 128 && LIMIT_OFF < 128
+               && SLOT(-2) >= -128 && SLOT(2) < 128,
+               "CPU fields and stack slots must be reachable with disp8");
+
+/* Host instruction encodings used in templates below */
+#define MOVSXD_RAX_SP     0x49, 0x63, 0x47, SP_OFF         /* movsxd rax, [r15+sp] */
+#define INC_SP            0x41, 0xff, 0x47, SP_OFF         /* inc dword [r15+sp] */
+#define DEC_SP            0x41, 0xff, 0x4f, SP_OFF         /* dec dword [r15+sp] */
+#define MOV_ECX_SLOT(d)   0x41, 0x8b, 0x4c, STACK_SIB, SLOT(d)  /* mov ecx, stack[sp+d] */
+#define MOV_EDX_SLOT(d)   0x41, 0x8b, 0x54, STACK_SIB, SLOT(d)  /* mov edx, stack[sp+d] */
+#define MOV_ESI_SLOT(d)   0x41, 0x8b, 0x74, STACK_SIB, SLOT(d)  /* mov esi, stack[sp+d] */
+#define MOV_SLOT_ECX(d)   0x41, 0x89, 0x4c, STACK_SIB, SLOT(d)  /* mov stack[sp+d], ecx */
+#define MOV_SLOT_EDX(d)   0x41, 0x89, 0x54, STACK_SIB, SLOT(d)  /* mov stack[sp+d], edx */
+#define MOV_SLOT_ESI(d)   0x41, 0x89, 0x74, STACK_SIB, SLOT(d)  /* mov stack[sp+d], esi */
+#define ALU_ECX_SLOT(op, d) 0x41, op, 0x4c, STACK_SIB, SLOT(d)  /* <op> ecx, stack[sp+d] */
+#define INC_SLOT(d)       0x41, 0xff, 0x44, STACK_SIB, SLOT(d)  /* inc dword stack[sp+d] */
+#define DEC_SLOT(d)       0x41, 0xff, 0x4c, STACK_SIB, SLOT(d)  /* dec dword stack[sp+d] */
+#define TEST_ECX_ECX      0x85, 0xc9                       /* test ecx, ecx */
+#define JCC_REL32(cc)     0x0f, cc, 0x00, 0x00, 0x00, 0x00 /* j<cc> .+0 */
+#define JMP_REL32         0xe9, 0x00, 0x00, 0x00, 0x00     /* jmp .+0 */
+#define CALL_REL32        0xe8, 0x00, 0x00, 0x00, 0x00     /* call .+0 */
+#define JMP_RIP_INDIRECT  0xff, 0x25, 0x00, 0x00, 0x00, 0x00 /* jmp [rip+0] */
+#define MOV_PC_IMM32      0x41, 0xc7, 0x47, PC_OFF, 0x00, 0x00, 0x00, 0x00
+                                                   /* mov dword [r15+pc], imm32 */
+#define MOV_RAX_STEPS     0x49, 0x8b, 0x47, STEPS_OFF      /* mov rax, [r15+steps] */
+#define MOV_STEPS_RAX     0x49, 0x89, 0x47, STEPS_OFF      /* mov [r15+steps], rax */
+#define ADD_RAX_IMM32     0x48, 0x05, 0x00, 0x00, 0x00, 0x00 /* add rax, imm32 */
+#define CMP_RAX_LIMIT     0x49, 0x3b, 0x47, LIMIT_OFF      /* cmp rax, [r15+steplimit] */
+#define SUB_STEPS_IMM32   0x49, 0x81, 0x6f, STEPS_OFF, 0x00, 0x00, 0x00, 0x00
+                                                   /* sub qword [r15+steps], imm32 */
+
+#define CC_JZ  0x84
+#define CC_JNZ 0x85
+#define CC_JA  0x87
+#define CC_JAE 0x83
+
+#define ALU_ADD 0x03
+#define ALU_SUB 0x2b
+#define ALU_AND 0x23
+#define ALU_OR  0x0b
+#define ALU_XOR 0x33
+
+/* Host code is emitted into a single buffer. Straight-line code for
+   consecutive guest instructions grows up from the start of the buffer,
+   rarely taken paths (slow paths, exits) grow down from its end.
+   This way hot code has no jumps over cold code. */
+typedef struct {
+    char *hot;  /* first free byte of the straight-line code */
+    char *cold; /* first used byte of the out-of-line code */
+} emitter_t;
+
+/* Translation cache state */
+static emitter_t emitter;
+/* Set when code is added to the cache, so that an unchanged persistent
+   cache is not rewritten */
+static bool translations_changed;
+
+/* Upper bounds of host code for one guest instruction
+   and for a jump ending a block, both hot and cold parts included */
+#define MAX_INSTR_CODE_SIZE 160
+#define MAX_BLOCK_END_CODE_SIZE 40
+/* Blocks are limited to keep individual translations short */
+#define MAX_BLOCK_LENGTH 64
+
+/* Steps are counted by runs of instructions translated inline: a run
+   ends after a branch and before an instruction left to a service
+   routine, which counts its step itself. Entering a run charges steps
+   for all of its instructions at once. A run that would reach the step
+   limit goes instead through its fallback: capsules of the same
+   instructions, one after another, so that the service routines stop
+   exactly at the limit. Only the first instruction of a run is an
+   entrypoint. */
+typedef struct {
+    char *charge;    /* hot code charging the steps, NULL if no run is open */
+    int length;
+    decode_t decoded[MAX_BLOCK_LENGTH];
+    uint32_t pcs[MAX_BLOCK_LENGTH];
+    /* Slow paths of the instructions, NULL for those without one */
+    char *slow_paths[MAX_BLOCK_LENGTH];
+} inline_run_t;
+
+static char* reserve(emitter_t *e, int size, bool hot) {
+    /* Callers make sure there is space for a whole instruction */
+    assert(e->cold - e->hot >= size);
+    char *where = hot ? e->hot : e->cold - size;
+    if (hot)
+        e->hot += size;
+    else
+        e->cold -= size;
+    return where;
+}
 
+static char* emit(emitter_t *e, bool hot, const char *code, int size) {
+    char *where = reserve(e, size, hot);
+    memcpy(writable(where), code, size);
+    return where;
+}
+
+#define EMIT_HOT(e, ...) do { \
+    const char code[] = {__VA_ARGS__}; \
+    emit(e, true, code, sizeof(code)); \
+} while (0)
+
+/* Patch a rel32 field that ends an instruction to point to target */
+static void patch_rel32(char *field, const void *target) {
+    intptr_t offset = (intptr_t)target - (intptr_t)(field + 4);
+    if (offset != (intptr_t)(int32_t)offset) {
+        fprintf(stderr, "Offset to %p does not fit in 32 bits."
+                " Cannot generate code for it, sorry\n", target);
+        exit(2);
+    }
+    int32_t offset32 = (int32_t)offset;
+    memcpy(writable(field), &offset32, 4);
+}
+
+static void patch_imm32(char *field, uint32_t value) {
+    memcpy(writable(field), &value, 4);
+}
+
+/* A capsule stores guest PC and invokes a service routine */
+#define CAPSULE_SIZE 20
+
+/* Write a capsule at an already reserved location */
+static void write_capsule(char *capsule, decode_t decoded, uint32_t pc) {
     /* An IA-32 instruction "MOV RDI, imm32" is used to pass a parameter
        to a function invoked by a following CALL. */
 #ifdef __CYGWIN__ /* Win64 ABI, use RCX instead of RDI */
-    const char mov_template_code[]= {0x48, 0xc7, 0xc1, 0x00, 0x00, 0x00, 0x00};
+    const char capsule_code[] = {MOV_PC_IMM32,
+                                 0x48, 0xc7, 0xc1, 0x00, 0x00, 0x00, 0x00,
+                                 CALL_REL32};
+#else
+    const char capsule_code[] = {MOV_PC_IMM32,
+                                 0x48, 0xc7, 0xc7, 0x00, 0x00, 0x00, 0x00,
+                                 CALL_REL32};
+#endif
+    _Static_assert(sizeof(capsule_code) == CAPSULE_SIZE, "Capsule size");
+    memcpy(writable(capsule), capsule_code, sizeof(capsule_code));
+    patch_imm32(capsule + 4, pc);
+    patch_imm32(capsule + 11, decoded.immediate);
+    patch_rel32(capsule + 16, sr_trampolines[decoded.opcode]);
+}
+
+/* Emit a capsule. Returns the capsule address. */
+static char* emit_capsule(emitter_t *e, bool hot, decode_t decoded,
+                          uint32_t pc) {
+    char *capsule = reserve(e, CAPSULE_SIZE, hot);
+    write_capsule(capsule, decoded, pc);
+    return capsule;
+}
+
+static void* translate_block(const Instr_t *prog, uint32_t pc);
+
+/* Called from generated code when a branch is taken for the first time.
+   Translates the target if needed and patches the branch to go directly
+   to it. Returns the address to continue execution at. */
+static void* link_branch(char *site) {
+    uint32_t target = pcpu->pc;
+    if (target >= program_size)
+        exit_generated_code(); /* Let the main loop deal with it */
+    void *entry = entrypoint(target);
+#ifdef TIER_UP_THRESHOLD
+    if (!entry && !warm_up(target))
+        exit_generated_code(); /* Cold code is left to the interpreter */
+#endif
+#ifdef BACKGROUND_COMPILE
+    if (!entry) {
+        /* Interpret the target until the compiler is done with it */
+        request_translation(target);
+        exit_generated_code();
+    }
+    if (pthread_mutex_trylock(&translator_lock))
+        return entry; /* Do not wait for the compiler, link next time */
+    patch_rel32(site, entry);
+    pthread_mutex_unlock(&translator_lock);
+    return entry;
+#endif
+    if (!entry)
+        entry = translate_block(pcpu->pmem, target);
+    if (!entry) {
+        /* The cache is full. It cannot be flushed while the code
+           that called us is still running, leave it first */
+        exit_generated_code();
+    }
+    patch_rel32(site, entry);
+    return entry;
+}
+
+/* Emit an out-of-line stub for a branch to a not yet linked target.
+   The branch jumping to the stub gets patched with the target address.
+   Returns the stub address. */
+static char* emit_link_stub(emitter_t *e, char *site, uint32_t target_pc) {
+#ifdef __CYGWIN__ /* Win64 ABI, use RCX instead of RDI */
+    const char link_code[] = {MOV_PC_IMM32,
+                              0x48, 0x8d, 0x0d, 0x00, 0x00, 0x00, 0x00,
+                              CALL_REL32,
+                              0xff, 0xe0}; /* jmp rax */
 #else
-    const char mov_template_code[]= {0x48, 0xc7, 0xc7, 0x00, 0x00, 0x00, 0x00};
+    const char link_code[] = {MOV_PC_IMM32,
+                              0x48, 0x8d, 0x3d, 0x00, 0x00, 0x00, 0x00,
+                              CALL_REL32,
+                              0xff, 0xe0}; /* jmp rax */
 #endif
-    const int mov_template_size = sizeof(mov_template_code);
-
-    /* An IA-32 instruction "CALL rel32" is used as a trampoline to invoke
-       service routines. A template for it is "call .+0x00000005" */
-    const char call_template_code[] = { 0xe8, 0x00, 0x00, 0x00, 0x00 };
-    const int call_template_size = sizeof(call_template_code);
-
-    int i = 0; /* Address of current guest instruction */
-    char* cur = out_code; /* Where to put new code */
-
-    /* The program is short, so we can translate it as a whole.
-       Otherwise, some sort of lazy decoding will be required */
-    while (i < len) {
-        decode_t decoded = decode_at_address(prog, i);
-        entrypoints[i] = (void*) cur;
-
-        if (decoded.length == 2) { /* Guest instruction has an immediate */
-            assert(cur + mov_template_size - out_code < JIT_CODE_SIZE);
-            memcpy(cur, mov_template_code, mov_template_size);
-            /* Patch template with correct immediate value */
-            memcpy(cur + 3, &decoded.immediate, 4);
-            cur += mov_template_size;
+    char *stub = emit(e, false, link_code, sizeof(link_code));
+    patch_imm32(stub + 4, target_pc);
+    patch_rel32(stub + 11, site); /* lea rdi, [rip + site] */
+    patch_rel32(stub + 16, link_trampoline);
+    return stub;
+}
+
+/* Emit a host check that guest stack has sp in [lo, hi].
+   Leaves the guest SP in host RAX for the code that follows.
+   Returns a location of rel32 jump to the slow path. */
+static char* emit_stack_check(emitter_t *e, int lo, int hi) {
+    EMIT_HOT(e, MOVSXD_RAX_SP);
+    if (lo == 0) {
+        const char cmp_code[] = {0x3d, 0x00, 0x00, 0x00, 0x00}; /* cmp eax, imm32 */
+        char *cmp = emit(e, true, cmp_code, sizeof(cmp_code));
+        patch_imm32(cmp + 1, hi);
+    } else {
+        /* lea ecx, [rax - lo]; cmp ecx, imm32 */
+        const char cmp_code[] = {0x8d, 0x48, (char)-lo,
+                                 0x81, 0xf9, 0x00, 0x00, 0x00, 0x00};
+        char *cmp = emit(e, true, cmp_code, sizeof(cmp_code));
+        patch_imm32(cmp + 5, hi - lo);
+    }
+    const char ja_code[] = {JCC_REL32(CC_JA)};
+    return emit(e, true, ja_code, sizeof(ja_code)) + 2;
+}
+
+/* Find the stack depth needed by an instruction and its maximal growth.
+   Returns false for operations that are rare or need libc; they are
+   delegated to service routines. */
+static bool inline_stack_effect(Instr_t opcode, int *needs, int *grows) {
+    *needs = *grows = 0;
+    switch (opcode) {
+    case Instr_Nop: case Instr_Jump:
+        return true;
+    case Instr_Push:
+        *grows = 1; return true;
+    case Instr_Dup:
+        *needs = 1; *grows = 1; return true;
+    case Instr_Over:
+        *needs = 2; *grows = 1; return true;
+    case Instr_Inc: case Instr_Dec: case Instr_Drop:
+    case Instr_JE: case Instr_JNE:
+        *needs = 1; return true;
+    case Instr_Swap: case Instr_Add: case Instr_Sub: case Instr_Mul:
+    case Instr_Mod: case Instr_And: case Instr_Or: case Instr_Xor:
+    case Instr_SHL: case Instr_SHR:
+        *needs = 2; return true;
+    case Instr_Rot:
+        *needs = 3; return true;
+    default: /* Print, Rand, SQRT, Pick, Halt, Break */
+        return false;
+    }
+}
+
+static bool ends_run(Instr_t opcode) {
+    return opcode == Instr_JE || opcode == Instr_JNE || opcode == Instr_Jump;
+}
+
+/* Start a run with hot code charging steps for all its instructions,
+   the count is patched in when the run ends */
+static void open_run(emitter_t *e, inline_run_t *run) {
+    const char charge_code[] = {MOV_RAX_STEPS, ADD_RAX_IMM32, CMP_RAX_LIMIT,
+                                JCC_REL32(CC_JAE), MOV_STEPS_RAX};
+    run->charge = emit(e, true, charge_code, sizeof(charge_code));
+    run->length = 0;
+}
+
+/* Emit the fallback of a run and patch its charge and slow paths.
+   The fallback continues with the code following the run. */
+static void close_run(emitter_t *e, inline_run_t *run) {
+    if (!run->charge)
+        return;
+    const int length = run->length;
+    char *fallback = reserve(e, length * CAPSULE_SIZE + 5, false);
+    for (int i = 0; i < length; i++)
+        write_capsule(fallback + i * CAPSULE_SIZE, run->decoded[i],
+                      run->pcs[i]);
+    const char jmp_code[] = {JMP_REL32};
+    char *jmp = fallback + length * CAPSULE_SIZE;
+    memcpy(writable(jmp), jmp_code, sizeof(jmp_code));
+    patch_rel32(jmp + 1, e->hot);
+
+    patch_imm32(run->charge + 6, length);
+    patch_rel32(run->charge + 16, fallback);
+    for (int i = 0; i < length; i++) {
+        if (!run->slow_paths[i])
+            continue;
+        /* Steps of this instruction and the following ones were charged
+           but not executed */
+        patch_imm32(run->slow_paths[i] + 4, length - i);
+        patch_rel32(run->slow_paths[i] + 9, fallback + i * CAPSULE_SIZE);
+    }
+    run->charge = NULL;
+}
+
+/* Translate a guest instruction into host code placed inline and add it
+   to the open run. Fast paths assume that pcpu->pc is not maintained
+   between guest instructions; it is written only on the way out of
+   generated code. */
+static void translate_instruction(emitter_t *e, inline_run_t *run,
+                                  decode_t decoded, uint32_t pc) {
+    const uint32_t next_pc = pc + decoded.length;
+    const uint32_t target_pc = next_pc + decoded.immediate;
+    int needs, grows;
+    const bool inlined = inline_stack_effect(decoded.opcode, &needs, &grows);
+    assert(inlined && run->charge);
+    (void)inlined;
+    const int index = run->length++;
+    run->decoded[index] = decoded;
+    run->pcs[index] = pc;
+    run->slow_paths[index] = NULL;
+
+    /* Jumps to the slow path of this instruction */
+    char *slow_jumps[2] = {NULL, NULL};
+    if ((needs || grows) && stack_verified)
+        EMIT_HOT(e, MOVSXD_RAX_SP); /* The code below addresses the stack by it */
+    else if (needs || grows)
+        slow_jumps[0] = emit_stack_check(e, needs - 1,
+                                         stack_capacity - 1 - grows);
+
+    switch (decoded.opcode) {
+    case Instr_Nop:
+        break;
+    case Instr_Push: {
+        /* mov dword stack[sp+1], imm32 */
+        const char push_code[] = {0x41, 0xc7, 0x44, STACK_SIB, SLOT(1),
+                                  0x00, 0x00, 0x00, 0x00, INC_SP};
+        char *code = emit(e, true, push_code, sizeof(push_code));
+        patch_imm32(code + 5, decoded.immediate);
+        break;
+    }
+    case Instr_Dup:
+        EMIT_HOT(e, MOV_ECX_SLOT(0), MOV_SLOT_ECX(1), INC_SP);
+        break;
+    case Instr_Over:
+        EMIT_HOT(e, MOV_ECX_SLOT(-1), MOV_SLOT_ECX(1), INC_SP);
+        break;
+    case Instr_Swap:
+        EMIT_HOT(e, MOV_ECX_SLOT(0), MOV_EDX_SLOT(-1),
+                    MOV_SLOT_EDX(0), MOV_SLOT_ECX(-1));
+        break;
+    case Instr_Rot:
+        EMIT_HOT(e, MOV_ECX_SLOT(0), MOV_EDX_SLOT(-1), MOV_ESI_SLOT(-2),
+                    MOV_SLOT_ECX(-2), MOV_SLOT_ESI(-1), MOV_SLOT_EDX(0));
+        break;
+    case Instr_Inc:
+        EMIT_HOT(e, INC_SLOT(0));
+        break;
+    case Instr_Dec:
+        EMIT_HOT(e, DEC_SLOT(0));
+        break;
+    case Instr_Drop:
+        EMIT_HOT(e, DEC_SP);
+        break;
+    case Instr_Add:
+        EMIT_HOT(e, MOV_ECX_SLOT(0), ALU_ECX_SLOT(ALU_ADD, -1),
+                    MOV_SLOT_ECX(-1), DEC_SP);
+        break;
+    case Instr_Sub:
+        EMIT_HOT(e, MOV_ECX_SLOT(0), ALU_ECX_SLOT(ALU_SUB, -1),
+                    MOV_SLOT_ECX(-1), DEC_SP);
+        break;
+    case Instr_And:
+        EMIT_HOT(e, MOV_ECX_SLOT(0), ALU_ECX_SLOT(ALU_AND, -1),
+                    MOV_SLOT_ECX(-1), DEC_SP);
+        break;
+    case Instr_Or:
+        EMIT_HOT(e, MOV_ECX_SLOT(0), ALU_ECX_SLOT(ALU_OR, -1),
+                    MOV_SLOT_ECX(-1), DEC_SP);
+        break;
+    case Instr_Xor:
+        EMIT_HOT(e, MOV_ECX_SLOT(0), ALU_ECX_SLOT(ALU_XOR, -1),
+                    MOV_SLOT_ECX(-1), DEC_SP);
+        break;
+    case Instr_Mul:
+        /* imul ecx, stack[sp-1] */
+        EMIT_HOT(e, MOV_ECX_SLOT(0), 0x41, 0x0f, 0xaf, 0x4c, STACK_SIB, SLOT(-1),
+                    MOV_SLOT_ECX(-1), DEC_SP);
+        break;
+    case Instr_SHL:
+        /* shl edx, cl */
+        EMIT_HOT(e, MOV_ECX_SLOT(-1), MOV_EDX_SLOT(0), 0xd3, 0xe2,
+                    MOV_SLOT_EDX(-1), DEC_SP);
+        break;
+    case Instr_SHR:
+        /* shr edx, cl */
+        EMIT_HOT(e, MOV_ECX_SLOT(-1), MOV_EDX_SLOT(0), 0xd3, 0xea,
+                    MOV_SLOT_EDX(-1), DEC_SP);
+        break;
+    case Instr_Mod: {
+        /* Division by zero is handled by the slow path */
+        const char mod_code[] = {MOV_ECX_SLOT(-1), TEST_ECX_ECX,
+                                 JCC_REL32(CC_JZ),
+                                 0x49, 0x89, 0xc0,             /* mov r8, rax */
+                                 0x41, 0x8b, 0x44, STACK_SIB, SLOT(0), /* mov eax, stack[sp] */
+                                 0x31, 0xd2,                   /* xor edx, edx */
+                                 0xf7, 0xf1,                   /* div ecx */
+                                 0x43, 0x89, 0x54, STACK_SIB, SLOT(-1), /* mov [r13+r8*4+..], edx */
+                                 DEC_SP};
+        char *code = emit(e, true, mod_code, sizeof(mod_code));
+        slow_jumps[1] = code + 9;
+        break;
+    }
+    case Instr_JE:
+    case Instr_JNE: {
+        /* A taken branch jumps directly to its target */
+        const char jcc_code[] = {MOV_ECX_SLOT(0), DEC_SP, TEST_ECX_ECX,
+            JCC_REL32(decoded.opcode == Instr_JE ? CC_JZ: CC_JNZ)};
+        char *code = emit(e, true, jcc_code, sizeof(jcc_code));
+        char *taken_jump = code + sizeof(jcc_code) - 4;
+        patch_rel32(taken_jump, emit_link_stub(e, taken_jump, target_pc));
+        break;
+    }
+    case Instr_Jump: {
+        const char jump_code[] = {JMP_REL32};
+        char *jump = emit(e, true, jump_code, sizeof(jump_code)) + 1;
+        patch_rel32(jump, emit_link_stub(e, jump, target_pc));
+        return;
+    }
+    default:
+        assert("Unreachable" && false);
+        break;
+    }
+
+    if (slow_jumps[0] || slow_jumps[1]) {
+        /* The slow path takes back the steps charged for the rest of
+           the run and continues in its fallback, where the service
+           routine reports the error. Both are patched when the run ends */
+        const char slow_code[] = {SUB_STEPS_IMM32, JMP_REL32};
+        char *slow = emit(e, false, slow_code, sizeof(slow_code));
+        run->slow_paths[index] = slow;
+        for (int i = 0; i < 2; i++)
+            if (slow_jumps[i])
+                patch_rel32(slow_jumps[i], slow);
+    }
+}
+
+/* Give the emitter a fresh chunk of the arena.
+   Returns false if the arena is exhausted */
+static bool grow_translations() {
+    if (arena.used + JIT_CODE_SIZE > JIT_ARENA_SIZE)
+        return false;
+    if (arena.used + JIT_CODE_SIZE > arena.committed)
+        commit_arena(arena.used + JIT_CODE_SIZE);
+    emitter.hot = arena.rx + arena.used;
+    arena.used += JIT_CODE_SIZE;
+    emitter.cold = arena.rx + arena.used;
+    return true;
+}
+
+static bool ends_block(Instr_t opcode) {
+    return opcode == Instr_Jump || opcode == Instr_Halt
+           || opcode == Instr_Break;
+}
+
+/* Translate a sequence of guest instructions starting at pc.
+   The block runs through conditional branches and ends at an instruction
+   that never falls through, or when it gets too long.
+   The first instructions of runs and those left to service routines
+   serve as entrypoints.
+   Returns NULL if there is no space left in the translation cache. */
+static void* translate_block(const Instr_t *prog, uint32_t pc) {
+    assert(prog);
+    assert(pc < program_size);
+    emitter_t *e = &emitter;
+    if (e->cold - e->hot < MAX_INSTR_CODE_SIZE + MAX_BLOCK_END_CODE_SIZE
+        && !grow_translations())
+        return NULL;
+
+    void *entry = e->hot;
+    /* Entrypoints of the block instructions, published when it is done */
+    uint32_t instr_pcs[MAX_BLOCK_LENGTH];
+    void *instr_code[MAX_BLOCK_LENGTH];
+    int entries = 0;
+    inline_run_t run;
+    run.charge = NULL;
+    for (int length = 0; ; length++) {
+        /* Fallbacks of the open run are emitted when it ends */
+        const int pending = run.charge ? run.length * CAPSULE_SIZE : 0;
+        if (pc >= program_size || length == MAX_BLOCK_LENGTH
+            || e->cold - e->hot - pending < MAX_INSTR_CODE_SIZE
+                                            + MAX_BLOCK_END_CODE_SIZE) {
+            /* Continue with the next block; it is linked on demand */
+            close_run(e, &run);
+            const char jmp_code[] = {JMP_REL32};
+            char *jmp = emit(e, true, jmp_code, sizeof(jmp_code));
+            patch_rel32(jmp + 1, emit_link_stub(e, jmp + 1, pc));
+            break;
         }
+        if (entrypoints[pc]) {
+            /* Got to already translated code, glue to it */
+            close_run(e, &run);
+            const char jmp_code[] = {JMP_REL32};
+            char *jmp = emit(e, true, jmp_code, sizeof(jmp_code));
+            patch_rel32(jmp + 1, entrypoints[pc]);
+            break;
+        }
+        decode_t decoded = decode_at_address(prog, program_size, pc);
+        int needs, grows;
+        if (inline_stack_effect(decoded.opcode, &needs, &grows)) {
+            if (!run.charge) {
+                instr_pcs[entries] = pc;
+                instr_code[entries++] = e->hot;
+                open_run(e, &run);
+            }
+            translate_instruction(e, &run, decoded, pc);
+            if (ends_run(decoded.opcode))
+                close_run(e, &run);
+        } else {
+            /* Service routine advances PC and checks for the end itself */
+            close_run(e, &run);
+            instr_pcs[entries] = pc;
+            instr_code[entries++] = e->hot;
+            emit_capsule(e, true, decoded, pc);
+        }
+        pc += decoded.length;
+        if (ends_block(decoded.opcode))
+            break;
+    }
+    for (int i = 0; i < entries; i++)
+        __atomic_store_n(&entrypoints[instr_pcs[i]], instr_code[i],
+                         __ATOMIC_RELEASE);
+    translations_changed = true;
+    return entry;
+}
 
-        assert(cur + call_template_size - out_code < JIT_CODE_SIZE);
-        memcpy(cur, call_template_code, call_template_size);
-        intptr_t offset = (intptr_t)service_routines[decoded.opcode]
-                            - (intptr_t)cur - call_template_size;
-        if (offset != (intptr_t)(int32_t)offset) {
-            fprintf(stderr, "Offset to service routine for opcode %d"
-            " does not fit in 32 bits. Cannot generate code for it, sorry",
-            decoded.opcode);
-            exit(2);
+/* Throw away all translations to make space for new ones */
+static void flush_translations() {
+    memset(entrypoints, 0, program_size * sizeof(void*));
+    memset(arena.rw + TRAMPOLINES_AREA_SIZE, 0xcc,
+           arena.committed - TRAMPOLINES_AREA_SIZE);
+    arena.used = TRAMPOLINES_AREA_SIZE;
+    /* The next translation will start a new chunk */
+    emitter.hot = emitter.cold = arena.rx + arena.used;
+}
+
+static char* emit_trampoline(char *where, const void *target) {
+    const char trampoline_code[] = {JMP_RIP_INDIRECT};
+    memcpy(writable(where), trampoline_code, sizeof(trampoline_code));
+    memcpy(writable(where + sizeof(trampoline_code)), &target, sizeof(target));
+    return where;
+}
+
+static void init_trampolines() {
+    _Static_assert((SERVICE_ROUTINES_COUNT + 1) * TRAMPOLINE_SIZE
+                   <= TRAMPOLINES_AREA_SIZE, "Trampolines must fit");
+    commit_arena(TRAMPOLINES_AREA_SIZE);
+    char *where = arena.rx;
+    for (unsigned i = 0; i < SERVICE_ROUTINES_COUNT; i++) {
+        sr_trampolines[i] = emit_trampoline(where, service_routines[i]);
+        where += TRAMPOLINE_SIZE;
+    }
+    link_trampoline = emit_trampoline(where, &link_branch);
+}
+
+/*** Persistent translation cache ***/
+
+/* With --cache-dir, the translations are saved to a file on exit and
+   restored on the next run of the same program, so that it starts with
+   translated code. Generated code refers to the rest of the arena with
+   relative offsets and to C functions through the trampolines only,
+   so it stays valid wherever the arena lands once the trampolines are
+   rebuilt. The file is tied to the contents of the executable that
+   wrote it, as service routines and the layout of cpu_t may differ
+   between builds, and carries a checksum of the code it holds. */
+#if defined(BACKGROUND_COMPILE)
+#define ENGINE_NAME "tiered-async"
+#elif defined(TIER_UP_THRESHOLD)
+#define ENGINE_NAME "tiered"
+#else
+#define ENGINE_NAME "translated"
+#endif
+
+typedef struct {
+    char engine[16];         /* ENGINE_NAME of the writer */
+    uint64_t build_hash;     /* of the writer executable, see build_hash() */
+    uint64_t program_hash;   /* of program memory, see hash_program() */
+    uint64_t checksum;       /* of the records and the code that follow */
+    uint32_t program_size;
+    int32_t stack_capacity;  /* stack checks are compiled in */
+    uint32_t entries_count;  /* cached_entry_t records following the header */
+    uint32_t used;           /* arena bytes handed out, trampolines included */
+    uint32_t hot;            /* emitter position as arena offsets */
+    uint32_t cold;
+} cache_header_t;
+
+typedef struct {
+    uint32_t pc;
+    uint32_t offset; /* of the entrypoint in the arena */
+} cached_entry_t;
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+/* FNV-1a over the words of program memory */
+static uint64_t hash_program(const Instr_t *prog, uint32_t size) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (uint32_t i = 0; i < size; i++) {
+        hash ^= prog[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* FNV-1a over bytes, continuing from hash */
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Hash of the running executable, so that rebuilding the same sources
+   keeps saved translations and any change to the code drops them.
+   Zero if the executable cannot be read */
+static uint64_t build_hash(void) {
+    static uint64_t hash = 0;
+    if (hash)
+        return hash;
+    int fd = open("/proc/self/exe", O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+        return 0;
+    if (!fstat(fd, &st) && st.st_size > 0) {
+        void *exe = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (exe != MAP_FAILED) {
+            hash = hash_bytes(FNV_OFFSET_BASIS, exe, st.st_size);
+            munmap(exe, st.st_size);
         }
-        uint32_t offset32 = (uint32_t)offset;
-        /* Patch template with correct offset */
-        memcpy(cur + 1, &offset, 4);
-        i += decoded.length;
-        cur += call_template_size;
     }
+    close(fd);
+    return hash;
+}
+
+static cache_header_t cache_header(const Instr_t *prog) {
+    _Static_assert(sizeof(ENGINE_NAME) <= sizeof(((cache_header_t*)0)->engine),
+                   "Engine name must fit");
+    cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    strcpy(header.engine, ENGINE_NAME);
+    header.build_hash = build_hash();
+    header.program_hash = hash_program(prog, program_size);
+    header.program_size = program_size;
+    header.stack_capacity = stack_capacity;
+    return header;
 }
 
+/* Returns a malloc'ed path of the cache file for the program */
+static char* cache_path(const cache_header_t *header) {
+    const char *format = "%s/" ENGINE_NAME "-%016" PRIx64 "-%d.cache";
+    int length = snprintf(NULL, 0, format, CacheDir, header->program_hash,
+                          header->stack_capacity);
+    char *path = malloc(length + 1);
+    if (path)
+        snprintf(path, length + 1, format, CacheDir, header->program_hash,
+                 header->stack_capacity);
+    return path;
+}
+
+/* Checks the file contents against the running program and copies them
+   into the arena. Returns false if they do not fit */
+static bool restore_translations(const char *file, size_t file_size,
+                                 const cache_header_t *expected) {
+    const cache_header_t *header = (const cache_header_t*)file;
+    if (file_size < sizeof(*header)
+        || strncmp(header->engine, expected->engine, sizeof(header->engine))
+        || header->build_hash != expected->build_hash
+        || header->program_hash != expected->program_hash
+        || header->program_size != expected->program_size
+        || header->stack_capacity != expected->stack_capacity)
+        return false;
+    /* Chunks of the arena are handed out whole */
+    if (header->used < TRAMPOLINES_AREA_SIZE || header->used > JIT_ARENA_SIZE
+        || (header->used - TRAMPOLINES_AREA_SIZE) % JIT_CODE_SIZE
+        || header->hot > header->cold || header->cold > header->used
+        || header->hot < (header->used > TRAMPOLINES_AREA_SIZE
+                          ? header->used - JIT_CODE_SIZE : header->used))
+        return false;
+    const size_t entries_size = header->entries_count * sizeof(cached_entry_t);
+    const size_t code_size = header->used - TRAMPOLINES_AREA_SIZE;
+    if (file_size != sizeof(*header) + entries_size + code_size
+        || hash_bytes(FNV_OFFSET_BASIS, file + sizeof(*header),
+                      entries_size + code_size) != header->checksum)
+        return false;
+    const cached_entry_t *entries =
+        (const cached_entry_t*)(file + sizeof(*header));
+    for (uint32_t i = 0; i < header->entries_count; i++)
+        if (entries[i].pc >= program_size
+            || entries[i].offset < TRAMPOLINES_AREA_SIZE
+            || entries[i].offset >= header->used)
+            return false;
+
+    if (header->used > arena.committed)
+        commit_arena(header->used);
+    memcpy(arena.rw + TRAMPOLINES_AREA_SIZE, file + sizeof(*header)
+                                             + entries_size, code_size);
+    for (uint32_t i = 0; i < header->entries_count; i++)
+        entrypoints[entries[i].pc] = arena.rx + entries[i].offset;
+    arena.used = header->used;
+    emitter.hot = arena.rx + header->hot;
+    emitter.cold = arena.rx + header->cold;
+    return true;
+}
+
+/* Called on an empty arena before any code runs */
+static void load_translations(const Instr_t *prog) {
+    const cache_header_t expected = cache_header(prog);
+    if (!expected.build_hash)
+        return;
+    char *path = cache_path(&expected);
+    int fd = path ? open(path, O_RDONLY) : -1;
+    free(path);
+    if (fd < 0)
+        return; /* Nothing saved yet */
+    struct stat st;
+    if (!fstat(fd, &st) && st.st_size > 0) {
+        char *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file != MAP_FAILED) {
+            if (!restore_translations(file, st.st_size, &expected))
+                flush_translations(); /* Stale, overwritten on exit */
+            munmap(file, st.st_size);
+        }
+    }
+    close(fd);
+}
+
+/* Writes the file under a temporary name and renames it in place,
+   so that concurrent runs of the program see either file whole */
+static void save_translations(const Instr_t *prog) {
+    if (!translations_changed)
+        return;
+    cache_header_t header = cache_header(prog);
+    if (!header.build_hash)
+        return;
+    char *path = cache_path(&header);
+    if (!path)
+        return;
+    char *temp_path = malloc(strlen(path) + 16);
+    if (!temp_path) {
+        free(path);
+        return;
+    }
+    sprintf(temp_path, "%s.%d", path, (int)getpid());
+
+    header.used = arena.used;
+    header.hot = emitter.hot - arena.rx;
+    header.cold = emitter.cold - arena.rx;
+    const size_t code_size = arena.used - TRAMPOLINES_AREA_SIZE;
+    header.checksum = FNV_OFFSET_BASIS;
+    for (uint32_t pc = 0; pc < program_size; pc++) {
+        if (!entrypoints[pc])
+            continue;
+        cached_entry_t entry = {pc, (char*)entrypoints[pc] - arena.rx};
+        header.checksum = hash_bytes(header.checksum, &entry, sizeof(entry));
+        header.entries_count++;
+    }
+    header.checksum = hash_bytes(header.checksum,
+                                 arena.rw + TRAMPOLINES_AREA_SIZE, code_size);
+    FILE *f = fopen(temp_path, "wb");
+    bool saved = f && fwrite(&header, sizeof(header), 1, f) == 1;
+    for (uint32_t pc = 0; saved && pc < program_size; pc++) {
+        if (!entrypoints[pc])
+            continue;
+        cached_entry_t entry = {pc, (char*)entrypoints[pc] - arena.rx};
+        saved = fwrite(&entry, sizeof(entry), 1, f) == 1;
+    }
+    saved = saved && fwrite(arena.rw + TRAMPOLINES_AREA_SIZE, 1, code_size, f)
+                     == code_size;
+    if (f)
+        saved = !fclose(f) && saved;
+    if (!saved || rename(temp_path, path)) {
+        fprintf(stderr, "Cannot save translations to %s\n", path);
+        unlink(temp_path);
+    }
+    free(temp_path);
+    free(path);
+}
+
+#ifdef TIER_UP_THRESHOLD
+/*** Interpreter for cold code ***/
+
+/* Instructions are decoded on their first execution,
+   entries of zero length are not decoded yet */
+static decode_t *decoded_cache;
+
+/* Execute instructions in the interpreter until a branch goes to
+   a translated or a hot block. State of the guest is kept in pcpu only,
+   so the main loop can continue with translated code at any instruction.
+   Service routines serve as the handlers; they leave through
+   exit_generated_code() when execution has to stop. */
+static void interpret_cold() {
+    while (pcpu->pc < program_size) {
+        if (!decoded_cache[pcpu->pc].length)
+            decoded_cache[pcpu->pc] = decode_at_address(pcpu->pmem,
+                                                        program_size, pcpu->pc);
+        decode_t decoded = decoded_cache[pcpu->pc];
+        bool taken = false;
+        switch (decoded.opcode) {
+        case Instr_JE:
+            taken = pop(pcpu) == 0;
+            break;
+        case Instr_JNE:
+            taken = pop(pcpu) != 0;
+            break;
+        case Instr_Jump:
+            taken = true;
+            break;
+        default:
+            service_routines[decoded.opcode](decoded.immediate);
+            continue;
+        }
+        if (taken)
+            pcpu->pc += decoded.immediate;
+        ADVANCE_PC(decoded.length);
+        if (!taken || pcpu->pc >= program_size)
+            continue;
+#ifdef BACKGROUND_COMPILE
+        if (entrypoint(pcpu->pc) || flush_pending())
+            return;
+        if (warm_up(pcpu->pc))
+            request_translation(pcpu->pc);
+#else
+        if (entrypoint(pcpu->pc) || warm_up(pcpu->pc))
+            return;
+#endif
+    }
+}
+#endif
+
+#ifdef BACKGROUND_COMPILE
+static void* compile_hot_code(void *arg) {
+    const Instr_t *prog = arg;
+    while (true) {
+        while (sem_wait(&queue_items) && errno == EINTR)
+            continue;
+        if (__atomic_load_n(&compiler_quit, __ATOMIC_ACQUIRE))
+            return NULL;
+        uint32_t head = queue_head;
+        uint32_t pc = compile_queue[head % COMPILE_QUEUE_SIZE];
+        __atomic_store_n(&queue_head, head + 1, __ATOMIC_RELEASE);
+
+        pthread_mutex_lock(&translator_lock);
+        /* While a flush is pending the cache stays full, the request
+           is repeated after the flush */
+        if (!flush_pending() && !entrypoints[pc]
+            && !translate_block(prog, pc))
+            __atomic_store_n(&flush_requested, true, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&translator_lock);
+    }
+}
+
+static void start_compiler(const Instr_t *prog) {
+    if (sem_init(&queue_items, 0, 0)
+        || pthread_create(&compiler, NULL, compile_hot_code, (void*)prog)) {
+        fprintf(stderr, "Cannot start compiler thread\n");
+        exit(2);
+    }
+}
+
+static void stop_compiler() {
+    __atomic_store_n(&compiler_quit, true, __ATOMIC_RELEASE);
+    sem_post(&queue_items);
+    pthread_join(compiler, NULL);
+}
+
+/* Called by the executing thread outside of generated code */
+static void flush_if_requested() {
+    if (!flush_pending())
+        return;
+    pthread_mutex_lock(&translator_lock);
+    flush_translations();
+    memset(requested, 0, program_size * sizeof(bool));
+    __atomic_store_n(&flush_requested, false, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&translator_lock);
+}
+#endif
+
 int main(int argc, char **argv) {
-    steplimit = parse_args(argc, argv);
+    ExtraOptions = Option_CacheDir;
+    const uint64_t steplimit = parse_args(argc, argv);
     cpu_t cpu = init_cpu();
+    cpu.steplimit = steplimit;
 
     pcpu = &cpu;
-
-    /* Code section is protected from writes by default, un-protect it */
-    if (mprotect(gen_code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC)) {
-        perror("mprotect");
+    stack_base = cpu.stack;
+    program_size = cpu.program_size;
+    stack_capacity = cpu.stack_capacity;
+    stack_verified = verify_stack_depth(cpu.pmem, program_size,
+                                        stack_capacity);
+
+    entrypoints = calloc(program_size, sizeof(void*));
+    bool allocated = entrypoints;
+#ifdef TIER_UP_THRESHOLD
+    heat = calloc(program_size, sizeof(uint32_t));
+    decoded_cache = calloc(program_size, sizeof(decode_t));
+    allocated = allocated && heat && decoded_cache;
+#endif
+#ifdef BACKGROUND_COMPILE
+    requested = calloc(program_size, sizeof(bool));
+    allocated = allocated && requested;
+#endif
+    if (!allocated) {
+        fprintf(stderr, "Failed to allocate memory for program maps.\n");
         exit(2);
     }
-    /* Pre-populate resulting code buffer with INT3 (machine code 0xCC).
-       This will help to catch jumps to wrong locations */
-    memset(gen_code, 0xcc, JIT_CODE_SIZE);
-    void* entrypoints[PROGRAM_SIZE] = {0}; /* a map of guest PCs to capsules */
 
-    translate_program(cpu.pmem, gen_code, entrypoints, PROGRAM_SIZE);
+    init_arena();
+    init_trampolines();
+    flush_translations();
+    if (CacheDir)
+        load_translations(cpu.pmem);
+#ifdef BACKGROUND_COMPILE
+    start_compiler(cpu.pmem);
+#endif
 
     setjmp(return_buf); /* Will get here from generated code. */
 
     while (cpu.state == Cpu_Running && cpu.steps < steplimit) {
-        if (cpu.pc > PROGRAM_SIZE) {
+        if (cpu.pc >= program_size) {
             cpu.state = Cpu_Break;
             break;
         }
-        enter_generated_code(entrypoints[cpu.pc]); /* Will not return */
+#ifdef BACKGROUND_COMPILE
+        flush_if_requested();
+        void *entry = entrypoint(cpu.pc);
+        if (!entry) {
+            /* Only the compiler thread translates */
+            interpret_cold();
+            continue;
+        }
+#else
+        void *entry = entrypoint(cpu.pc);
+#endif
+#ifdef TIER_UP_THRESHOLD
+        if (!entry && heat[cpu.pc] < TIER_UP_THRESHOLD) {
+            interpret_cold();
+            continue;
+        }
+#endif
+        /* Translate code on first reach */
+        if (!entry)
+            entry = translate_block(cpu.pmem, cpu.pc);
+        if (!entry) {
+            flush_translations();
+            entry = translate_block(cpu.pmem, cpu.pc);
+        }
+        assert(entry);
+        enter_generated_code(entry); /* Will not return */
     }
 
+#ifdef BACKGROUND_COMPILE
+    stop_compiler();
+#endif
+    if (CacheDir)
+        save_translations(cpu.pmem);
     assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
     /* Print CPU state */
     printf("CPU executed %ld steps. End state \"%s\".\n",
@@ -456,7 +1523,16 @@ int main(int argc, char **argv) {
     }
     printf("%s\n", cpu.sp == -1? "(empty)": "");
 
-    free(LoadedProgram);
+#ifdef BACKGROUND_COMPILE
+    free(requested);
+#endif
+#ifdef TIER_UP_THRESHOLD
+    free(decoded_cache);
+    free(heat);
+#endif
+    free(entrypoints);
+    free(cpu.stack);
+    unload_program();
 
     return cpu.state == Cpu_Halted ||
            (cpu.state == Cpu_Running &&